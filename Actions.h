@@ -14,7 +14,12 @@ class Actions;
 #include "Keys.h"
 #include "CBUS.h"
 #include "CBUSConfig.h"
+#include "CBUSNode.h"
+#include "CBUSJournal.h"
 #include "AudioBoard.h"
+#include "LatencyTrace.h"
+
+extern LatencyTracer latency;
 
 #define ACTIVITY_IDLE -1
 
@@ -24,11 +29,15 @@ class Actions {
   AudioBoard * audio;
   CBUS * cbus;
   CBUSConfig * config;
+  CBUSNode * node;
+  CBUSJournal * journal;
   Dispatcher<Actions> * dispatcher;
   Keys * keys;
   void (*keepAlive)();
 
-  int runningCount;
+  int activityTimer;                  // Dispatcher one-shot timer ending the push button activity
+  int wasPlaying;
+  unsigned long lastReceivedFrames;   // To tell if the bus was quiet since the last journal check
   
 public:
 
@@ -39,11 +48,15 @@ public:
               keepAlive(nullptr), 
               cbus(nullptr), 
               config(nullptr), 
-              runningCount(ACTIVITY_IDLE){
+              node(nullptr), 
+              journal(nullptr), 
+              activityTimer(ACTIVITY_IDLE),
+              wasPlaying(0),
+              lastReceivedFrames(0){
   };
 
   // Initialize all static members
-  void init(Relay * r, AudioBoard * a, CBUS * cbus, CBUSConfig * c, Keys * k, Dispatcher<Actions> * d, void (*wdtCb)()){
+  void init(Relay * r, AudioBoard * a, CBUS * cbus, CBUSConfig * c, CBUSNode * n, CBUSJournal * j, Keys * k, Dispatcher<Actions> * d, void (*wdtCb)()){
     this->audio = a;
     this->relay = r;
     this->keys = k;
@@ -51,83 +64,172 @@ public:
     this->keepAlive = wdtCb;
     this->cbus = cbus;
     this->config = c;
+    this->node = n;
+    this->journal = j;
   };
 
-  void checkPushButtonActivity(){
-    if(runningCount>0){
-      trace.log("Actions", "checkPushButtonActivity. Activity running", runningCount);
-      runningCount--; //Decrement 1 and keep going
-      return;
-    }
+  // One-shot timer armed by checkKeyAction
+  void endPushButtonActivity(){
+    LOG_TRACE(Actions, "endPushButtonActivity", "Activity completed");
+    relay->off();
+    audio->stopPlaying();
+    activityTimer = ACTIVITY_IDLE;
+    produceEvent(config->getKeyEventNumber(), 0);
+  }
 
-    if(runningCount==0){
-      //Last tick -> disable activity
-      trace.log("Actions", "checkPushButtonActivity", "Activity completed");
-      relay->off();
-      audio->stopPlaying();
-      runningCount = ACTIVITY_IDLE;
+  // Tells the layout when a track starts and ends
+  void checkAudioActivity(){
+    int playing = audio->isPlaying() ? 1 : 0;
+    if(playing == wasPlaying){
       return;
     }
-  }
+    wasPlaying = playing;
+    LOG_TRACE(Actions, "checkAudioActivity", playing ? "Track started" : "Track ended");
+    produceEvent(config->getTrackEventNumber(), playing);
+  };
 
   void checkKeyAction(){
     if(keys->isOn()){
-      trace.log("Actions", "checkKeysAction", "Key pressed");
-      if(runningCount == ACTIVITY_IDLE){  //Action is IDLE, start activity
-        trace.log("Actions", "checkKeysAction", "Activating relay & default audio");
+      LOG_TRACE(Actions, "checkKeysAction", "Key pressed");
+      if(activityTimer == ACTIVITY_IDLE){  //Action is IDLE, start activity
+        activityTimer = dispatcher->arm(&Actions::endPushButtonActivity, ACTIVITY_DURATION);
+        if(activityTimer < 0){
+          activityTimer = ACTIVITY_IDLE;
+          return;
+        }
+        LOG_TRACE(Actions, "checkKeysAction", "Activating relay & default audio");
+        latency.begin(LATENCY_PATH_BUTTON, keys->getEdgeAt());
+        latency.mark(LATENCY_PICKUP);
         relay->on();
-        audio->play(config->getDefaultAudio());
-        runningCount = SEC_TO_TICKS(15);
+        const CBUSMapping * track = config->getDefaultMapping();
+        latency.mark(LATENCY_LOOKUP);
+        audio->play(config->getTrackHandle(track), config->getTrackPriority(track));
+        latency.end();
+        produceEvent(config->getKeyEventNumber(), 1);
       }
       return;
     }
   };
 
+  // Drains all frames queued by the CAN interrupt since the last run
   void checkCBUSCommandAction(){
-    int nodeNumber, eventNumber;
-    auto cmd = cbus->getEvent(&nodeNumber, &eventNumber);
+    if(!cbus->available()){
+      LOG_TRACE(Actions, "No command received");
+      return;
+    }
 
-    if(!cmd){
-      trace.log("Actions", "No command received");
+    //Bounded, in case the ISR keeps filling the queue while we process
+    for(unsigned int i = 0; i < cbus->getQueueCapacity() && cbus->available(); i++){
+      processCBUSEvent();
+    }
+  };
+
+  // Samples the CAN controller error state. Bus state changes go to the error log, so they survive a reset
+  void checkCBUSHealth(){
+    if(!cbus->sampleHealth()){
       return;
     }
+    const char * states[] = {"Error active", "Error warning", "Error passive", "Bus off"};
+    const CBUSHealth * h = cbus->getHealth();
+    LOG_ERROR(Actions, "CBUS state changed: ", states[h->state]);
+    LOG_ERROR(Actions, "CBUS TEC: ", h->tec);
+    LOG_ERROR(Actions, "CBUS REC: ", h->rec);
+  };
 
-    if(nodeNumber != config->getNodeNumber()){
-      trace.log("Actions", "Ignoring Event from Node: ", nodeNumber);
+  // Writes journal entries to SD in batches. Only when no frames arrived since the last check: SD writes are slow
+  void checkCBUSJournal(){
+    unsigned long received = cbus->getReceivedFrames();
+    int idle = received == lastReceivedFrames && !cbus->available();
+    lastReceivedFrames = received;
+    if(!idle || !journal->isFlushDue()){
       return;
     }
-    
-    //Check if event number is mapped to the relay
-    if(eventNumber == config->getRelayEventNumber()){
-      if(cmd == ACON){
-        trace.log("Actions", "Event for activation of relay received");
-        relay->on();
-      } else {
-        if(cmd == ACOF){
-          trace.log("Actions", "Event for deactivation of relay received");
-          relay->off();
+    int written = journal->flush();
+    LOG_TRACE(Actions, "Journal entries written: ", written);
+  };
+
+private:
+
+  /*
+    Queues ACON/ACOF for eventNumber with the module's own node number, not the one it listens to: consumers
+    taught that node's events must not react. Never blocks, the frame is sent from the main loop
+  */
+  void produceEvent(int eventNumber, int on){
+    if(eventNumber <= 0 || config->getModuleNodeNumber() <= 0){
+      return;
+    }
+    if(!cbus->sendEvent(on ? ACON : ACOF, config->getModuleNodeNumber(), eventNumber)){
+      LOG_TRACE(Actions, "Could not queue produced event: ", eventNumber);
+    }
+  };
+
+  // Returns the CBUS_JOURNAL_* bit for the action run
+  byte runMapping(const CBUSMapping & mapping, int on){
+    switch(mapping.action){
+      case CBUS_ACTION_RELAY:
+        LOG_TRACE(Actions, "Event for relay received: ", on ? "activation" : "deactivation");
+        on ? relay->on() : relay->off();
+        return CBUS_JOURNAL_RELAY;
+
+      case CBUS_ACTION_AUDIO:
+        LOG_TRACE(Actions, "Event for audio received: ", on ? "activation" : "deactivation");
+        if(on){
+          audio->play(config->getTrackHandle(&mapping), config->getTrackPriority(&mapping));
+        } else {
+          audio->stopTrack(config->getTrackHandle(&mapping));
         }
+        return CBUS_JOURNAL_AUDIO;
+    }
+    return CBUS_JOURNAL_NONE;
+  };
+
+  void processCBUSEvent(){
+    CBUSEvent event;
+    if(!cbus->getEvent(&event)){
+      return;
+    }
+
+    if(event.type == CBUS_EVENT_COMMAND){
+      if(event.source != CBUS_SOURCE_DRY_RUN){
+        node->handle(event);
       }
+      journal->record(event, CBUS_JOURNAL_COMMAND, micros() - event.timestamp);
+      return;
     }
 
-    //Check if event number is mapped to any audio file
-    char * track = config->getAudioByEventNumber(eventNumber);
-    if(track){
-      if(cmd == ACON){
-        trace.log("Actions", "Event for activation of audio received");
-        audio->play(track);
-        return;
-      } else {
-        if(cmd == ACOF){
-          trace.log("Actions", "Event for deactivation of audio received");
-          audio->stopPlaying();
-          return;
-        }
+    //Short events carry no node number: they are mapped like our own long events
+    int nodeNumber = event.type == CBUS_EVENT_LONG ? event.nodeNumber : config->getNodeNumber();
+    int eventNumber = event.eventNumber;
+
+    if(event.source != CBUS_SOURCE_DRY_RUN){
+      latency.begin(LATENCY_PATH_CAN, event.timestamp);
+      latency.mark(LATENCY_PICKUP);
+    }
+    const CBUSMapping * mappings;
+    int count = config->findMappings(nodeNumber, eventNumber, &mappings);
+    latency.mark(LATENCY_LOOKUP);
+    byte actions = CBUS_JOURNAL_NONE;
+    for(int i = 0; i < count; i++){
+      if(event.source == CBUS_SOURCE_DRY_RUN){
+        actions |= mappings[i].action == CBUS_ACTION_RELAY ? CBUS_JOURNAL_RELAY : CBUS_JOURNAL_AUDIO;
+        continue;
       }
+      actions |= runMapping(mappings[i], event.on);
+    }
+    latency.end();
+    journal->record(event, actions, micros() - event.timestamp);
+
+    if(count){
+      return;
+    }
+
+    if(nodeNumber != config->getNodeNumber()){
+      LOG_TRACE(Actions, "Ignoring Event from Node: ", nodeNumber);
+      return;
     }
 
     // The event comes from a recognized node, but it is not mapped to any action here
-    trace.log("Actions", "Unmapped event: ", eventNumber);
+    LOG_TRACE(Actions, "Unmapped event: ", eventNumber);
     return;
   };
 };
@@ -6,12 +6,18 @@
 #include <Wire.h>
 #include <Adafruit_VS1053.h>
 
+#include "Defaults.h"
 #include "Logger.h"
 #include "WD.h"
+#include "LatencyTrace.h"
+#include "AudioFeeder.h"
+#include "AudioMixer.h"
+#include "AudioCatalog.h"
 
-extern ConsoleLogger trace;
-extern ConsoleLogger info;
+extern TraceLogger trace;
+extern InfoLogger info;
 extern FileLogger error;
+extern LatencyTracer latency;
 
 #define VS1053_RESET   -1     // VS1053 reset pin (not used!)
 #define VS1053_CS       6     // VS1053 chip select pin (output)
@@ -21,58 +27,470 @@ extern FileLogger error;
 
 enum AudioBoardInit { AUDIOBOARD_INIT_OK = 0, AUDIOBOARD_INIT_FAIL };
 
+// A sound bank clip: the first AUDIO_BANK_HEAD bytes of its audio data (after the ID3 tag), in RAM
+typedef struct {
+  int handle;                     // In the catalog
+  unsigned int length;            // Bytes in head
+  uint8_t head[AUDIO_BANK_HEAD];
+} AudioClip;
+
+// A play request waiting for the track playing to end
+typedef struct {
+  int handle;
+  int priority;
+  unsigned long at;               // millis() when queued
+} AudioRequest;
+
+typedef struct {
+  unsigned long requests;
+  unsigned long preempted;        // Tracks stopped by one of higher priority, that started
+  unsigned long queued;
+  unsigned long dropped;          // Lower priority, with AUDIO_QUEUE=0
+  unsigned long queueFull;        // Dropped: the queue was full of requests of the same or higher priority
+  unsigned long expired;          // Dropped: waited over AUDIO_QUEUE_MAX_AGE
+  unsigned long missing;          // Tracks not in the catalog
+  unsigned long preemptMin;       // uS from the decision to stop to the first byte of the new track
+  unsigned long preemptMax;
+  unsigned long long preemptTotal;
+} AudioQueueStats;
+
+/*
+  Tracks are played by handle: their index in the catalog built at init. Track names are resolved to
+  handles once (CBUSConfig::resolveTracks). play(const char *) looks the name up, for the CLI.
+*/
 class AudioBoard {
 
   Adafruit_VS1053_FilePlayer audioPlayer;   //Pinout: https://learn.adafruit.com/adafruit-music-maker-featherwing/pinouts
+  AudioFeeder feeder;
+  AudioMixer mixer;
+  AudioCatalog catalog;
+  int mixing;                     // The feeder is sending the mixer's stream
+  AudioClip bank[AUDIO_BANK_CLIPS];
+  int bankCount;
+
+  int playingHandle;
+  int playingPriority;
+  unsigned long fedAt;            // micros() when the first byte of the last track started went out
+  int queueing;                   // AUDIO_QUEUE: lower priority requests are queued (1) or dropped (0)
+  AudioRequest pending[AUDIO_QUEUE_SIZE];   // Highest priority first, in arrival order within a priority
+  int pendingCount;
+  AudioQueueStats stats;
+
+  // Reset playback, resync
+  void resync(){
+    audioPlayer.sciWrite(VS1053_REG_MODE, VS1053_MODE_SM_LINE1 | VS1053_MODE_SM_SDINEW | VS1053_MODE_SM_LAYER12);
+    audioPlayer.sciWrite(VS1053_REG_WRAMADDR, 0x1e29);
+    audioPlayer.sciWrite(VS1053_REG_WRAM, 0);
+  }
+
+  // endFillByte, the parameter the decoder wants after the end of a stream
+  uint8_t endFillByte(){
+    audioPlayer.sciWrite(VS1053_REG_WRAMADDR, 0x1e06);
+    return audioPlayer.sciRead(VS1053_REG_WRAM) & 0xFF;
+  }
+
+  // Stops the track, or the mixer and all its voices. The library cancels decoding (SM_CANCEL): the feeder has the file
+  void halt(){
+    feeder.stop();
+    if(mixing){
+      mixer.stop();
+      mixing = 0;
+    }
+    audioPlayer.stopPlaying();
+  }
+
+  int start(int handle, int priority){
+    const AudioTrack * track = catalog.get(handle);
+    LOG_TRACE(AudioBoard, "Playing track: ", track->name);
+    AudioClip * clip = findClip(handle);
+    if(!(clip ? startClip(clip, track) : startTrack(track))){
+      LOG_ERROR(AudioBoard, "Track could not be opened: ", track->name);
+      return 0;
+    }
+    playingHandle = handle;
+    playingPriority = priority;
+    return 1;
+  }
+
+  // Keeps pending sorted. When full, a request only gets in by pushing out one of lower priority
+  void enqueue(int handle, int priority){
+    int i = pendingCount;
+    while(i > 0 && pending[i - 1].priority < priority){
+      i--;
+    }
+    if(i == AUDIO_QUEUE_SIZE){
+      LOG_TRACE(AudioBoard, "Audio queue full. Dropped: ", catalog.get(handle)->name);
+      stats.queueFull++;
+      return;
+    }
+    if(pendingCount == AUDIO_QUEUE_SIZE){
+      stats.queueFull++;
+      pendingCount--;
+    }
+    memmove(&pending[i + 1], &pending[i], (pendingCount - i) * sizeof(AudioRequest));
+    pending[i].handle = handle;
+    pending[i].priority = priority;
+    pending[i].at = millis();
+    pendingCount++;
+    stats.queued++;
+    LOG_TRACE(AudioBoard, "Track queued: ", catalog.get(handle)->name);
+  }
+
+  AudioClip * findClip(int handle){
+    for(int i = 0; i < bankCount; i++){
+      if(bank[i].handle == handle){
+        return &bank[i];
+      }
+    }
+    return nullptr;
+  }
+
+  /*
+    Adafruit_VS1053_FilePlayer::startPlayingFile, step by step, so the latency tracer can stamp when the
+    file is open and when the first data goes to the VS1053. From there the feeder sends it (DREQ interrupt).
+    Where the audio starts (after the ID3 tag) comes from the catalog.
+  */
+  int startTrack(const AudioTrack * track){
+    resync();
+    latency.setSource(LATENCY_SOURCE_SD);
+
+    File file = SD.open(track->name);
+    if(!file){
+      return 0;
+    }
+    file.seek(track->dataStart);
+    latency.mark(LATENCY_OPEN);
+
+    audioPlayer.sciWrite(VS1053_REG_DECODETIME, 0x00);
+    audioPlayer.sciWrite(VS1053_REG_DECODETIME, 0x00);
+    feeder.start(file);
+    latency.mark(LATENCY_FEED);
+    fedAt = micros();
+    feeder.poll();
+    return 1;
+  }
+
+  /*
+    Sound bank clips start with no SD access: the head goes from RAM straight into the VS1053 FIFO, as much
+    as it takes (DREQ). Then the file is opened and positioned after what was sent, while the decoder plays
+    the FIFO (2 KB, over 100 mS of a 128 kbps mp3), and the feeder takes over from there.
+  */
+  int startClip(AudioClip * clip, const AudioTrack * track){
+    resync();
+    latency.setSource(LATENCY_SOURCE_BANK);
+    audioPlayer.sciWrite(VS1053_REG_DECODETIME, 0x00);
+    audioPlayer.sciWrite(VS1053_REG_DECODETIME, 0x00);
+
+    latency.mark(LATENCY_FEED);
+    fedAt = micros();
+    unsigned int sent = 0;
+    while(sent < clip->length && feeder.readyForData()){
+      unsigned int n = clip->length - sent;
+      if(n > AUDIO_CHUNK){
+        n = AUDIO_CHUNK;
+      }
+      if(!feeder.send(clip->head + sent, n)){
+        break;
+      }
+      sent += n;
+    }
+
+    File file = SD.open(track->name);
+    if(!file){
+      return 0;
+    }
+    file.seek(track->dataStart + sent);
+    feeder.start(file);
+    feeder.poll();
+    return 1;
+  }
+
+  // Adds the WAV to the mixer, starting its stream if it's the first voice
+  int mixTrack(const AudioTrack * track, int gain, int loop){
+    if(mixer.add(track->name, gain, loop) < 0){
+      return 0;
+    }
+    if(!mixing){
+      resync();
+      latency.setSource(LATENCY_SOURCE_SD);
+      audioPlayer.sciWrite(VS1053_REG_DECODETIME, 0x00);
+      audioPlayer.sciWrite(VS1053_REG_DECODETIME, 0x00);
+      feeder.start(&mixer);
+      mixing = 1;
+      playingHandle = -1;
+      playingPriority = 0;
+      feeder.poll();
+    }
+    LOG_TRACE(AudioBoard, "Mixing: ", track->name);
+    return 1;
+  }
   
 public:
  
-  AudioBoard() : audioPlayer(VS1053_RESET, VS1053_CS, VS1053_DCS, VS1053_DREQ, CARDCS){
+  AudioBoard() : audioPlayer(VS1053_RESET, VS1053_CS, VS1053_DCS, VS1053_DREQ, CARDCS), mixing(0), bankCount(0),
+                 playingHandle(-1), playingPriority(0), fedAt(0), queueing(0), pendingCount(0) {
+    resetStats();
   }
 
+  // Also builds the catalog of the audio files in the SD root
   int init(){
     auto ret = audioPlayer.begin();
     if(!ret){
-      error.log("AudioBoard", "Error initializing audio board");
+      LOG_ERROR(AudioBoard, "Error initializing audio board");
       return AUDIOBOARD_INIT_FAIL;
     }
-    trace.log("AudioBoard", "Board initialized");
-    audioPlayer.useInterrupt(VS1053_FILEPLAYER_PIN_INT);
+    LOG_TRACE(AudioBoard, "Board initialized");
     audioPlayer.setVolume(0, 0);  //MAX Volume
 
+    // Its own DREQ interrupt, instead of the library's (useInterrupt), which reads SD inside it
+    if(!feeder.init(VS1053_DCS, VS1053_DREQ)){
+      LOG_ERROR(AudioBoard, "No DMA channel for the audio feeder");
+      return AUDIOBOARD_INIT_FAIL;
+    }
+
     if(!SD.begin(CARDCS)) {
-      error.log("AudioBoard", "SD card initialization failed. Check a card is inserted.");
+      LOG_ERROR(AudioBoard, "SD card initialization failed. Check a card is inserted.");
       return AUDIOBOARD_INIT_FAIL;
     }
 
+    LOG_INFO(AudioBoard, "Audio files in the catalog: ", catalog.scan());
     return AUDIOBOARD_INIT_OK;
   }
 
-  void play(const char * track){
-  
-    if(audioPlayer.playingMusic){
-      trace.log("AudioBoard", "A track is already playing");
+  // Handle of track ({track}.mp3, or .wav if there's no mp3), or -1 if it's not on the SD card
+  int find(const char * track){
+    return catalog.find(track);
+  }
+
+  AudioCatalog * getCatalog(){
+    return &catalog;
+  }
+
+  // Adds track to the sound bank: reads the start of its audio data into RAM. After init (SD)
+  int preload(const char * track){
+    if(bankCount >= AUDIO_BANK_CLIPS){
+      LOG_ERROR(AudioBoard, "Sound bank full. Ignoring: ", track);
+      return 0;
+    }
+    AudioClip & clip = bank[bankCount];
+    clip.handle = catalog.find(track);
+    const AudioTrack * t = catalog.get(clip.handle);
+    if(!t){
+      LOG_ERROR(AudioBoard, "Sound bank track not found: ", track);
+      return 0;
+    }
+    File file = SD.open(t->name);
+    if(!file){
+      LOG_ERROR(AudioBoard, "Sound bank track could not be opened: ", t->name);
+      return 0;
+    }
+    file.seek(t->dataStart);
+    int r = file.read(clip.head, AUDIO_BANK_HEAD);
+    file.close();
+    if(r <= 0){
+      LOG_ERROR(AudioBoard, "Sound bank track could not be read: ", t->name);
+      return 0;
+    }
+    clip.length = r;
+    bankCount++;
+    LOG_TRACE(AudioBoard, "Sound bank track loaded: ", t->name);
+    return 1;
+  }
+
+  int getBankCount(){
+    return bankCount;
+  }
+
+  const AudioClip * getClip(int index){
+    if(index < 0 || index >= bankCount) return nullptr;
+    return &bank[index];
+  }
+
+  // Lower priority requests, while a track plays: 1 queues them, 0 drops them
+  void setQueueing(int queueing){
+    this->queueing = queueing;
+  }
+
+  /*
+    Plays track (a handle) now if nothing is playing, or if priority is higher than that of the track
+    playing, which is stopped. Otherwise the request is queued or dropped (setQueueing).
+    Stopping is immediate: decoding is cancelled and the FIFO discarded, so what bounds a preemption is
+    starting the new track (a sound bank clip sends its first byte before touching SD).
+  */
+  void play(int handle, int priority = 0){
+    latency.mark(LATENCY_PLAY);
+    stats.requests++;
+
+    const AudioTrack * track = catalog.get(handle);
+    if(!track){
+      LOG_TRACE(AudioBoard, "Track not on the SD card");
+      stats.missing++;
+      return;
+    }
+
+    if(!feeder.isPlaying()){
+      start(handle, priority);
       return;
     }
 
-    trace.log("AudioBoard", "Playing track: ", track);
+    // Layered over what the mixer plays, if there's a WAV of the track
+    if(mixing){
+      const AudioTrack * wav = track->format == AUDIO_FORMAT_WAV ? track : catalog.get(track->twin);
+      if(wav && mixTrack(wav, MIX_GAIN_UNITY, 0)){
+        return;
+      }
+    }
 
-    char audioFile[15];     // {track}.mp3
-    snprintf(audioFile, sizeof(audioFile), "%s.mp3", track);
-    audioPlayer.startPlayingFile(audioFile);
+    if(priority > playingPriority){
+      LOG_TRACE(AudioBoard, "Preempting track: ", getPlaying());
+      unsigned long decided = micros();
+      halt();
+      if(start(handle, priority)){
+        stats.preempted++;
+        unsigned long elapsed = fedAt - decided;
+        stats.preemptTotal += elapsed;
+        if(elapsed > stats.preemptMax){
+          stats.preemptMax = elapsed;
+        }
+        if(elapsed < stats.preemptMin){
+          stats.preemptMin = elapsed;
+        }
+      }
+      return;
+    }
+
+    if(!queueing){
+      LOG_TRACE(AudioBoard, "A track of the same or higher priority is playing. Dropped: ", track->name);
+      stats.dropped++;
+      return;
+    }
+    enqueue(handle, priority);
+  }
+
+  // Looks track up in the catalog first. For the CLI: mappings are resolved when the configuration is loaded
+  void play(const char * track, int priority = 0){
+    play(catalog.find(track), priority);
+  }
+
+  // Feeds the VS1053, and starts the next request queued when a track ends. Main loop, every pass
+  void poll(){
+    feeder.poll();
+    if(feeder.needsEndFill()){
+      feeder.endFill(endFillByte());
+    }
+    // The mixer stream is a WAV of unknown length: the VS1053 waits for more until it's cancelled. The end fill
+    // has pushed the last samples out of the FIFO by now, so only fill is cut
+    if(mixing && !feeder.isPlaying()){
+      halt();
+    }
+    while(!feeder.isPlaying() && pendingCount){
+      AudioRequest next = pending[0];
+      pendingCount--;
+      memmove(&pending[0], &pending[1], pendingCount * sizeof(AudioRequest));
+      if(millis() - next.at > AUDIO_QUEUE_MAX_AGE){
+        LOG_TRACE(AudioBoard, "Queued request expired: ", catalog.get(next.handle)->name);
+        stats.expired++;
+        continue;
+      }
+      start(next.handle, next.priority);
+    }
+  }
+
+  int getPendingCount(){
+    return pendingCount;
+  }
+
+  const AudioRequest * getPending(int index){
+    if(index < 0 || index >= pendingCount) return nullptr;
+    return &pending[index];
+  }
+
+  // File name of the track playing, "MIXER", or nullptr
+  const char * getPlaying(){
+    if(!feeder.isPlaying()){
+      return nullptr;
+    }
+    return mixing ? "MIXER" : catalog.get(playingHandle)->name;
+  }
+
+  int getPlayingPriority(){
+    return playingPriority;
+  }
+
+  const AudioQueueStats & getStats(){
+    return stats;
+  }
+
+  void resetStats(){
+    memset(&stats, 0, sizeof(stats));
+    stats.preemptMin = 0xFFFFFFFF;
   }
 
   int isPlaying(){
-    return audioPlayer.playingMusic;
+    return feeder.isPlaying();
+  }
+
+  /*
+    Mixes {track}.wav with gain (Q8, MIX_GAIN_UNITY), looping or not. The first voice starts the mixer
+    stream, with priority 0: play() requests of higher priority preempt it, the rest are mixed in when they
+    have a WAV. Returns 0 if an mp3 is playing, or the WAV is missing or has the wrong format.
+  */
+  int mix(const char * track, int gain, int loop){
+    if(feeder.isPlaying() && !mixing){
+      LOG_TRACE(AudioBoard, "A track is playing. Not mixed: ", track);
+      return 0;
+    }
+    const AudioTrack * wav = catalog.get(catalog.find(track, AUDIO_FORMAT_WAV));
+    return wav && mixTrack(wav, gain, loop);
+  }
+
+  int isMixing(){
+    return mixing;
   }
 
+  AudioMixer * getMixer(){
+    return &mixer;
+  }
+
+  // Also drops the requests queued
   void stopPlaying(){
-    trace.log("AudioBoard", "Stop playing");
-    audioPlayer.stopPlaying();
+    LOG_TRACE(AudioBoard, "Stop playing");
+    pendingCount = 0;
+    halt();
+  }
+
+  // Stops track (a handle) if it's playing, and drops its queued requests. Requests for other tracks go on
+  void stopTrack(int handle){
+    const AudioTrack * track = catalog.get(handle);
+    if(!track){
+      return;
+    }
+    int j = 0;
+    for(int i = 0; i < pendingCount; i++){
+      if(pending[i].handle != handle){
+        pending[j++] = pending[i];
+      }
+    }
+    pendingCount = j;
+    if(mixing){
+      const AudioTrack * wav = track->format == AUDIO_FORMAT_WAV ? track : catalog.get(track->twin);
+      if(wav){
+        mixer.remove(wav->name);
+      }
+      return;
+    }
+    if(feeder.isPlaying() && playingHandle == handle){
+      LOG_TRACE(AudioBoard, "Stop playing: ", track->name);
+      halt();
+    }
+  }
+
+  AudioFeeder * getFeeder(){
+    return &feeder;
   }
 
   void test(){
-    trace.log("AudioBoard", "Testing board");
+    LOG_TRACE(AudioBoard, "Testing board");
     audioPlayer.setVolume(1,1);
     audioPlayer.sineTest(0x44, 500);
     return;
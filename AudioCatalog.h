@@ -0,0 +1,226 @@
+#ifndef AUDIO_CATALOG_H
+#define AUDIO_CATALOG_H
+
+#include <Arduino.h>
+#include <SD.h>
+
+#include "Defaults.h"
+#include "Logger.h"
+
+enum AudioFormat { AUDIO_FORMAT_MP3 = 0, AUDIO_FORMAT_WAV };
+
+// An audio file in the SD root
+typedef struct {
+  char name[13];                  // 8.3, as in the directory
+  byte format;                    // AudioFormat
+  int16_t twin;                   // The same track in the other format, or -1
+  unsigned long size;
+  unsigned long dataStart;        // MP3: first byte after the ID3 tag. WAV: 0, the VS1053 reads the header
+  unsigned long rate;             // Hz. 0 if unknown
+  unsigned int kbps;              // MP3: average bitrate
+  unsigned long duration;         // mS. 0 if unknown
+} AudioTrack;
+
+/*
+  The MP3 and WAV files in the SD root, inspected once (AudioBoard::init): size, where the audio starts,
+  format and duration. Sorted by name, so a track name resolves to a handle (index) with a binary search.
+  Handles are resolved when the configuration is loaded or changed (CBUSConfig::resolveTracks), not per play.
+  MP3 durations come from the Xing/Info frame count when there is one, from the first frame's bitrate
+  otherwise (exact for CBR files).
+*/
+class AudioCatalog {
+
+  AudioTrack tracks[AUDIO_CATALOG_SIZE];
+  int count;
+  int skipped;                    // Audio files that didn't fit
+
+  static uint32_t le32(const uint8_t * p){
+    return p[0] | (p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+  };
+
+  static uint32_t be32(const uint8_t * p){
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | (p[2] << 8) | p[3];
+  };
+
+  static int formatOf(const char * name){
+    const char * dot = strrchr(name, '.');
+    if(!dot){
+      return -1;
+    }
+    if(strcasecmp(dot, ".MP3") == 0){
+      return AUDIO_FORMAT_MP3;
+    }
+    if(strcasecmp(dot, ".WAV") == 0){
+      return AUDIO_FORMAT_WAV;
+    }
+    return -1;
+  };
+
+  // ID3v2 tag size, then the first frame header (and the Xing/Info header in it, for VBR files)
+  void inspectMp3(File & file, AudioTrack & t){
+    static const uint16_t kbps1[] = { 0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 0 };
+    static const uint16_t kbps2[] = { 0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160, 0 };
+    static const uint16_t rates[] = { 44100, 48000, 32000, 0 };
+    uint8_t b[128];
+
+    if(file.read(b, 10) == 10 && memcmp(b, "ID3", 3) == 0){
+      t.dataStart = 10 + (((uint32_t)(b[6] & 0x7F) << 21) | ((uint32_t)(b[7] & 0x7F) << 14) | ((b[8] & 0x7F) << 7) | (b[9] & 0x7F));
+      if(b[5] & 0x10){
+        t.dataStart += 10;    // Footer
+      }
+    }
+    file.seek(t.dataStart);
+    int n = file.read(b, sizeof(b));
+    int i = 0;
+    for(; i + 4 <= n && !(b[i] == 0xFF && (b[i + 1] & 0xE6) == 0xE2 && (b[i + 2] >> 4) != 0x0F); i++);
+    if(i + 4 > n){
+      return;
+    }
+
+    int version = (b[i + 1] >> 3) & 3;     // 3: MPEG1, 2: MPEG2, 0: MPEG2.5
+    int mpeg1 = version == 3;
+    t.kbps = (mpeg1 ? kbps1 : kbps2)[b[i + 2] >> 4];
+    t.rate = rates[(b[i + 2] >> 2) & 3] >> (mpeg1 ? 0 : (version == 2 ? 1 : 2));
+    if(!t.kbps || !t.rate){
+      return;
+    }
+
+    int mono = (b[i + 3] >> 6) == 3;
+    int xing = i + 4 + (mpeg1 ? (mono ? 17 : 32) : (mono ? 9 : 17));
+    if(xing + 12 <= n && (memcmp(b + xing, "Xing", 4) == 0 || memcmp(b + xing, "Info", 4) == 0) && (b[xing + 7] & 1)){
+      unsigned long frames = be32(b + xing + 8);
+      unsigned long samples = mpeg1 ? 1152 : 576;
+      t.duration = (unsigned long)((unsigned long long)frames * samples * 1000 / t.rate);
+      if(t.duration){
+        t.kbps = (unsigned long)((unsigned long long)(t.size - t.dataStart) * 8 / t.duration);
+      }
+      return;
+    }
+    t.duration = (t.size - t.dataStart) * 8 / t.kbps;
+  };
+
+  void inspectWav(File & file, AudioTrack & t){
+    uint8_t b[16];
+    if(file.read(b, 12) != 12 || memcmp(b, "RIFF", 4) || memcmp(b + 8, "WAVE", 4)){
+      return;
+    }
+    unsigned long byteRate = 0;
+    while(file.read(b, 8) == 8){
+      uint32_t size = le32(b + 4);
+      uint32_t next = file.position() + size + (size & 1);
+      if(memcmp(b, "fmt ", 4) == 0 && size >= 16 && file.read(b, 16) == 16){
+        t.rate = le32(b + 4);
+        byteRate = le32(b + 8);
+      } else if(memcmp(b, "data", 4) == 0){
+        if(byteRate){
+          t.duration = (unsigned long)((unsigned long long)size * 1000 / byteRate);
+        }
+        return;
+      }
+      file.seek(next);
+    }
+  };
+
+public:
+
+  AudioCatalog() : count(0), skipped(0) {
+  };
+
+  // Inspects the audio files in the SD root. Returns how many are in the catalog
+  int scan(){
+    count = 0;
+    skipped = 0;
+    File root = SD.open("/");
+    if(!root){
+      return 0;
+    }
+    for(File entry = root.openNextFile(); entry; entry = root.openNextFile()){
+      int format = entry.isDirectory() ? -1 : formatOf(entry.name());
+      if(format < 0){
+        entry.close();
+        continue;
+      }
+      if(count == AUDIO_CATALOG_SIZE){
+        skipped++;
+        entry.close();
+        continue;
+      }
+
+      AudioTrack t;
+      memset(&t, 0, sizeof(t));
+      strncpy(t.name, entry.name(), sizeof(t.name) - 1);
+      t.format = format;
+      t.twin = -1;
+      t.size = entry.size();
+      if(format == AUDIO_FORMAT_MP3){
+        inspectMp3(entry, t);
+      } else {
+        inspectWav(entry, t);
+      }
+      entry.close();
+
+      // Insertion sort by name
+      int i = count++;
+      for(; i > 0 && strcasecmp(tracks[i - 1].name, t.name) > 0; i--){
+        tracks[i] = tracks[i - 1];
+      }
+      tracks[i] = t;
+    }
+    root.close();
+
+    // Same name, other extension: next to each other ("A.MP3" < "A.WAV")
+    for(int i = 0; i + 1 < count; i++){
+      const char * dot = strrchr(tracks[i].name, '.');
+      int stem = dot - tracks[i].name;
+      if(strncasecmp(tracks[i].name, tracks[i + 1].name, stem + 1) == 0){
+        tracks[i].twin = i + 1;
+        tracks[i + 1].twin = i;
+      }
+    }
+    if(skipped){
+      LOG_ERROR(AudioBoard, "Audio catalog full. Files left out: ", skipped);
+    }
+    return count;
+  };
+
+  // Handle of {track}.MP3 or {track}.WAV (format), or -1
+  int find(const char * track, int format){
+    char name[13];
+    snprintf(name, sizeof(name), "%s.%s", track, format == AUDIO_FORMAT_MP3 ? "MP3" : "WAV");
+    int lo = 0, hi = count;
+    while(lo < hi){
+      int mid = (lo + hi) >> 1;
+      int c = strcasecmp(tracks[mid].name, name);
+      if(c == 0){
+        return mid;
+      }
+      if(c < 0){
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    return -1;
+  };
+
+  // The MP3 of track, or its WAV if there's no MP3
+  int find(const char * track){
+    int handle = find(track, AUDIO_FORMAT_MP3);
+    return handle >= 0 ? handle : find(track, AUDIO_FORMAT_WAV);
+  };
+
+  const AudioTrack * get(int handle){
+    if(handle < 0 || handle >= count) return nullptr;
+    return &tracks[handle];
+  };
+
+  int getCount(){
+    return count;
+  };
+
+  int getSkipped(){
+    return skipped;
+  };
+};
+
+#endif
@@ -0,0 +1,329 @@
+#ifndef AUDIO_FEEDER_H
+#define AUDIO_FEEDER_H
+
+#include <Arduino.h>
+#include <SPI.h>
+#include <SD.h>
+#include <Adafruit_ZeroDMA.h>
+
+#include "Defaults.h"
+
+#define AUDIO_SPI_CLOCK     8000000             // VS1053 SDI. The library uses the same
+#define AUDIO_SPI_SERCOM    SERCOM4             // Feather M0 SPI (MOSI, SCK)
+#define AUDIO_SPI_DMAC_TX   SERCOM4_DMAC_ID_TX
+#define AUDIO_CHUNK         32                  // Bytes the VS1053 takes for sure when DREQ is high
+#define AUDIO_FIFO          2048                // VS1053 SDI FIFO
+#define AUDIO_END_FILL      (AUDIO_FIFO + 4)    // endFillByte bytes after a track, so its end is decoded (VS1053 datasheet)
+#define AUDIO_DMA_TIMEOUT   1000                // uS. A chunk takes 40 at 8 MHz
+
+typedef struct {
+  unsigned long chunks;
+  unsigned long bytes;
+  unsigned long reads;              // SD reads
+  unsigned long underruns;          // DREQ asked for data and the buffers were empty, before the end of the track
+  unsigned long dmaErrors;          // Chunks that timed out
+  unsigned long long feedMicros;    // CPU time sending chunks (DREQ interrupt)
+  unsigned long long readMicros;    // CPU time reading SD (main loop)
+  unsigned long long playMicros;    // Time playing (start to end of file, or stop)
+  unsigned long maxPoll;            // uS
+} AudioFeederStats;
+
+// A stream generated in RAM (AudioMixer), instead of a file
+class AudioSource {
+public:
+  virtual int read(uint8_t * buffer, unsigned int n) = 0;   // Returns the bytes written, 0 at the end
+};
+
+/*
+  Feeds the VS1053 from its DREQ interrupt, out of RAM. The main loop (poll) reads the track ahead in
+  AUDIO_FEED_BLOCK reads, aligned to SD blocks, into AUDIO_FEED_BUFFERS buffers; the interrupt sends them in
+  AUDIO_CHUNK chunks by DMA (SERCOM TX trigger), for as long as DREQ is high. The library's interrupt read
+  32 bytes from SD per chunk instead. The buffers and the VS1053 FIFO cover main loop stalls: 4 KB, about
+  90 mS of 22050 Hz WAV and 250 mS of a 128 kbps mp3.
+  SD, the VS1053 and the MCP2515 share one SPI bus, so a chunk can't go out while the loop reads SD: the
+  interrupt waits for each chunk (40 uS at 8 MHz) before it releases the bus. SPI.usingInterrupt masks DREQ
+  while the loop (SD) or CAN_INT hold the bus, and each chunk's transaction masks CAN_INT.
+  At the end of a track the owner reads the decoder's endFillByte and passes it to endFill: AUDIO_END_FILL of
+  it push the last bytes of the track out of the FIFO, and then the track is done. Cancelling only cuts fill.
+*/
+class AudioFeeder {
+
+  Adafruit_ZeroDMA dma;
+  DmacDescriptor * descriptor;
+  static AudioFeeder * instance;    // For the DREQ interrupt
+
+  int dcs;
+  int dreq;
+  File file;
+  AudioSource * source;             // Instead of file
+  volatile int playing;
+  volatile int ended;               // The track or source has no more data. Waiting for endFill
+  volatile int eof;                 // Nothing left to read (end fill queued too). Playing until the buffers are sent
+  unsigned int fillLeft;            // End fill bytes not queued yet
+  uint8_t fillByte;
+  volatile int feeding;             // feed() runs from the interrupt and from poll()
+  int starving;
+  uint8_t buffers[AUDIO_FEED_BUFFERS][AUDIO_FEED_BLOCK] __attribute__((aligned(4)));   // Sources write 16 bit samples
+  volatile unsigned int length[AUDIO_FEED_BUFFERS];   // Bytes in each buffer. 0: empty. Filled by poll, emptied by feed
+  volatile int current;             // Buffer being sent
+  unsigned int sent;                // Bytes of current sent
+  int filling;                      // Next buffer to read into
+  unsigned long started;            // micros() at start
+
+  AudioFeederStats stats;
+
+  static void onDreq(){
+    instance->feed();
+  };
+
+  // The channel disables itself when the descriptor is done. The DMAC interrupt can't run inside the DREQ one
+  int dmaActive(){
+    noInterrupts();
+    DMAC->CHID.reg = DMAC_CHID_ID(dma.getChannel());
+    int active = DMAC->CHCTRLA.bit.ENABLE;
+    interrupts();
+    return active;
+  };
+
+  // Reads into the empty buffers, in order. The first read ends at a block boundary, so the rest are whole blocks
+  void refill(){
+    while(!eof && !length[filling]){
+      if(ended){
+        if(!fillLeft){
+          return;         // endFill not called yet
+        }
+        unsigned int n = fillLeft < AUDIO_FEED_BLOCK ? fillLeft : AUDIO_FEED_BLOCK;
+        memset(buffers[filling], fillByte, n);
+        fillLeft -= n;
+        eof = !fillLeft;
+        length[filling] = n;
+        filling = (filling + 1) % AUDIO_FEED_BUFFERS;
+        continue;
+      }
+      unsigned long start = micros();
+      int r;
+      if(source){
+        r = source->read(buffers[filling], AUDIO_FEED_BLOCK);
+      } else {
+        unsigned int n = AUDIO_FEED_BLOCK - file.position() % 512;
+        r = file.read(buffers[filling], n);
+      }
+      stats.readMicros += micros() - start;
+      stats.reads++;
+      if(r <= 0){
+        ended = 1;
+        close();          // Playing until the buffers and the end fill are sent
+        return;
+      }
+      length[filling] = r;
+      filling = (filling + 1) % AUDIO_FEED_BUFFERS;
+    }
+  };
+
+  // Sends while DREQ is high. From the DREQ interrupt, and from poll: DREQ stays high if the interrupt found nothing to send
+  void feed(){
+    noInterrupts();
+    if(feeding || !playing){
+      interrupts();
+      return;
+    }
+    feeding = 1;
+    interrupts();
+
+    while(readyForData()){
+      if(!length[current]){
+        if(!ended && !starving){
+          stats.underruns++;
+        }
+        starving = 1;
+        break;
+      }
+      starving = 0;
+      unsigned int n = length[current] - sent;
+      if(n > AUDIO_CHUNK){
+        n = AUDIO_CHUNK;
+      }
+      if(!send(buffers[current] + sent, n)){
+        break;
+      }
+      sent += n;
+      if(sent == length[current]){
+        sent = 0;
+        length[current] = 0;
+        current = (current + 1) % AUDIO_FEED_BUFFERS;
+      }
+    }
+    feeding = 0;
+  };
+
+  int isDrained(){
+    for(int i = 0; i < AUDIO_FEED_BUFFERS; i++){
+      if(length[i]){
+        return 0;
+      }
+    }
+    return 1;
+  };
+
+  void close(){
+    if(file){
+      file.close();
+    }
+    source = nullptr;
+  };
+
+  void finish(){
+    playing = 0;
+    close();
+    stats.playMicros += micros() - started;
+  };
+
+public:
+
+  AudioFeeder() : descriptor(nullptr), dcs(-1), dreq(-1), source(nullptr), playing(0), ended(1), eof(1), fillLeft(0),
+                  fillByte(0), feeding(0), starving(0), current(0), sent(0), filling(0) {
+    resetStats();
+  };
+
+  // Pins are set up by Adafruit_VS1053::begin
+  int init(int dcs, int dreq){
+    this->dcs = dcs;
+    this->dreq = dreq;
+    if(dma.allocate() != DMA_STATUS_OK){
+      return 0;
+    }
+    dma.setTrigger(AUDIO_SPI_DMAC_TX);
+    dma.setAction(DMA_TRIGGER_ACTON_BEAT);
+    descriptor = dma.addDescriptor(buffers[0], (void *)(&AUDIO_SPI_SERCOM->SPI.DATA.reg), AUDIO_CHUNK, DMA_BEAT_SIZE_BYTE, true, false);
+    if(!descriptor){
+      return 0;
+    }
+    instance = this;
+    SPI.usingInterrupt(digitalPinToInterrupt(dreq));
+    attachInterrupt(digitalPinToInterrupt(dreq), onDreq, RISING);
+    return 1;
+  };
+
+  int readyForData(){
+    return digitalRead(dreq);
+  };
+
+  /*
+    Writes up to AUDIO_CHUNK bytes to the VS1053 SDI. Only when DREQ is high. Returns 0 if the DMA timed out.
+    What the SERCOM clocked in is dropped, so the next SPI.transfer doesn't read it.
+  */
+  int send(const uint8_t * data, unsigned int n){
+    unsigned long start = micros();
+    SPI.beginTransaction(SPISettings(AUDIO_SPI_CLOCK, MSBFIRST, SPI_MODE0));
+    digitalWrite(dcs, LOW);
+    dma.changeDescriptor(descriptor, (void *)data, nullptr, n);
+    dma.startJob();
+    while(dmaActive() && micros() - start < AUDIO_DMA_TIMEOUT);
+    int ok = !dmaActive();
+    if(!ok){
+      dma.abort();
+      stats.dmaErrors++;
+    }
+    while(!AUDIO_SPI_SERCOM->SPI.INTFLAG.bit.TXC && micros() - start < AUDIO_DMA_TIMEOUT);
+    while(AUDIO_SPI_SERCOM->SPI.INTFLAG.bit.RXC){
+      (void)AUDIO_SPI_SERCOM->SPI.DATA.reg;
+    }
+    AUDIO_SPI_SERCOM->SPI.STATUS.bit.BUFOVF = 1;
+    digitalWrite(dcs, HIGH);
+    SPI.endTransaction();
+
+    stats.chunks++;
+    stats.bytes += n;
+    stats.feedMicros += micros() - start;
+    return ok;
+  };
+
+  // Plays track from its current position. Fills the buffers: call poll() to start sending
+  void start(File track){
+    begin();
+    file = track;
+    refill();
+  };
+
+  void start(AudioSource * source){
+    begin();
+    this->source = source;
+    refill();
+  };
+
+  void begin(){
+    stop();
+    ended = 0;
+    eof = 0;
+    fillLeft = 0;
+    starving = 0;
+    for(int i = 0; i < AUDIO_FEED_BUFFERS; i++){
+      length[i] = 0;
+    }
+    current = 0;
+    sent = 0;
+    filling = 0;
+    started = micros();
+    playing = 1;
+  };
+
+  // Drops what is buffered, with no end fill: the owner cancels decoding
+  void stop(){
+    if(playing){
+      finish();
+    }
+    ended = 1;
+    eof = 1;
+  };
+
+  // The track was read to its end, and waits for endFill (the decoder's endFillByte, read over SCI by the owner)
+  int needsEndFill(){
+    return playing && ended && !eof && !fillLeft;
+  };
+
+  void endFill(uint8_t value){
+    fillByte = value;
+    fillLeft = AUDIO_END_FILL;
+    refill();
+  };
+
+  int isPlaying(){
+    return playing;
+  };
+
+  // Reads ahead, and sends what the interrupt couldn't. Main loop, at least every AUDIO_FEED_INTERVAL
+  void poll(){
+    if(!playing){
+      return;
+    }
+    unsigned long start = micros();
+    refill();
+    feed();
+    if(eof && isDrained()){
+      finish();
+    }
+    unsigned long elapsed = micros() - start;
+    if(elapsed > stats.maxPoll){
+      stats.maxPoll = elapsed;
+    }
+  };
+
+  const AudioFeederStats & getStats(){
+    return stats;
+  };
+
+  // CPU time sending and reading, as % of the time playing
+  unsigned long getLoad(){
+    unsigned long long total = stats.playMicros + (playing ? micros() - started : 0);
+    return total ? (unsigned long)((stats.feedMicros + stats.readMicros) * 100 / total) : 0;
+  };
+
+  void resetStats(){
+    memset(&stats, 0, sizeof(stats));
+    started = micros();
+  };
+};
+
+AudioFeeder * AudioFeeder::instance = nullptr;
+
+#endif
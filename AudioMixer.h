@@ -0,0 +1,393 @@
+#ifndef AUDIO_MIXER_H
+#define AUDIO_MIXER_H
+
+#include <Arduino.h>
+#include <SD.h>
+
+#include "Defaults.h"
+#include "Logger.h"
+#include "AudioFeeder.h"
+#include "MixKernel.h"
+
+#define AUDIO_MIX_SAMPLES   (AUDIO_FEED_BLOCK / 2)    // Output samples per read
+#define AUDIO_WAV_HEADER    44
+
+enum AudioMixFormat { AUDIO_MIX_FREE = 0, AUDIO_MIX_PCM, AUDIO_MIX_ADPCM };
+
+// A WAV file being mixed: 16 bit PCM or IMA-ADPCM, mono, AUDIO_MIX_RATE
+typedef struct {
+  File file;
+  char name[15];
+  byte format;                    // AudioMixFormat
+  byte loop;
+  int gain;                       // Q8
+  unsigned long dataStart;        // "data" chunk, offset in the file
+  unsigned long dataLength;
+  unsigned long remaining;        // Bytes of data not read yet
+  unsigned int blockAlign;        // IMA-ADPCM: bytes per block (4 byte header, then 2 samples per byte)
+  unsigned int blockPos;          // Bytes into the current block
+  int pending;                    // IMA-ADPCM: high nibble of the last byte, not decoded yet. PCM: odd byte of the last read. -1: none
+  ImaState ima;
+  uint8_t in[AUDIO_MIX_IN];       // IMA-ADPCM bytes read
+  unsigned int inLen;
+  unsigned int inPos;
+} AudioVoice;
+
+typedef struct {
+  unsigned long blocks;
+  unsigned long samples;
+  unsigned long long mixMicros;   // Decoding and mixing (with the IMA-ADPCM reads)
+  unsigned long long readMicros;  // PCM reads
+} AudioMixerStats;
+
+/*
+  Mixes up to AUDIO_MIX_VOICES WAV clips into one 16 bit mono stream, sent to the VS1053 as a WAV of unknown
+  length (AudioFeeder reads it as a source). Clips are pre-converted to AUDIO_MIX_RATE, mono, PCM or
+  IMA-ADPCM (e.g. sox in.mp3 -r 22050 -c 1 -e ima-adpcm OUT.WAV). A voice can loop: an ambient bed that
+  effects are layered over. The stream ends when all voices have.
+*/
+class AudioMixer : public AudioSource {
+
+  AudioVoice voices[AUDIO_MIX_VOICES];
+  int headerSent;
+  int32_t acc[AUDIO_MIX_SAMPLES];
+  int16_t samples[AUDIO_MIX_SAMPLES];
+  AudioMixerStats stats;
+
+  static uint16_t le16(const uint8_t * p){
+    return p[0] | (p[1] << 8);
+  };
+
+  static uint32_t le32(const uint8_t * p){
+    return le16(p) | ((uint32_t)le16(p + 2) << 16);
+  };
+
+  static void put32(uint8_t * p, uint32_t v){
+    for(int i = 0; i < 4; i++){
+      p[i] = (v >> (8 * i)) & 0xFF;
+    }
+  };
+
+  // Finds the fmt and data chunks. Leaves the file at the start of the data
+  int parseWav(AudioVoice & v){
+    uint8_t h[20];
+    if(v.file.read(h, 12) != 12 || memcmp(h, "RIFF", 4) || memcmp(h + 8, "WAVE", 4)){
+      return 0;
+    }
+    int format = 0, bits = 0;
+    while(v.file.read(h, 8) == 8){
+      uint32_t size = le32(h + 4);
+      uint32_t next = v.file.position() + size + (size & 1);
+      if(memcmp(h, "fmt ", 4) == 0){
+        if(size < 16 || v.file.read(h, 16) != 16){
+          return 0;
+        }
+        format = le16(h);
+        v.blockAlign = le16(h + 12);
+        bits = le16(h + 14);
+        if(le16(h + 2) != 1 || le32(h + 4) != AUDIO_MIX_RATE){
+          return 0;
+        }
+      } else if(memcmp(h, "data", 4) == 0){
+        v.dataStart = v.file.position();
+        v.dataLength = size;
+        break;
+      }
+      v.file.seek(next);
+    }
+    if(format == 1 && bits == 16){
+      v.format = AUDIO_MIX_PCM;
+    } else if(format == 0x11 && bits == 4 && v.blockAlign > 4){
+      v.format = AUDIO_MIX_ADPCM;
+    }
+    return v.format != AUDIO_MIX_FREE && v.dataStart;
+  };
+
+  // At the end of the data: back to its start if looping. Returns 0 if the voice is done
+  int rewind(AudioVoice & v){
+    if(!v.loop || !v.dataLength){
+      return 0;
+    }
+    v.file.seek(v.dataStart);
+    v.remaining = v.dataLength;
+    v.blockPos = 0;
+    v.pending = -1;
+    v.inLen = v.inPos = 0;
+    return 1;
+  };
+
+  int nextByte(AudioVoice & v){
+    if(v.inPos == v.inLen){
+      unsigned int n = v.remaining < sizeof(v.in) ? v.remaining : sizeof(v.in);
+      int r = n ? v.file.read(v.in, n) : 0;
+      if(r <= 0){
+        v.remaining = 0;
+        v.loop = 0;       // A read error would loop forever
+        return -1;
+      }
+      v.inLen = r;
+      v.inPos = 0;
+      v.remaining -= r;
+    }
+    return v.in[v.inPos++];
+  };
+
+  int atEnd(AudioVoice & v){
+    return !v.remaining && v.inPos == v.inLen && v.pending < 0;
+  };
+
+  int readPcm(AudioVoice & v, int16_t * out, int n){
+    int i = 0;
+    while(i < n){
+      if(!v.remaining && !rewind(v)){
+        break;
+      }
+      // A short read can end mid sample: its odd byte starts the next one
+      uint8_t * p = (uint8_t *)(out + i);
+      unsigned int have = 0;
+      if(v.pending >= 0){
+        p[have++] = v.pending;
+        v.pending = -1;
+      }
+      unsigned long bytes = (n - i) * 2 - have;
+      if(bytes > v.remaining){
+        bytes = v.remaining;
+      }
+      int r = v.file.read(p + have, bytes);
+      if(r <= 0){
+        v.remaining = 0;
+        v.loop = 0;
+        break;
+      }
+      v.remaining -= r;
+      have += r;
+      if(have & 1){
+        v.pending = p[have - 1];
+      }
+      i += have / 2;
+    }
+    return i;
+  };
+
+  // A block starts with the first sample and the step index, then low nibble first
+  int readAdpcm(AudioVoice & v, int16_t * out, int n){
+    int i = 0;
+    while(i < n){
+      if(v.pending >= 0){
+        out[i++] = imaDecode(v.ima, v.pending);
+        v.pending = -1;
+        continue;
+      }
+      if(atEnd(v) && !rewind(v)){
+        break;
+      }
+      if(v.blockPos == 0){
+        int b0 = nextByte(v), b1 = nextByte(v), b2 = nextByte(v), b3 = nextByte(v);
+        if(b3 < 0){
+          break;
+        }
+        v.ima.predictor = (int16_t)(b0 | (b1 << 8));
+        v.ima.index = b2 > 88 ? 88 : b2;
+        v.blockPos = 4;
+        out[i++] = v.ima.predictor;
+        continue;
+      }
+      int b = nextByte(v);
+      if(b < 0){
+        break;
+      }
+      if(++v.blockPos == v.blockAlign){
+        v.blockPos = 0;
+      }
+      out[i++] = imaDecode(v.ima, b & 0x0F);
+      v.pending = b >> 4;
+    }
+    return i;
+  };
+
+  void release(AudioVoice & v){
+    if(v.file){
+      v.file.close();
+    }
+    v.format = AUDIO_MIX_FREE;
+  };
+
+  // WAV header of a 16 bit mono stream, with the largest sizes: the VS1053 plays until it's cancelled
+  void buildHeader(uint8_t * h){
+    memcpy(h, "RIFF\xff\xff\xff\xff" "WAVEfmt \x10\x00\x00\x00\x01\x00\x01\x00", 24);
+    put32(h + 24, AUDIO_MIX_RATE);
+    put32(h + 28, AUDIO_MIX_RATE * 2);
+    memcpy(h + 32, "\x02\x00\x10\x00" "data\xff\xff\xff\xff", 12);
+  };
+
+public:
+
+  AudioMixer() : headerSent(0) {
+    for(int i = 0; i < AUDIO_MIX_VOICES; i++){
+      voices[i].format = AUDIO_MIX_FREE;
+    }
+    resetStats();
+  };
+
+  // Adds file to a free voice. gain: Q8 (MIX_GAIN_UNITY). Returns the voice, or -1
+  int add(const char * file, int gain, int loop){
+    for(int i = 0; i < AUDIO_MIX_VOICES; i++){
+      AudioVoice & v = voices[i];
+      if(v.format != AUDIO_MIX_FREE){
+        continue;
+      }
+      v.file = SD.open(file);
+      if(!v.file){
+        return -1;
+      }
+      v.dataStart = v.dataLength = 0;
+      if(!parseWav(v)){
+        LOG_TRACE(AudioBoard, "Not a mono WAV (PCM 16 bit or IMA-ADPCM) at the mix rate: ", file);
+        release(v);
+        return -1;
+      }
+      strncpy(v.name, file, sizeof(v.name) - 1);
+      v.name[sizeof(v.name) - 1] = '\0';
+      v.gain = gain;
+      v.loop = loop;
+      v.remaining = v.dataLength;
+      v.blockPos = 0;
+      v.pending = -1;
+      v.inLen = v.inPos = 0;
+      return i;
+    }
+    LOG_TRACE(AudioBoard, "No free voice for: ", file);
+    return -1;
+  };
+
+  // Stops the voices playing file. Returns how many
+  int remove(const char * file){
+    int removed = 0;
+    for(int i = 0; i < AUDIO_MIX_VOICES; i++){
+      if(voices[i].format != AUDIO_MIX_FREE && strcmp(voices[i].name, file) == 0){
+        release(voices[i]);
+        removed++;
+      }
+    }
+    return removed;
+  };
+
+  void stop(){
+    for(int i = 0; i < AUDIO_MIX_VOICES; i++){
+      release(voices[i]);
+    }
+    headerSent = 0;
+  };
+
+  int isActive(){
+    for(int i = 0; i < AUDIO_MIX_VOICES; i++){
+      if(voices[i].format != AUDIO_MIX_FREE){
+        return 1;
+      }
+    }
+    return 0;
+  };
+
+  // The stream: the WAV header first, then AUDIO_MIX_SAMPLES samples at most per call. 0 when all voices ended
+  virtual int read(uint8_t * buffer, unsigned int n){
+    if(!headerSent){
+      buildHeader(buffer);
+      headerSent = 1;
+      return AUDIO_WAV_HEADER;
+    }
+    int count = n / 2;
+    if(count > AUDIO_MIX_SAMPLES){
+      count = AUDIO_MIX_SAMPLES;
+    }
+
+    unsigned long start = micros();
+    unsigned long reading = 0;
+    memset(acc, 0, count * sizeof(int32_t));
+    int produced = 0;
+    for(int i = 0; i < AUDIO_MIX_VOICES; i++){
+      AudioVoice & v = voices[i];
+      if(v.format == AUDIO_MIX_FREE){
+        continue;
+      }
+      unsigned long t = micros();
+      int got = v.format == AUDIO_MIX_PCM ? readPcm(v, samples, count) : readAdpcm(v, samples, count);
+      if(v.format == AUDIO_MIX_PCM){
+        reading += micros() - t;
+      }
+      mixAccumulate(acc, samples, got, v.gain);
+      if(got > produced){
+        produced = got;
+      }
+      if(got < count){
+        release(v);
+      }
+    }
+    // Voices that ended early leave silence behind (acc is 0 there)
+    mixSaturate((int16_t *)buffer, acc, produced);
+
+    stats.blocks++;
+    stats.samples += produced;
+    stats.readMicros += reading;
+    stats.mixMicros += micros() - start - reading;
+    return produced * 2;
+  };
+
+  const AudioVoice * getVoice(int index){
+    if(index < 0 || index >= AUDIO_MIX_VOICES || voices[index].format == AUDIO_MIX_FREE) return nullptr;
+    return &voices[index];
+  };
+
+  const AudioMixerStats & getStats(){
+    return stats;
+  };
+
+  void resetStats(){
+    memset(&stats, 0, sizeof(stats));
+  };
+
+  /*
+    The kernel on this CPU: samples mixed per second for 1 to AUDIO_MIX_VOICES voices, and IMA-ADPCM samples
+    decoded per second. Synthetic input, no SD. Each run takes about 100 mS. Uses the mixer's buffers: not
+    while it plays.
+  */
+  void benchmark(Print & out, void (*keepAlive)()){
+    const int runs = 64;
+    for(int i = 0; i < AUDIO_MIX_SAMPLES; i++){
+      samples[i] = (int16_t)(i * 2654435761UL >> 16);
+    }
+    out.println("Voices, samples/s mixed, voice samples/s");
+    for(int n = 1; n <= AUDIO_MIX_VOICES; n++){
+      unsigned long start = micros();
+      for(int r = 0; r < runs; r++){
+        memset(acc, 0, sizeof(acc));
+        for(int v = 0; v < n; v++){
+          mixAccumulate(acc, samples, AUDIO_MIX_SAMPLES, MIX_GAIN_UNITY / n);
+        }
+        mixSaturate(samples, acc, AUDIO_MIX_SAMPLES);
+      }
+      unsigned long elapsed = micros() - start;
+      unsigned long rate = (unsigned long)((unsigned long long)runs * AUDIO_MIX_SAMPLES * 1000000 / elapsed);
+      out.print(n);
+      out.print(", ");
+      out.print(rate);
+      out.print(", ");
+      out.println(rate * n);
+      keepAlive();
+    }
+
+    ImaState state = { 0, 0 };
+    unsigned long start = micros();
+    for(int r = 0; r < runs; r++){
+      for(int i = 0; i < AUDIO_MIX_SAMPLES; i++){
+        samples[i] = imaDecode(state, i & 0x0F);
+      }
+    }
+    unsigned long elapsed = micros() - start;
+    out.print("IMA-ADPCM decode: ");
+    out.print((unsigned long)((unsigned long long)runs * AUDIO_MIX_SAMPLES * 1000000 / elapsed));
+    out.print(" samples/s. Needed per voice: ");
+    out.println(AUDIO_MIX_RATE);
+  };
+};
+
+#endif
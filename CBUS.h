@@ -1,86 +1,605 @@
 #ifndef CANBUS_H
 #define CANBUS_H
 
+#include <SPI.h>
 #include <Adafruit_MCP2515.h>
 
 #include "Defaults.h"
+#include "RingBuffer.h"
+#include "CBUSOpcodes.h"
 
 #define CAN_INT 13
-#define CAN_CS 12  
+#define CAN_CS 12
 #define CAN_BAUDRATE 125000
 
-// CBUS opcodes
-enum CBUS_OPC { NOOP = 0x00, ACON = 0x90, ACOF = 0x91 };
-
 enum CBUSInit { CBUS_INIT_OK = 0, CBUS_INIT_FAIL };
 
+// CBUS CAN identifier: major priority (2 bits), minor priority (2 bits) and the 7 bit CANID of the node
+#define CBUS_PRIORITY_NORMAL  0x0B    //MjPri 10 (normal), MinPri 11 (low), used for accessory events
+#define CBUS_CAN_ID(priority, canId)  ((((priority) & 0x0F) << 7) | ((canId) & 0x7F))
+
+enum CBUSFilterMode { CBUS_FILTER_PROMISCUOUS = 0, CBUS_FILTER_NODE };
+
+// MCP2515 registers used for acceptance filtering (the library keeps register access private)
+#define MCP_SPI_CLOCK       8000000
+#define MCP_CMD_WRITE       0x02
+#define MCP_CMD_READ        0x03
+#define MCP_CMD_MODIFY      0x05
+#define MCP_REG_CANSTAT     0x0E
+#define MCP_REG_CANCTRL     0x0F
+#define MCP_REG_RXF(n)      ((n) < 3 ? (n) * 4 : 0x10 + ((n) - 3) * 4)
+#define MCP_REG_RXM(n)      (0x20 + (n) * 4)
+#define MCP_REG_RXBCTRL(n)  (0x60 + (n) * 0x10)
+#define MCP_MODE_MASK       0xE0
+#define MCP_MODE_CONFIG     0x80
+#define MCP_CMD_RTS         0x80    //Request to send, OR'ed with the TX buffer bits
+#define MCP_REG_TXBCTRL(n)  (0x30 + (n) * 0x10)
+#define MCP_TXB_TXREQ       0x08
+#define MCP_TXB_TXERR       0x10
+#define MCP_TXB_MLOA        0x20
+#define MCP_TX_BUFFERS      3
+#define MCP_RXM_ANY         0x60    //RXBnCTRL: filters off, receive everything
+#define MCP_RXB0_BUKT       0x04    //RXB0CTRL: roll over into RXB1 when RXB0 is full
+#define MCP_REG_TEC         0x1C
+#define MCP_REG_REC         0x1D
+#define MCP_REG_EFLG        0x2D
+#define MCP_EFLG_RX1OVR     0x80
+#define MCP_EFLG_RX0OVR     0x40
+#define MCP_EFLG_TXBO       0x20
+#define MCP_EFLG_TXEP       0x10
+#define MCP_EFLG_RXEP       0x08
+#define MCP_EFLG_EWARN      0x01
+
+#define MCP_MASKS   2
+#define MCP_FILTERS 6
+
+/*
+	For standard frames the MCP2515 applies the EID8/EID0 part of masks and filters to the first
+	two data bytes: the CBUS opcode and the node number high byte. The low byte of the node number
+	can't be filtered in hardware, so Actions still checks the full node number.
+	Masks 0 and 1 cover RXB0 (filters 0-1) and RXB1 (filters 2-5).
+*/
+typedef struct {
+	byte mode;
+	byte masks[MCP_MASKS][2];       // {opcode, node number high}
+	byte filters[MCP_FILTERS][2];   // {opcode, node number high}
+} CBUSFilters;
+
+// Opcode mask matching ACONn/ACOFn (filter ACON) or ASONn/ASOFn (filter ASON): the 'n' and ON/OFF bits are don't care
+#define CBUS_FILTER_EVENT_MASK  0x9E
+
+enum CBUSBusState { CBUS_BUS_ACTIVE = 0, CBUS_BUS_WARNING, CBUS_BUS_PASSIVE, CBUS_BUS_OFF };
+
+/*
+	Approximate bits on the wire for a standard frame with length data bytes: 47 bits of
+	SOF/ID/control/CRC/ACK/EOF/IFS, the data, and ~1 stuff bit every 5 bits of the stuffable part.
+*/
+#define CBUS_FRAME_BITS(length)  (47 + 8 * (length) + (34 + 8 * (length)) / 5)
+
+// MCP2515 error state, sampled periodically from the main loop
+typedef struct {
+	byte state;                   // CBUSBusState
+	byte eflg;                    // Last EFLG read
+	byte tec;                     // Transmit/receive error counters
+	byte rec;
+	byte maxTec;
+	byte maxRec;
+	unsigned long hwOverflows;    // Frames lost in the MCP2515 (RX0OVR/RX1OVR): CAN_INT serviced too late
+	unsigned long warnings;       // Transitions into error warning (a counter >= 96)
+	unsigned long errorPassive;   // Transitions into error passive (a counter >= 128)
+	unsigned long busOff;         // Transitions into bus-off (TEC > 255)
+	unsigned long recoveries;     // Bus-off -> active. The MCP2515 recovers on its own after 128 x 11 recessive bits
+	unsigned long samples;
+	unsigned int fps;             // Frames per second (received + sent) over the last sample period
+	unsigned int peakFps;
+	unsigned int load;            // Estimated bus load in tenths of %, over the last sample period
+	unsigned int peakLoad;
+} CBUSHealth;
+
+// A packet as captured by the CAN interrupt
 typedef struct {
-	byte opcode;
-	byte nodeNumberHigh;
-	byte nodeNumberLow;
-	byte eventNumberHigh;
-	byte eventNumberLow;
-	byte param1;
-	byte param2;
-	byte param3;
-} __attribute__((packed)) CBUSPacket;
+	unsigned long timestamp;	// micros() when the frame was read from the MCP2515
+	byte source;							// CBUSSource
+	int id;
+	byte length;
+	CBUSPacket packet;
+} CBUSFrame;
 
 class CBUS {
 
-	Adafruit_MCP2515 mcp;	
+	Adafruit_MCP2515 mcp;
+	RingBuffer<CBUSFrame, CAN_RX_QUEUE_SIZE> rxQueue;
+
+	// Updated from the ISR
+	volatile unsigned long rxFrames;
+	volatile unsigned long rxOverflows;
+	volatile unsigned long rxIgnored;
+	volatile unsigned long rxBits;
+
+	// The MCP2515 library takes a plain function as callback
+	static CBUS * instance;
+
+	CBUSFilters filters;
+
+	// Frames waiting for a free MCP2515 TX buffer. Only used from the main loop
+	RingBuffer<CBUSFrame, CAN_TX_QUEUE_SIZE> txQueue;
+	int canId;
+	unsigned long txFrames;
+	unsigned long txFull;       // Frames dropped because txQueue was full
+	unsigned long txDeferred;   // Pumps that found all TX buffers busy
+	unsigned long txRetried;    // Frames that lost arbitration or hit a bus error at least once: the MCP2515 sent them again
+	byte txRetryCounted;        // Bit per TX buffer: its frame is already in txRetried
+	unsigned long txBits;
+
+	CBUSHealth health;
+	unsigned long lastSample;   // millis() of the last sampleHealth
+	unsigned long lastFrames;   // rx + tx frames at the last sample
+	unsigned long lastBits;
+
+	static byte stateOf(byte eflg){
+		if(eflg & MCP_EFLG_TXBO){
+			return CBUS_BUS_OFF;
+		}
+		if(eflg & (MCP_EFLG_TXEP | MCP_EFLG_RXEP)){
+			return CBUS_BUS_PASSIVE;
+		}
+		return (eflg & MCP_EFLG_EWARN) ? CBUS_BUS_WARNING : CBUS_BUS_ACTIVE;
+	};
+
+	void select(){
+		SPI.beginTransaction(SPISettings(MCP_SPI_CLOCK, MSBFIRST, SPI_MODE0));
+		digitalWrite(CAN_CS, LOW);
+	};
+
+	void deselect(){
+		digitalWrite(CAN_CS, HIGH);
+		SPI.endTransaction();
+	};
+
+	byte readRegister(byte address){
+		select();
+		SPI.transfer(MCP_CMD_READ);
+		SPI.transfer(address);
+		byte value = SPI.transfer(0x00);
+		deselect();
+		return value;
+	};
+
+	void writeRegister(byte address, byte value){
+		select();
+		SPI.transfer(MCP_CMD_WRITE);
+		SPI.transfer(address);
+		SPI.transfer(value);
+		deselect();
+	};
+
+	void modifyRegister(byte address, byte mask, byte value){
+		select();
+		SPI.transfer(MCP_CMD_MODIFY);
+		SPI.transfer(address);
+		SPI.transfer(mask);
+		SPI.transfer(value);
+		deselect();
+	};
+
+	int requestMode(byte mode){
+		modifyRegister(MCP_REG_CANCTRL, MCP_MODE_MASK, mode);
+		for(int i = 0; i < 100; i++){
+			if((readRegister(MCP_REG_CANSTAT) & MCP_MODE_MASK) == mode){
+				return 1;
+			}
+			delay(1);
+		}
+		return 0;
+	};
+
+	// Writes {SIDH, SIDL, EID8, EID0}. SID is left as "don't care" and EXIDE cleared (standard frames)
+	void writeAcceptance(byte address, const byte * value){
+		writeRegister(address, 0x00);
+		writeRegister(address + 1, 0x00);
+		writeRegister(address + 2, value[0]);
+		writeRegister(address + 3, value[1]);
+	};
+
+	int verifyAcceptance(byte address, const byte * value){
+		return readRegister(address + 2) == value[0] && readRegister(address + 3) == value[1];
+	};
+
+	/*
+		RXB0: short events from any node.
+		RXB1: any opcode carrying the node number we listen to (long events), or our own (node configuration,
+		FLiM commands). QNN carries no node number, so it's only seen in promiscuous mode.
+	*/
+	void buildFilters(int nodeNumber, int ownNodeNumber){
+		byte nnHigh = (nodeNumber >> 8) & 0xFF;
+		byte ownHigh = ownNodeNumber > 0 ? (ownNodeNumber >> 8) & 0xFF : nnHigh;
+		filters.mode = CBUS_FILTER_NODE;
+		filters.masks[0][0] = CBUS_FILTER_EVENT_MASK;
+		filters.masks[0][1] = 0x00;
+		filters.masks[1][0] = 0x00;
+		filters.masks[1][1] = 0xFF;
+		for(int i = 0; i < MCP_FILTERS; i++){
+			filters.filters[i][0] = i < 2 ? ASON : 0x00;
+			filters.filters[i][1] = i < 2 ? 0x00 : (i < 4 ? nnHigh : ownHigh);
+		}
+	};
+
+	int programFilters(){
+		if(!requestMode(MCP_MODE_CONFIG)){
+			return 0;
+		}
+
+		int ok = 1;
+		if(filters.mode == CBUS_FILTER_NODE){
+			for(int i = 0; i < MCP_MASKS; i++){
+				writeAcceptance(MCP_REG_RXM(i), filters.masks[i]);
+				ok &= verifyAcceptance(MCP_REG_RXM(i), filters.masks[i]);
+			}
+			for(int i = 0; i < MCP_FILTERS; i++){
+				writeAcceptance(MCP_REG_RXF(i), filters.filters[i]);
+				ok &= verifyAcceptance(MCP_REG_RXF(i), filters.filters[i]);
+			}
+		}
+
+		byte rxm = (ok && filters.mode == CBUS_FILTER_NODE) ? 0x00 : MCP_RXM_ANY;
+		writeRegister(MCP_REG_RXBCTRL(0), rxm | MCP_RXB0_BUKT);
+		writeRegister(MCP_REG_RXBCTRL(1), rxm);
+
+		return requestMode(0x00) && ok;
+	};
+
+	/*
+		Loads frame in TX buffer n and requests transmission. CTRL..D7 are consecutive, so it's a single write.
+		priority (TXP, 0-3) decides which loaded buffer goes first.
+	*/
+	void loadTxBuffer(int n, byte priority, const CBUSFrame & frame){
+		select();
+		SPI.transfer(MCP_CMD_WRITE);
+		SPI.transfer(MCP_REG_TXBCTRL(n));
+		SPI.transfer(priority & 0x03);					//TXBnCTRL (TXREQ clear)
+		SPI.transfer((frame.id >> 3) & 0xFF);		//SIDH
+		SPI.transfer((frame.id & 0x07) << 5);		//SIDL (standard frame)
+		SPI.transfer(0x00);											//EID8
+		SPI.transfer(0x00);											//EID0
+		SPI.transfer(frame.length & 0x0F);			//DLC
+		const byte * p = (const byte *)&frame.packet;
+		for(int i = 0; i < frame.length; i++){
+			SPI.transfer(p[i]);
+		}
+		deselect();
+
+		select();
+		SPI.transfer(MCP_CMD_RTS | (1 << n));
+		deselect();
+	};
+
+	static void onReceive(int packetSize){
+		if(instance){
+			instance->receive(packetSize);
+		}
+	};
+
+	/*
+		Runs in interrupt context (CAN_INT). The library has already moved the frame out of the
+		MCP2515 RX buffer, we only copy it to the queue. No logging here.
+	*/
+	void receive(int packetSize){
+		if(mcp.packetRtr()){
+			rxIgnored++;
+			return;
+		}
+
+		CBUSFrame frame;
+		frame.timestamp = micros();
+		frame.source = CBUS_SOURCE_CAN;
+		frame.id = mcp.packetId();
+		frame.length = packetSize <= (int)sizeof(frame.packet) ? packetSize : sizeof(frame.packet);
+		memset(&frame.packet, 0, sizeof(frame.packet));
+		byte * p = (byte *)&frame.packet;
+		for(int i = 0; i < frame.length; i++){
+			p[i] = mcp.read();
+		}
+
+		rxFrames++;
+		rxBits += CBUS_FRAME_BITS(frame.length);
+		if(!rxQueue.push(frame)){
+			rxOverflows++;
+		}
+	};
 
 public:
-  CBUS() : mcp(CAN_CS) {
+  CBUS() : mcp(CAN_CS), rxFrames(0), rxOverflows(0), rxIgnored(0), rxBits(0), canId(CBUS_DEFAULT_CANID), txFrames(0), txFull(0), txDeferred(0), txRetried(0), txRetryCounted(0), txBits(0),
+	         lastSample(0), lastFrames(0), lastBits(0) {
+		filters.mode = CBUS_FILTER_PROMISCUOUS;
+		memset(&health, 0, sizeof(health));
   };
 
-  int init(){
+  /*
+		nodeNumber: node we listen to, ownNodeNumber: the module's (from CBUSConfig). With useFilters the MCP2515
+		is programmed so only events for those nodes raise CAN_INT. Node 0 (not configured) or a failure falls
+		back to promiscuous.
+	*/
+  int init(int nodeNumber = 0, int ownNodeNumber = 0, int useFilters = 1){
     if(!mcp.begin(CAN_BAUDRATE)){
 			return CBUS_INIT_FAIL;
 		};
 
+		setFilters(nodeNumber, ownNodeNumber, useFilters);
+
+		//The library attaches CAN_INT and registers it with SPI.usingInterrupt, so SD and VS1053 transfers are not interleaved
+		instance = this;
+		mcp.onReceive(CAN_INT, CBUS::onReceive);
+
 		return CBUS_INIT_OK;
   }
 
-	char getEvent(int * nodeNumber, int * eventNumber){
-		
-		CBUSPacket packet;
-		int id;
-		int packetLength = mcp.parsePacket();
-		*nodeNumber = *eventNumber = 0;
+	// Returns the mode actually in effect
+	int setFilters(int nodeNumber, int ownNodeNumber, int useFilters){
+		if(useFilters && nodeNumber > 0){
+			buildFilters(nodeNumber, ownNodeNumber);
+		} else {
+			filters.mode = CBUS_FILTER_PROMISCUOUS;
+		}
 
+		if(!programFilters()){
+			LOG_ERROR(CBUS, "Failed to program acceptance filters. Falling back to promiscuous mode");
+			filters.mode = CBUS_FILTER_PROMISCUOUS;
+			programFilters();
+		}
 
-		trace.log("CBUS", "Rx packet:", packetLength);
-		
-		//No message
-		if(packetLength == 0){
-			trace.log("CBUS", "No message");
-			return 0;
-		};
+		LOG_TRACE(CBUS, "Acceptance filters: ", filters.mode == CBUS_FILTER_NODE ? "node" : "promiscuous");
+		return filters.mode;
+	};
 
-		if(mcp.packetRtr()){
-			trace.log("CBUS", "Message is RTR - Ignoring");
+	const CBUSFilters * getFilters(){
+		return &filters;
+	};
+
+	void setCanId(int id){
+		canId = id;
+	};
+
+	/*
+		Queues an accessory event for transmission. Never blocks: the frame goes out when
+		pumpTx finds a free TX buffer. Returns 0 if the TX queue is full.
+	*/
+	int sendEvent(byte opcode, int nodeNumber, int eventNumber){
+		byte bytes[] = { opcode, (byte)(nodeNumber >> 8), (byte)nodeNumber, (byte)(eventNumber >> 8), (byte)eventNumber };
+		return send(bytes, sizeof(bytes));
+	};
+
+	// Queues any CBUS message: opcode followed by its data bytes (at most 8 in total)
+	int send(const byte * bytes, int length){
+		CBUSFrame frame;
+		memset(&frame, 0, sizeof(frame));
+		frame.timestamp = micros();
+		frame.id = CBUS_CAN_ID(CBUS_PRIORITY_NORMAL, canId);
+		frame.length = length <= (int)sizeof(frame.packet) ? length : sizeof(frame.packet);
+		memcpy(&frame.packet, bytes, frame.length);
+
+		if(!txQueue.push(frame)){
+			txFull++;
+			LOG_TRACE_HEX(CBUS, "TX queue full. Dropping opcode: ", bytes[0]);
 			return 0;
 		}
+		return 1;
+	};
 
-		trace.logHex("CBUS", "Message received", (char *)&packet, sizeof(packet));
+	unsigned int getTxFree(){
+		return txQueue.capacity() - txQueue.count();
+	};
 
-		id = mcp.packetId();
-		
-		mcp.readBytes((char *)&packet, packetLength <= sizeof(packet) ? packetLength : sizeof(packet));
+	// Moves queued frames into free MCP2515 TX buffers. Called from the main loop, returns immediately if nothing is queued
+	void pumpTx(){
+		if(txQueue.isEmpty()){
+			return;
+		}
+
+		/*
+			The MCP2515 doesn't send buffers in load order, so we only load when all of them are free and
+			give each one a decreasing TXP: events leave in the order they were queued.
+		*/
+		int busy = 0;
+		for(int n = 0; n < MCP_TX_BUFFERS; n++){
+			byte ctrl = readRegister(MCP_REG_TXBCTRL(n));
+			if(ctrl & MCP_TXB_TXREQ){
+				busy = 1;
+				if((ctrl & (MCP_TXB_TXERR | MCP_TXB_MLOA)) && !(txRetryCounted & (1 << n))){
+					txRetryCounted |= 1 << n;
+					txRetried++;
+				}
+			}
+		}
+
+		if(busy){
+			txDeferred++;
+			return;
+		}
+
+		txRetryCounted = 0;
+		for(int n = 0; n < MCP_TX_BUFFERS && !txQueue.isEmpty(); n++){
+			loadTxBuffer(n, MCP_TX_BUFFERS - n, *txQueue.peek());
+			CBUSFrame sent;
+			txQueue.pop(sent);
+			txFrames++;
+			txBits += CBUS_FRAME_BITS(sent.length);
+		}
+	};
+
+	/*
+		Reads the controller error state and updates the health counters. Called periodically from the main loop.
+		Frame rate and bus load only count the frames that pass the acceptance filters (and the ones we send):
+		with node filters on, they are a lower bound of the real bus traffic.
+		Returns 1 if the bus state changed since the last sample.
+	*/
+	int sampleHealth(){
+		byte eflg = readRegister(MCP_REG_EFLG);
+		health.eflg = eflg;
+		health.tec = readRegister(MCP_REG_TEC);
+		health.rec = readRegister(MCP_REG_REC);
+		if(health.tec > health.maxTec){
+			health.maxTec = health.tec;
+		}
+		if(health.rec > health.maxRec){
+			health.maxRec = health.rec;
+		}
+
+		// Overflow flags stay set until cleared. The other flags follow the error counters
+		if(eflg & (MCP_EFLG_RX0OVR | MCP_EFLG_RX1OVR)){
+			health.hwOverflows += ((eflg & MCP_EFLG_RX0OVR) ? 1 : 0) + ((eflg & MCP_EFLG_RX1OVR) ? 1 : 0);
+			modifyRegister(MCP_REG_EFLG, MCP_EFLG_RX0OVR | MCP_EFLG_RX1OVR, 0x00);
+		}
+
+		byte previous = health.state;
+		byte state = stateOf(eflg);
+		if(state > previous){
+			if(state >= CBUS_BUS_WARNING && previous < CBUS_BUS_WARNING){
+				health.warnings++;
+			}
+			if(state >= CBUS_BUS_PASSIVE && previous < CBUS_BUS_PASSIVE){
+				health.errorPassive++;
+			}
+			if(state == CBUS_BUS_OFF){
+				health.busOff++;
+			}
+		}
+		if(previous == CBUS_BUS_OFF && state != CBUS_BUS_OFF){
+			health.recoveries++;
+		}
+		health.state = state;
+
+		unsigned long now = millis();
+		unsigned long elapsed = now - lastSample;
+		unsigned long frames = rxFrames + txFrames;
+		unsigned long bits = rxBits + txBits;
+		if(health.samples > 0 && elapsed > 0){
+			health.fps = (frames - lastFrames) * 1000UL / elapsed;
+			// bits / (CAN_BAUDRATE * elapsed / 1000) in tenths of %. 1000000 / CAN_BAUDRATE is exact for 125 kbit/s
+			health.load = (bits - lastBits) * (1000000UL / CAN_BAUDRATE) / elapsed;
+			if(health.fps > health.peakFps){
+				health.peakFps = health.fps;
+			}
+			if(health.load > health.peakLoad){
+				health.peakLoad = health.load;
+			}
+		}
+		lastSample = now;
+		lastFrames = frames;
+		lastBits = bits;
+		health.samples++;
+
+		return state != previous;
+	};
+
+	const CBUSHealth * getHealth(){
+		return &health;
+	};
 
-		if(packet.opcode != ACOF && packet.opcode != ACON){
-			trace.logHex("CBUS", "Opcode not supported: ", packet.opcode);
+	void resetHealth(){
+		byte state = health.state;
+		memset(&health, 0, sizeof(health));
+		health.state = state;
+	};
+
+	unsigned long getTransmittedFrames(){
+		return txFrames;
+	};
+
+	unsigned long getTxFull(){
+		return txFull;
+	};
+
+	unsigned long getTxDeferred(){
+		return txDeferred;
+	};
+
+	unsigned long getTxRetried(){
+		return txRetried;
+	};
+
+	unsigned int getTxQueued(){
+		return txQueue.count();
+	};
+
+	// Number of frames waiting to be processed
+	unsigned int available(){
+		return rxQueue.count();
+	};
+
+	unsigned long getReceivedFrames(){
+		return rxFrames;
+	};
+
+	// Frames lost because the queue was full when the interrupt fired
+	unsigned long getOverflows(){
+		return rxOverflows;
+	};
+
+	unsigned long getIgnoredFrames(){
+		return rxIgnored;
+	};
+
+	unsigned int getQueueCapacity(){
+		return rxQueue.capacity();
+	};
+
+	/*
+		Queues a frame as if the CAN interrupt had received it (traffic replay and load tests), and counts it
+		in the bus statistics. The queue has a single producer, so CAN_INT is masked while we push.
+		Returns 0 if the queue is full.
+	*/
+	int inject(const byte * bytes, int length, byte source){
+		CBUSFrame frame;
+		memset(&frame, 0, sizeof(frame));
+		frame.source = source;
+		frame.id = CBUS_CAN_ID(CBUS_PRIORITY_NORMAL, 0);
+		frame.length = length <= (int)sizeof(frame.packet) ? length : sizeof(frame.packet);
+		memcpy(&frame.packet, bytes, frame.length);
+
+		noInterrupts();
+		frame.timestamp = micros();
+		int ok = rxQueue.push(frame);
+		if(ok){
+			rxFrames++;
+			rxBits += CBUS_FRAME_BITS(frame.length);
+		}
+		interrupts();
+		return ok;
+	};
+
+	/*
+		Takes the oldest frame from the queue and decodes it into event.
+		Returns 0 if there's no frame or the frame is not an event we support.
+	*/
+	int getEvent(CBUSEvent * event){
+
+		CBUSFrame frame;
+
+		//No message
+		if(!rxQueue.pop(frame)){
+			LOG_TRACE(CBUS, "No message");
+			return 0;
+		};
+
+		LOG_TRACE(CBUS, "Rx packet:", frame.length);
+		LOG_TRACE_HEX(CBUS, "Message received", (char *)&frame.packet, frame.length);
+
+		if(frame.length == 0 || !CBUSOpcodeDecoder::decode(frame.packet, frame.length, *event)){
+			LOG_TRACE_HEX(CBUS, "Opcode not supported: ", frame.packet.opcode);
 			return 0;
 		};
 
-		trace.log("CBUS", "Opcode: ", (packet.opcode == ACON ? "ACON" : "ACOF"));
-		*nodeNumber = (packet.nodeNumberHigh << 8) | packet.nodeNumberLow;
-		*eventNumber = (packet.eventNumberHigh << 8) | packet.eventNumberLow;
-		trace.log("CBUS", "Node Number: ", *nodeNumber);
-		trace.log("CBUS", "Event Number: ", *eventNumber);
+		event->timestamp = frame.timestamp;
+		event->source = frame.source;
+		LOG_TRACE_HEX(CBUS, "Opcode: ", event->opcode);
+		LOG_TRACE(CBUS, "Node Number: ", event->nodeNumber);
+		LOG_TRACE(CBUS, "Event Number: ", event->eventNumber);
+		LOG_TRACE(CBUS, "Data bytes: ", event->dataLength);
 
-		return packet.opcode;
+		return 1;
 	};
 };
 
+CBUS * CBUS::instance = nullptr;
+
 #endif
\ No newline at end of file
@@ -4,46 +4,171 @@
 #include <SD.h>
 #include <Arduino.h>
 
+#include "Defaults.h"
+#include "NVMStore.h"
+#include "CBUSIndex.h"
+
 enum { CBUS_CFG_INIT_OK, CBUS_CFG_INIT_FAIL };
 
 #define DEFAULT_TRACK 0		//Default track is identified with the 'event=0'
 
+enum CBUSActionType { CBUS_ACTION_NONE = 0, CBUS_ACTION_RELAY, CBUS_ACTION_AUDIO };
+#define CBUS_ACTION_OWN_NODE 0x8000	//Flag in CBUSMapping::action while a file is read: "NN", resolved by buildIndex
+
+// Event variables taught with EVLRN
+#define CBUS_EV_ACTIONS   1   //Bit 0: relay, bit 1: audio
+#define CBUS_EV_TRACK     2   //Track number. Played as {number}.mp3, zero padded to 3 digits
+#define CBUS_EVS_PER_EVENT 2
+#define CBUS_EV_RELAY     0x01
+#define CBUS_EV_AUDIO     0x02
+
+// Priority of a track: a higher one stops the track playing (AudioBoard)
+typedef struct {
+	uint16_t track;				// Offset of the track name in the track arena
+	uint16_t priority;
+} CBUSPriority;
+
+// A mapped track, resolved to its audio catalog handle. In RAM only: the catalog is rebuilt at every boot
+typedef struct {
+	int16_t handle;				// -1: not on the SD card
+	uint16_t priority;
+} CBUSTrackRef;
+
+enum CBUSLearnResult { CBUS_LEARN_OK = 0, CBUS_LEARN_FULL, CBUS_LEARN_INVALID_EV, CBUS_LEARN_NO_EVENT };
+
+// Everything that is persisted in flash
+typedef struct {
+    int nodeNumber;           // Node listened to: mappings of "our node" and the acceptance filters
+    int moduleNodeNumber;     // The module's own: FLiM commands and replies, produced events. Set by SNN
+    int relayEventNumber;
+    int hardwareFilters;
+    int canId;
+    int keyEventNumber;       // Produced when the pushbutton is pressed (ACON) and the activity ends (ACOF)
+    int trackEventNumber;     // Produced when a track starts (ACON) and ends (ACOF)
+    int foreignNodes;         // Set if any mapping listens to a node other than NN
+    int mappingCount;
+    int tracksLength;
+    int bankCount;
+    uint16_t bank[AUDIO_BANK_CLIPS];  // Sound bank tracks: offsets in the track arena
+    int audioQueue;           // Requests for tracks of lower or the same priority as the one playing: 1 queued, 0 dropped
+    int priorityCount;
+    CBUSPriority priorities[AUDIO_PRIORITIES];
+    CBUSMapping mappings[CBUS_MAX_MAPPINGS];
+    char tracks[CBUS_TRACK_ARENA_SIZE];
+} CBUSConfigData;
+
+/*
+	Mappings are kept in an array sorted by (node, event), so lookups are a binary search and all
+	actions for an event are contiguous (in file order). Track names are interned in a single arena.
+	Capacity is set by CBUS_MAX_MAPPINGS and CBUS_TRACK_ARENA_SIZE (Defaults.h).
+
+	The whole configuration lives in a wear leveled flash region and is loaded from there on boot.
+	The config file is only read when flash holds no valid image, or on an explicit import.
+	Events taught over CBUS (FLiM) are added to the same index.
+
+	Track names are resolved to audio catalog handles (setTrackResolver) whenever the index changes, so
+	playing an event's track is an array lookup. Tracks missing from the SD card go to the error log then.
+*/
 class CBUSConfig {
 private:
-    int nodeNumber = 0;
-    int relayEventNumber = 0;
+    CBUSConfigData data;
+    NVMStore<CBUSConfigData, NVM_CONFIG_SLOTS> store;
+    const char * importFile = nullptr;
+    int loadedFromFlash = 0;
+    int dirty = 0;            // Changed since the last save
+    CBUSTrackRef refs[CBUS_MAX_MAPPINGS];   // Same order as data.mappings
+    int (*resolver)(const char * track) = nullptr;
 
-    static const int MAX_EVENTS = 20;
     static const int MAX_KEY_LEN = 16; // enough for keys like "steam"
-    
-    char keys[MAX_EVENTS][MAX_KEY_LEN];
-    int values[MAX_EVENTS];
-    int eventCount = 0;
 
 public:
     CBUSConfig(){}
 
-		int getMappedSoundEvents(){
-			return eventCount;
+		int getMappingCount(){
+			return data.mappingCount;
+		}
+
+		const CBUSMapping * getMapping(int index){
+			if(index < 0 || index >= data.mappingCount) return nullptr;
+			return &data.mappings[index];
+		}
+
+		const char * getTrackName(const CBUSMapping * mapping){
+			if(!mapping || mapping->action != CBUS_ACTION_AUDIO) return nullptr;
+			return &data.tracks[mapping->track];
+		}
+
+		// Catalog handle of the mapping's track, -1 if it's missing or not an audio mapping
+		int getTrackHandle(const CBUSMapping * mapping){
+			if(!mapping || mapping->action != CBUS_ACTION_AUDIO) return -1;
+			return refs[mapping - data.mappings].handle;
+		}
+
+		int getTrackPriority(const CBUSMapping * mapping){
+			if(!mapping || mapping->action != CBUS_ACTION_AUDIO) return 0;
+			return refs[mapping - data.mappings].priority;
+		}
+
+		// Returns the catalog handle of a track name, or -1. Set before init
+		void setTrackResolver(int (*resolver)(const char * track)){
+			this->resolver = resolver;
+		}
+
+		int getTrackArenaUsed(){
+			return data.tracksLength;
+		}
+
+		// Sound bank: short tracks AudioBoard keeps the start of in RAM (BANK={track} in the config file)
+		int getBankCount(){
+			return data.bankCount;
+		}
+
+		const char * getBankTrack(int index){
+			if(index < 0 || index >= data.bankCount) return nullptr;
+			return &data.tracks[data.bank[index]];
 		}
 
-		int getMappedSoundEvent(int index){
-			if(index < 0 || index >= eventCount) return -1;
-			return values[index];
+		// PRIORITY={track}:{priority} in the config file. 0 if not set
+		int getTrackPriority(const char * track){
+			for(int i = 0; track && i < data.priorityCount; i++){
+				if(strcmp(&data.tracks[data.priorities[i].track], track) == 0){
+					return data.priorities[i].priority;
+				}
+			}
+			return 0;
 		}
 
-		const char * getMappedSoundTrack(int index){
-			if(index < 0 || index >= eventCount) return nullptr;
-			return keys[index];
+		int getAudioQueue(){
+			return data.audioQueue;
 		}
-		
+
+		// Loads the configuration from flash. filename is imported (and saved) only if flash is empty or corrupted
 		int init(const char* filename){
-			File file = SD.open(filename);
+			importFile = filename;
+			if(store.begin() && store.load(data)){
+				loadedFromFlash = 1;
+				LOG_TRACE(CBUSConfig, "Configuration loaded from flash. Mappings: ", data.mappingCount);
+				resolveTracks(1);
+				return CBUS_CFG_INIT_OK;
+			}
+
+			LOG_TRACE(CBUSConfig, "No configuration in flash. Importing: ", filename);
+			return import();
+		}
+
+		// Replaces the configuration with the contents of the config file and persists it
+		int import(){
+			File file = SD.open(importFile);
 			if(!file) {
-				trace.log("CBUSConfig", "Failed to open config file");
+				LOG_TRACE(CBUSConfig, "Failed to open config file");
 				return CBUS_CFG_INIT_FAIL;
 			}
 
+			memset(&data, 0, sizeof(data));
+			data.hardwareFilters = 1;
+			data.canId = CBUS_DEFAULT_CANID;
+			loadedFromFlash = 0;
+
 			char line[64];  // buffer for reading lines
 			while(file.available()) {
 				readLine(file, line, sizeof(line));
@@ -65,46 +190,412 @@ public:
 				int value = atoi(valStr);
 
 				if(strcmp(key, "NN") == 0){
-					trace.log("CBUSConfig", "Listening to Node Number: ", value);
-					nodeNumber = value;
+					LOG_TRACE(CBUSConfig, "Listening to Node Number: ", value);
+					data.nodeNumber = value;
+				}else if(strcmp(key, "MODULE_NN") == 0){
+					LOG_TRACE(CBUSConfig, "Module Node Number: ", value);
+					data.moduleNodeNumber = value;
 				}else if(strcmp(key, "RELAY_EN") == 0){
-					trace.log("CBUSConfig", "Relay Event Number: ", value);
-					relayEventNumber = value;
-				}else if(eventCount < MAX_EVENTS){
-					strncpy(keys[eventCount], key, MAX_KEY_LEN - 1);
-					keys[eventCount][MAX_KEY_LEN - 1] = '\0'; // Ensure null termination
-					values[eventCount] = value;
-					trace.log("CBUSConfig", keys[eventCount], values[eventCount]);
-					eventCount++;
+					LOG_TRACE(CBUSConfig, "Relay Event Number: ", value);
+					data.relayEventNumber = value;
+					addMapping(0, value, CBUS_ACTION_RELAY | CBUS_ACTION_OWN_NODE, 0);
+				}else if(strcmp(key, "CAN_FILTER") == 0){
+					LOG_TRACE(CBUSConfig, "Hardware acceptance filters: ", value);
+					data.hardwareFilters = value;
+				}else if(strcmp(key, "CANID") == 0){
+					if(value < CBUS_MIN_CANID || value > CBUS_MAX_CANID){
+						LOG_ERROR(CBUSConfig, "CANID out of range (1-127). Ignoring: ", valStr);
+						continue;
+					}
+					LOG_TRACE(CBUSConfig, "CANID: ", value);
+					data.canId = value;
+				}else if(strcmp(key, "KEY_EN") == 0){
+					LOG_TRACE(CBUSConfig, "Pushbutton produced Event Number: ", value);
+					data.keyEventNumber = value;
+				}else if(strcmp(key, "TRACK_EN") == 0){
+					LOG_TRACE(CBUSConfig, "Track produced Event Number: ", value);
+					data.trackEventNumber = value;
+				}else if(strcmp(key, "BANK") == 0){
+					if(data.bankCount >= AUDIO_BANK_CLIPS){
+						LOG_ERROR(CBUSConfig, "Sound bank full. Ignoring: ", valStr);
+						continue;
+					}
+					int offset = internTrack(valStr);
+					if(offset < 0){
+						LOG_ERROR(CBUSConfig, "Track name arena full. Ignoring: ", valStr);
+						continue;
+					}
+					LOG_TRACE(CBUSConfig, "Sound bank track: ", valStr);
+					data.bank[data.bankCount++] = offset;
+				}else if(strcmp(key, "PRIORITY") == 0){
+					char * colon = strchr(valStr, ':');
+					if(!colon || data.priorityCount >= AUDIO_PRIORITIES){
+						LOG_ERROR(CBUSConfig, "Invalid or too many track priorities. Ignoring: ", valStr);
+						continue;
+					}
+					*colon = '\0';
+					int offset = internTrack(valStr);
+					if(offset < 0){
+						LOG_ERROR(CBUSConfig, "Track name arena full. Ignoring: ", valStr);
+						continue;
+					}
+					LOG_TRACE(CBUSConfig, "Track priority: ", valStr);
+					data.priorities[data.priorityCount].track = offset;
+					data.priorities[data.priorityCount++].priority = atoi(colon + 1);
+				}else if(strcmp(key, "AUDIO_QUEUE") == 0){
+					LOG_TRACE(CBUSConfig, "Queue lower priority tracks: ", value);
+					data.audioQueue = value;
+				}else{
+					// {track}={event} maps to our node, {track}={node}:{event} to any node
+					uint16_t node = 0;
+					uint16_t action = CBUS_ACTION_AUDIO | CBUS_ACTION_OWN_NODE;
+					char * colon = strchr(valStr, ':');
+					if(colon){
+						node = value;
+						action = CBUS_ACTION_AUDIO;
+						value = atoi(colon + 1);
+					}
+					int offset = internTrack(key);
+					if(offset < 0){
+						LOG_ERROR(CBUSConfig, "Track name arena full. Ignoring: ", key);
+						continue;
+					}
+					if(addMapping(node, value, action, offset)){
+						LOG_TRACE(CBUSConfig, "Track mapped: ", key);
+						LOG_TRACE(CBUSConfig, "To event: ", value);
+					}
 				}
 			}
 
 			file.close();
+			buildIndex(1);
+			if(!save()){
+				LOG_ERROR(CBUSConfig, "Failed to save configuration to flash");
+			}
 			return CBUS_CFG_INIT_OK;
     }
 
+		int save(){
+			dirty = 0;
+			return store.save(data);
+		}
+
+		int isDirty(){
+			return dirty;
+		}
+
+		int isLoadedFromFlash(){
+			return loadedFromFlash;
+		}
+
+		const NVMStore<CBUSConfigData, NVM_CONFIG_SLOTS> * getStore(){
+			return &store;
+		}
+
     int getNodeNumber() {
-        return nodeNumber;
+        return data.nodeNumber;
+    }
+
+    int getModuleNodeNumber() {
+        return data.moduleNodeNumber;
     }
 
     int getRelayEventNumber() {
-      return relayEventNumber;
+      return data.relayEventNumber;
+    }
+
+    int getCanId() {
+      return data.canId;
+    }
+
+    // Event numbers produced by this module. 0 means the event is not produced
+    int getKeyEventNumber() {
+      return data.keyEventNumber;
     }
 
-    char * getAudioByEventNumber(int eventNumber) {
-			for(int i = 0; i < eventCount; i++){
-				if(values[i] == eventNumber){
-					return keys[i];
+    int getTrackEventNumber() {
+      return data.trackEventNumber;
+    }
+
+    // 0 disables the MCP2515 acceptance filters (promiscuous mode). Filters only know NN, so mappings for other nodes disable them too
+    int useHardwareFilters() {
+      return data.hardwareFilters && !data.foreignNodes;
+    }
+
+		// Returns the number of actions mapped to (node, event), and in first a pointer to the first one (CBUSIndex.h)
+		int findMappings(int node, int event, const CBUSMapping ** first){
+			return cbusFindMappings(data.mappings, data.mappingCount, node, event, first);
+		}
+
+    // First audio mapping of eventNumber on our node
+    const CBUSMapping * getAudioMapping(int eventNumber) {
+			const CBUSMapping * m;
+			int count = findMappings(data.nodeNumber, eventNumber, &m);
+			for(int i = 0; i < count; i++){
+				if(m[i].action == CBUS_ACTION_AUDIO){
+					return &m[i];
 				}
 			}
 			return nullptr;
     }
 
-	char * getDefaultAudio(){
+    const char * getAudioByEventNumber(int eventNumber) {
+			return getTrackName(getAudioMapping(eventNumber));
+    }
+
+	const char * getDefaultAudio(){
 		return getAudioByEventNumber(DEFAULT_TRACK);
 	}
 
+	const CBUSMapping * getDefaultMapping(){
+		return getAudioMapping(DEFAULT_TRACK);
+	}
+
+		// FLiM support. Events are the distinct (node, event) keys of the index
+
+		// SNN. The node listened to, and so the mappings, stay as they are
+		void setModuleNodeNumber(int nn){
+			data.moduleNodeNumber = nn;
+			dirty = 1;
+		}
+
+		int countEvents(){
+			int count = 0;
+			for(int i = 0; i < data.mappingCount; i++){
+				if(i == 0 || cbusKeyOf(data.mappings[i]) != cbusKeyOf(data.mappings[i - 1])){
+					count++;
+				}
+			}
+			return count;
+		}
+
+		// Worst case: every event has a relay and a track
+		int freeEventSlots(){
+			return (CBUS_MAX_MAPPINGS - data.mappingCount) / CBUS_EVS_PER_EVENT;
+		}
+
+		// Node and event number of the index-th event (0 based). Returns 0 if out of range
+		int getEvent(int index, int * node, int * event){
+			int count = -1;
+			for(int i = 0; i < data.mappingCount; i++){
+				if(i == 0 || cbusKeyOf(data.mappings[i]) != cbusKeyOf(data.mappings[i - 1])){
+					count++;
+				}
+				if(count == index){
+					*node = data.mappings[i].nodeNumber;
+					*event = data.mappings[i].eventNumber;
+					return 1;
+				}
+			}
+			return 0;
+		}
+
+		// Current value of an event variable, derived from the actions mapped to the event
+		int readEV(int node, int event, int evIndex, int * value){
+			const CBUSMapping * m;
+			int count = findMappings(node, event, &m);
+			if(!count){
+				return CBUS_LEARN_NO_EVENT;
+			}
+			int actions = 0, track = 0;
+			for(int i = 0; i < count; i++){
+				if(m[i].action == CBUS_ACTION_RELAY){
+					actions |= CBUS_EV_RELAY;
+				} else if(m[i].action == CBUS_ACTION_AUDIO){
+					actions |= CBUS_EV_AUDIO;
+					track = atoi(getTrackName(&m[i]));
+				}
+			}
+			switch(evIndex){
+				case CBUS_EV_ACTIONS: *value = actions; return CBUS_LEARN_OK;
+				case CBUS_EV_TRACK: *value = track; return CBUS_LEARN_OK;
+			}
+			return CBUS_LEARN_INVALID_EV;
+		}
+
+		// EVLRN: sets one event variable, creating the event if needed. The event's actions are rebuilt from its EVs
+		int learn(int node, int event, int evIndex, int evValue){
+			int actions = 0, track = 0;
+			if(evIndex != CBUS_EV_ACTIONS && evIndex != CBUS_EV_TRACK){
+				return CBUS_LEARN_INVALID_EV;
+			}
+			readEV(node, event, CBUS_EV_ACTIONS, &actions);
+			readEV(node, event, CBUS_EV_TRACK, &track);
+			if(evIndex == CBUS_EV_ACTIONS){
+				actions = evValue;
+			} else {
+				track = evValue;
+			}
+
+			const CBUSMapping * m;
+			if(data.mappingCount - findMappings(node, event, &m) + CBUS_EVS_PER_EVENT > CBUS_MAX_MAPPINGS){
+				return CBUS_LEARN_FULL;
+			}
+			unlearn(node, event);
+
+			if(actions & CBUS_EV_RELAY){
+				addMapping(node, event, CBUS_ACTION_RELAY, 0);
+			}
+			if(actions & CBUS_EV_AUDIO){
+				char name[MAX_KEY_LEN];
+				snprintf(name, sizeof(name), "%03d", track);
+				int offset = internTrack(name);
+				if(offset < 0){
+					buildIndex();
+					return CBUS_LEARN_FULL;
+				}
+				addMapping(node, event, CBUS_ACTION_AUDIO, offset);
+			}
+			buildIndex();
+			dirty = 1;
+			return CBUS_LEARN_OK;
+		}
+
+		// EVULN. Returns the number of actions removed
+		int unlearn(int node, int event){
+			uint32_t key = cbusKey(node, event);
+			int j = 0;
+			for(int i = 0; i < data.mappingCount; i++){
+				if(cbusKeyOf(data.mappings[i]) != key){
+					data.mappings[j++] = data.mappings[i];
+				}
+			}
+			int removed = data.mappingCount - j;
+			data.mappingCount = j;
+			if(removed){
+				resolveTracks(0);
+				dirty = 1;
+			}
+			return removed;
+		}
+
+		// NNCLR. The sound bank and track priorities stay
+		void clearEvents(){
+			data.mappingCount = 0;
+			compactTracks();
+			data.relayEventNumber = 0;
+			buildIndex();
+			dirty = 1;
+		}
+
 private:
+
+		int addMapping(uint16_t node, int event, uint16_t action, uint16_t track){
+			if(data.mappingCount >= CBUS_MAX_MAPPINGS){
+				LOG_ERROR(CBUSConfig, "Max number of mappings reached. Ignoring event: ", event);
+				return 0;
+			}
+			CBUSMapping & m = data.mappings[data.mappingCount++];
+			m.nodeNumber = node;
+			m.eventNumber = event;
+			m.action = action;
+			m.track = track;
+			return 1;
+		}
+
+		// Returns the offset of name in arena, adding it if it's not there yet. -1 if the arena is full
+		static int intern(char * arena, int & length, const char * name){
+			char trimmed[MAX_KEY_LEN];
+			strncpy(trimmed, name, MAX_KEY_LEN - 1);
+			trimmed[MAX_KEY_LEN - 1] = '\0';
+
+			for(int offset = 0; offset < length; offset += strlen(&arena[offset]) + 1){
+				if(strcmp(&arena[offset], trimmed) == 0){
+					return offset;
+				}
+			}
+
+			int len = strlen(trimmed) + 1;
+			if(length + len > CBUS_TRACK_ARENA_SIZE){
+				return -1;
+			}
+			int offset = length;
+			memcpy(&arena[offset], trimmed, len);
+			length += len;
+			return offset;
+		}
+
+		// Rebuilds the arena with the names still in use: mapped tracks, the sound bank and priorities
+		void compactTracks(){
+			char arena[CBUS_TRACK_ARENA_SIZE];
+			int length = 0;
+			for(int i = 0; i < data.mappingCount; i++){
+				CBUSMapping & m = data.mappings[i];
+				if((m.action & ~CBUS_ACTION_OWN_NODE) == CBUS_ACTION_AUDIO){		// Also while a file is read
+					m.track = intern(arena, length, &data.tracks[m.track]);
+				}
+			}
+			for(int i = 0; i < data.bankCount; i++){
+				data.bank[i] = intern(arena, length, &data.tracks[data.bank[i]]);
+			}
+			for(int i = 0; i < data.priorityCount; i++){
+				data.priorities[i].track = intern(arena, length, &data.tracks[data.priorities[i].track]);
+			}
+			memcpy(data.tracks, arena, length);
+			data.tracksLength = length;
+		}
+
+		// Unlearnt events leave unused names behind. When the arena fills up, it's compacted
+		int internTrack(const char * name){
+			int offset = intern(data.tracks, data.tracksLength, name);
+			if(offset >= 0){
+				return offset;
+			}
+			compactTracks();
+			return intern(data.tracks, data.tracksLength, name);
+		}
+
+		// Resolves "our node" (CBUS_ACTION_OWN_NODE) now that NN is known, and sorts
+		void buildIndex(int report = 0){
+			data.foreignNodes = 0;
+			for(int i = 0; i < data.mappingCount; i++){
+				CBUSMapping & m = data.mappings[i];
+				if(m.action & CBUS_ACTION_OWN_NODE){
+					m.action &= ~CBUS_ACTION_OWN_NODE;
+					m.nodeNumber = data.nodeNumber;
+				} else if(m.nodeNumber != data.nodeNumber){
+					data.foreignNodes = 1;
+				}
+			}
+			cbusSortMappings(data.mappings, data.mappingCount);
+			LOG_TRACE(CBUSConfig, "Mappings indexed: ", data.mappingCount);
+			resolveTracks(report);
+		}
+
+		/*
+			Fills refs from the index. Returns the mappings with a missing track. report: log each missing track once,
+			on boot and import only. Learning over CBUS resolves again, but must not write the error log each time.
+		*/
+		int resolveTracks(int report){
+			if(!resolver){
+				return 0;
+			}
+			int missing = 0;
+			for(int i = 0; i < data.mappingCount; i++){
+				const CBUSMapping & m = data.mappings[i];
+				refs[i].handle = -1;
+				refs[i].priority = 0;
+				if(m.action != CBUS_ACTION_AUDIO){
+					continue;
+				}
+				const char * track = &data.tracks[m.track];
+				refs[i].handle = resolver(track);
+				refs[i].priority = getTrackPriority(track);
+				if(refs[i].handle >= 0){
+					continue;
+				}
+				missing++;
+				int logged = 0;
+				for(int j = 0; report && j < i && !logged; j++){
+					logged = data.mappings[j].action == CBUS_ACTION_AUDIO && data.mappings[j].track == m.track;
+				}
+				if(report && !logged){
+					LOG_ERROR(CBUSConfig, "Mapped track not on the SD card: ", track);
+				}
+			}
+			return missing;
+		}
+
     // Read line from file into buffer, null-terminated
     void readLine(File& file, char* buffer, int maxLen){
 			int index = 0;
@@ -134,4 +625,4 @@ private:
 		}
 };
 
-#endif
\ No newline at end of file
+#endif
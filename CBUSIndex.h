@@ -0,0 +1,66 @@
+#ifndef CBUS_INDEX_H
+#define CBUS_INDEX_H
+
+#include <stdint.h>
+
+/*
+  The (node, event) -> action index of CBUSConfig, with no Arduino dependencies so the same code builds on
+  the host (tools/indexbench.cpp). Mappings are kept sorted by (node, event): a lookup is a binary search,
+  and all actions for an event are contiguous.
+*/
+
+// One (node, event) -> action entry of the index
+typedef struct {
+	uint16_t nodeNumber;
+	uint16_t eventNumber;
+	uint16_t action;			// CBUSActionType
+	uint16_t track;				// CBUS_ACTION_AUDIO: offset of the track name in the track arena
+} CBUSMapping;
+
+static inline uint32_t cbusKey(int node, int event){
+	return ((uint32_t)(node & 0xFFFF) << 16) | (event & 0xFFFF);
+}
+
+static inline uint32_t cbusKeyOf(const CBUSMapping & m){
+	return cbusKey(m.nodeNumber, m.eventNumber);
+}
+
+// Insertion sort: stable, so the actions of an event keep file order. Mappings are loaded mostly in order
+static inline void cbusSortMappings(CBUSMapping * mappings, int count){
+	for(int i = 1; i < count; i++){
+		CBUSMapping m = mappings[i];
+		uint32_t key = cbusKeyOf(m);
+		int j = i - 1;
+		while(j >= 0 && cbusKeyOf(mappings[j]) > key){
+			mappings[j + 1] = mappings[j];
+			j--;
+		}
+		mappings[j + 1] = m;
+	}
+}
+
+/*
+	Returns the number of actions mapped to (node, event), and in first a pointer to the first one.
+	All of them are contiguous. O(log n).
+*/
+static inline int cbusFindMappings(const CBUSMapping * mappings, int count, int node, int event, const CBUSMapping ** first){
+	uint32_t key = cbusKey(node, event);
+	int lo = 0, hi = count;
+	while(lo < hi){
+		int mid = (lo + hi) >> 1;
+		if(cbusKeyOf(mappings[mid]) < key){
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	int n = 0;
+	while(lo + n < count && cbusKeyOf(mappings[lo + n]) == key){
+		n++;
+	}
+	*first = n ? &mappings[lo] : nullptr;
+	return n;
+}
+
+#endif
@@ -0,0 +1,247 @@
+#ifndef CBUS_JOURNAL_H
+#define CBUS_JOURNAL_H
+
+#include <RTCZero.h>
+#include <SD.h>
+
+#include "Defaults.h"
+#include "CBUSOpcodes.h"
+
+// What a received event resolved to (bit mask)
+#define CBUS_JOURNAL_NONE     0x00    //Not mapped, or from a node we ignore
+#define CBUS_JOURNAL_RELAY    0x01
+#define CBUS_JOURNAL_AUDIO    0x02
+#define CBUS_JOURNAL_COMMAND  0x04    //Node configuration (FLiM)
+#define CBUS_JOURNAL_DRY_RUN  0x40    //Injected event, actions resolved but not run
+#define CBUS_JOURNAL_ON       0x80    //ON event
+
+typedef struct {
+  uint32_t epoch;       // RTC time the event was processed
+  uint32_t received;    // micros() when the CAN interrupt read the frame
+  uint32_t latency;     // Microseconds from reception until the relay/audio call returned
+  uint16_t nodeNumber;
+  uint16_t eventNumber;
+  byte opcode;
+  byte actions;         // CBUS_JOURNAL_* bits
+} CBUSJournalEntry;
+
+/*
+  Fixed size RAM record of the last CBUS_JOURNAL_SIZE events received, independent of the trace logger.
+  Entries are appended to CBUS_JOURNAL_FILE in batches, from the main loop, when the bus is quiet.
+  If entries are overwritten before they are flushed they are counted as lost.
+  Past CBUS_JOURNAL_MAX_SIZE the journal goes on in CBUS_JOURNAL_FILE2, and the other way round: starting a
+  file removes the older one, so the journal never takes over twice CBUS_JOURNAL_MAX_SIZE of the card.
+*/
+class CBUSJournal {
+
+  RTCZero rtc;
+  CBUSJournalEntry entries[CBUS_JOURNAL_SIZE];
+  unsigned long total;        // Entries recorded since boot. entries[total % SIZE] is the next slot
+  unsigned long flushed;      // Entries written to SD (or lost)
+  unsigned long lost;
+  unsigned long flushes;
+  unsigned long flushErrors;
+  unsigned long lastFlush;    // millis()
+  unsigned long rotations;
+  int current;                // Journal file written: 0 CBUS_JOURNAL_FILE, 1 CBUS_JOURNAL_FILE2. -1 not known yet
+
+  // Latency of all events recorded since the last resetLatency (not only the ones in RAM)
+  unsigned long latencyCount;
+  unsigned long latencyMin;
+  unsigned long latencyMax;
+  unsigned long long latencySum;
+
+  static const char * fileName(int index){
+    return index ? CBUS_JOURNAL_FILE2 : CBUS_JOURNAL_FILE;
+  };
+
+  // The file that isn't full. When both are, the first is started again
+  File openFile(){
+    if(current < 0){
+      File f = SD.open(CBUS_JOURNAL_FILE);
+      current = f && f.size() >= CBUS_JOURNAL_MAX_SIZE;
+      if(f){
+        f.close();
+      }
+    }
+    File f = SD.open(fileName(current), FILE_WRITE);
+    if(f && f.size() >= CBUS_JOURNAL_MAX_SIZE){
+      f.close();
+      current = !current;
+      SD.remove(fileName(current));
+      rotations++;
+      f = SD.open(fileName(current), FILE_WRITE);
+    }
+    return f;
+  };
+
+  void print(Print & out, const CBUSJournalEntry & e, char separator){
+    out.print(e.epoch);
+    out.print(separator);
+    if(e.opcode < 0x10){
+      out.print('0');
+    }
+    out.print(e.opcode, HEX);
+    out.print(separator);
+    out.print(e.nodeNumber);
+    out.print(separator);
+    out.print(e.eventNumber);
+    out.print(separator);
+    out.print((e.actions & CBUS_JOURNAL_ON) ? "on" : "off");
+    out.print(separator);
+    out.print(actionName(e.actions));
+    if(e.actions & CBUS_JOURNAL_DRY_RUN){
+      out.print(" (dry run)");
+    }
+    out.print(separator);
+    out.println(e.latency);
+  };
+
+public:
+
+  CBUSJournal() : total(0), flushed(0), lost(0), flushes(0), flushErrors(0), lastFlush(0), rotations(0), current(-1) {
+    resetLatency();
+  };
+
+  void record(const CBUSEvent & event, byte actions, unsigned long latency){
+    CBUSJournalEntry & e = entries[total % CBUS_JOURNAL_SIZE];
+    e.epoch = rtc.getEpoch();
+    e.received = event.timestamp;
+    e.latency = latency;
+    e.nodeNumber = event.nodeNumber;
+    e.eventNumber = event.eventNumber;
+    e.opcode = event.opcode;
+    e.actions = actions | (event.on ? CBUS_JOURNAL_ON : 0) | (event.source == CBUS_SOURCE_DRY_RUN ? CBUS_JOURNAL_DRY_RUN : 0);
+    total++;
+
+    latencyCount++;
+    latencySum += latency;
+    if(latency < latencyMin){
+      latencyMin = latency;
+    }
+    if(latency > latencyMax){
+      latencyMax = latency;
+    }
+
+    if(total - flushed > CBUS_JOURNAL_SIZE){
+      flushed++;
+      lost++;
+    }
+  };
+
+  static const char * actionName(byte actions){
+    switch(actions & ~(CBUS_JOURNAL_ON | CBUS_JOURNAL_DRY_RUN)){
+      case CBUS_JOURNAL_RELAY: return "relay";
+      case CBUS_JOURNAL_AUDIO: return "audio";
+      case CBUS_JOURNAL_RELAY | CBUS_JOURNAL_AUDIO: return "relay+audio";
+      case CBUS_JOURNAL_COMMAND: return "command";
+    }
+    return "-";
+  };
+
+  // Entries in RAM
+  unsigned int count(){
+    return total < CBUS_JOURNAL_SIZE ? total : CBUS_JOURNAL_SIZE;
+  };
+
+  // 0 is the newest entry
+  const CBUSJournalEntry * get(unsigned int index){
+    if(index >= count()){
+      return nullptr;
+    }
+    return &entries[(total - 1 - index) % CBUS_JOURNAL_SIZE];
+  };
+
+  unsigned int pending(){
+    return total - flushed;
+  };
+
+  // A batch is due when enough entries are waiting, or the oldest has been waiting for too long
+  int isFlushDue(){
+    unsigned int p = pending();
+    return p >= CBUS_JOURNAL_BATCH || (p > 0 && millis() - lastFlush >= CBUS_JOURNAL_MAX_AGE);
+  };
+
+  // Appends pending entries to the journal file. Returns the number of entries written
+  int flush(){
+    lastFlush = millis();
+    unsigned int p = pending();
+    if(!p){
+      return 0;
+    }
+
+    if(!SD.begin(SD_CS)){
+      flushErrors++;
+      return 0;
+    }
+
+    File f = openFile();
+    if(!f){
+      flushErrors++;
+      return 0;
+    }
+    f.seek(f.size());
+    for(unsigned int i = 0; i < p; i++){
+      print(f, entries[(flushed + i) % CBUS_JOURNAL_SIZE], ',');
+    }
+    f.close();
+
+    flushed += p;
+    flushes++;
+    return p;
+  };
+
+  // Newest first, at most n entries
+  void printHistory(Print & out, unsigned int n){
+    out.println("Epoch\tOpcode\tNode\tEvent\tOn/Off\tAction\tLatency (us)");
+    for(unsigned int i = 0; i < n && i < count(); i++){
+      print(out, *get(i), '\t');
+    }
+  };
+
+  void resetLatency(){
+    latencyCount = 0;
+    latencyMin = 0xFFFFFFFF;
+    latencyMax = 0;
+    latencySum = 0;
+  };
+
+  unsigned long getLatencyCount(){
+    return latencyCount;
+  };
+
+  unsigned long getLatencyMin(){
+    return latencyCount ? latencyMin : 0;
+  };
+
+  unsigned long getLatencyMax(){
+    return latencyMax;
+  };
+
+  unsigned long getLatencyMean(){
+    return latencyCount ? latencySum / latencyCount : 0;
+  };
+
+  unsigned long getTotal(){
+    return total;
+  };
+
+  unsigned long getLost(){
+    return lost;
+  };
+
+  unsigned long getFlushes(){
+    return flushes;
+  };
+
+  unsigned long getFlushErrors(){
+    return flushErrors;
+  };
+
+  // Journal files started because the other was full
+  unsigned long getRotations(){
+    return rotations;
+  };
+};
+
+#endif
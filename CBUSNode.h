@@ -0,0 +1,264 @@
+#ifndef CBUS_NODE_H
+#define CBUS_NODE_H
+
+#include "Defaults.h"
+#include "CBUS.h"
+#include "CBUSConfig.h"
+
+extern TraceLogger trace;
+extern FileLogger error;
+
+enum CBUSNodeMode { CBUS_MODE_NORMAL = 0, CBUS_MODE_SETUP, CBUS_MODE_LEARN };
+
+// CMDERR codes
+enum CBUSCommandError {
+  CBUS_ERR_INVALID_COMMAND = 1,
+  CBUS_ERR_NOT_LEARN = 2,
+  CBUS_ERR_NOT_SETUP = 3,
+  CBUS_ERR_TOO_MANY_EVENTS = 4,
+  CBUS_ERR_INVALID_EV_INDEX = 6,
+  CBUS_ERR_INVALID_EVENT = 7
+};
+
+#define CBUS_NODE_FLAGS 0x07    //PNN flags: consumer, producer, FLiM
+
+/*
+  FLiM node configuration: setup (SNN), learn mode (NNLRN/NNULN), teaching events (EVLRN/EVULN/NNCLR)
+  and reading them back (NERD, RQEVN, NNEVN, REVAL). Events live in CBUSConfig, which persists them in
+  flash when learn mode ends.
+*/
+class CBUSNode {
+
+  CBUS * cbus;
+  CBUSConfig * config;
+  int mode;
+  int nerdIndex;      // Next event to report for NERD, -1 if not reporting
+
+  // Addressed to the module's own node number (SNN), not the one it listens to. None before setup
+  int isForUs(const CBUSEvent & cmd){
+    int nn = config->getModuleNodeNumber();
+    return nn > 0 && cmd.nodeNumber == nn;
+  };
+
+  void reply(byte opcode, const byte * data = nullptr, int length = 0){
+    byte bytes[8];
+    int nn = config->getModuleNodeNumber();
+    bytes[0] = opcode;
+    bytes[1] = (nn >> 8) & 0xFF;
+    bytes[2] = nn & 0xFF;
+    for(int i = 0; i < length && i < 5; i++){
+      bytes[3 + i] = data[i];
+    }
+    cbus->send(bytes, 3 + (length < 5 ? length : 5));
+  };
+
+  void replyError(byte errorCode){
+    reply(CMDERR, &errorCode, 1);
+  };
+
+  // SETUP waits for SNN, LEARN for EVLRN/EVULN, which carry the producer's NN: both need all traffic
+  void updateFilters(){
+    if(mode == CBUS_MODE_SETUP || mode == CBUS_MODE_LEARN){
+      cbus->setFilters(0, 0, 0);
+      return;
+    }
+    cbus->setFilters(config->getNodeNumber(), config->getModuleNodeNumber(), config->useHardwareFilters());
+  };
+
+  void learnEvent(const CBUSEvent & cmd){
+    if(mode != CBUS_MODE_LEARN){
+      return;   // EVLRN is addressed to whatever node is in learn mode
+    }
+    if(cmd.dataLength < 2){
+      replyError(CBUS_ERR_INVALID_EVENT);
+      return;
+    }
+    switch(config->learn(cmd.nodeNumber, cmd.eventNumber, cmd.data[0], cmd.data[1])){
+      case CBUS_LEARN_OK:
+        LOG_TRACE(CBUSNode, "Event learned: ", cmd.eventNumber);
+        reply(WRACK);
+        break;
+      case CBUS_LEARN_FULL:
+        replyError(CBUS_ERR_TOO_MANY_EVENTS);
+        break;
+      default:
+        replyError(CBUS_ERR_INVALID_EV_INDEX);
+        break;
+    }
+  };
+
+  void unlearnEvent(const CBUSEvent & cmd){
+    if(mode != CBUS_MODE_LEARN){
+      return;
+    }
+    if(!config->unlearn(cmd.nodeNumber, cmd.eventNumber)){
+      replyError(CBUS_ERR_INVALID_EVENT);
+      return;
+    }
+    LOG_TRACE(CBUSNode, "Event unlearned: ", cmd.eventNumber);
+    reply(WRACK);
+  };
+
+  // REVAL: {NN}{event index}{EV index}
+  void readEventVariable(const CBUSEvent & cmd){
+    int index = (cmd.eventNumber >> 8) & 0xFF;
+    int evIndex = cmd.eventNumber & 0xFF;
+    int node, event, value;
+    if(!config->getEvent(index, &node, &event)){
+      replyError(CBUS_ERR_INVALID_EVENT);
+      return;
+    }
+    if(config->readEV(node, event, evIndex, &value) != CBUS_LEARN_OK){
+      replyError(CBUS_ERR_INVALID_EV_INDEX);
+      return;
+    }
+    byte data[] = { (byte)index, (byte)evIndex, (byte)value };
+    reply(NEVAL, data, sizeof(data));
+  };
+
+  void setNodeNumber(const CBUSEvent & cmd){
+    if(mode != CBUS_MODE_SETUP){
+      return;
+    }
+    LOG_TRACE(CBUSNode, "Node number set: ", cmd.nodeNumber);
+    config->setModuleNodeNumber(cmd.nodeNumber);
+    if(!config->save()){
+      LOG_ERROR(CBUSNode, "Failed to save configuration to flash");
+    }
+    mode = CBUS_MODE_NORMAL;
+    updateFilters();
+    reply(NNACK);
+  };
+
+  void exitLearn(){
+    mode = CBUS_MODE_NORMAL;
+    LOG_TRACE(CBUSNode, "Learn mode off");
+    if(config->isDirty() && !config->save()){
+      LOG_ERROR(CBUSNode, "Failed to save configuration to flash");
+    }
+    updateFilters();
+  };
+
+public:
+
+  CBUSNode() : cbus(nullptr), config(nullptr), mode(CBUS_MODE_NORMAL), nerdIndex(-1) {
+  };
+
+  void init(CBUS * cbus, CBUSConfig * config){
+    this->cbus = cbus;
+    this->config = config;
+  };
+
+  int getMode(){
+    return mode;
+  };
+
+  // Asks the configuration tool for a node number (RQNN). Listens to all traffic until SNN arrives
+  void enterSetup(){
+    mode = CBUS_MODE_SETUP;
+    updateFilters();
+    reply(RQNN);
+    LOG_TRACE(CBUSNode, "Setup mode. Waiting for SNN");
+  };
+
+  void handle(const CBUSEvent & cmd){
+    switch(cmd.opcode){
+      case QNN:
+        {
+          byte data[] = { CBUS_MANUFACTURER_ID, CBUS_MODULE_ID, CBUS_NODE_FLAGS };
+          reply(PNN, data, sizeof(data));
+        }
+        return;
+
+      case RQNP:
+        if(mode == CBUS_MODE_SETUP){
+          byte params[] = { CBUS_MANUFACTURER_ID, CBUS_VERSION_MINOR, CBUS_MODULE_ID, (byte)(CBUS_MAX_MAPPINGS / CBUS_EVS_PER_EVENT), CBUS_EVS_PER_EVENT, 0, CBUS_VERSION_MAJOR };
+          byte bytes[8] = { PARAMS };
+          memcpy(&bytes[1], params, sizeof(params));
+          cbus->send(bytes, sizeof(bytes));
+        }
+        return;
+
+      case SNN:
+        setNodeNumber(cmd);
+        return;
+
+      case EVLRN:
+        learnEvent(cmd);
+        return;
+
+      case EVULN:
+        unlearnEvent(cmd);
+        return;
+    }
+
+    // Everything else is addressed to a node number
+    if(!isForUs(cmd)){
+      return;
+    }
+
+    switch(cmd.opcode){
+      case NNLRN:
+        mode = CBUS_MODE_LEARN;
+        updateFilters();
+        LOG_TRACE(CBUSNode, "Learn mode on");
+        break;
+
+      case NNULN:
+        exitLearn();
+        break;
+
+      case NNCLR:
+        if(mode != CBUS_MODE_LEARN){
+          replyError(CBUS_ERR_NOT_LEARN);
+          break;
+        }
+        config->clearEvents();
+        reply(WRACK);
+        break;
+
+      case NNEVN:
+        {
+          byte free = config->freeEventSlots();
+          reply(EVNLF, &free, 1);
+        }
+        break;
+
+      case RQEVN:
+        {
+          byte count = config->countEvents();
+          reply(NUMEV, &count, 1);
+        }
+        break;
+
+      case NERD:
+        nerdIndex = 0;    // Reported from poll(), as TX queue space allows
+        break;
+
+      case REVAL:
+        readEventVariable(cmd);
+        break;
+    }
+  };
+
+  // Called from the main loop. Streams NERD responses without overflowing the TX queue
+  // A NERD reply is in progress: poll has frames to queue
+  int isBusy(){
+    return nerdIndex >= 0;
+  };
+
+  void poll(){
+    while(nerdIndex >= 0 && cbus->getTxFree() > 0){
+      int node, event;
+      if(!config->getEvent(nerdIndex, &node, &event)){
+        nerdIndex = -1;
+        return;
+      }
+      byte data[] = { (byte)(node >> 8), (byte)node, (byte)(event >> 8), (byte)event, (byte)nerdIndex };
+      reply(ENRSP, data, sizeof(data));
+      nerdIndex++;
+    }
+  };
+};
+
+#endif
@@ -0,0 +1,162 @@
+#ifndef CBUS_OPCODES_H
+#define CBUS_OPCODES_H
+
+#include <Arduino.h>
+
+// CBUS opcodes. The top 3 bits of an opcode are the number of data bytes that follow it
+enum CBUS_OPC {
+	NOOP  = 0x00,
+	ACON  = 0x90, ACOF  = 0x91, ASON  = 0x98, ASOF  = 0x99,   // NN/DN + EN
+	ACON1 = 0xB0, ACOF1 = 0xB1, ASON1 = 0xB8, ASOF1 = 0xB9,   // + 1 data byte
+	ACON2 = 0xD0, ACOF2 = 0xD1, ASON2 = 0xD8, ASOF2 = 0xD9,   // + 2 data bytes
+	ACON3 = 0xF0, ACOF3 = 0xF1, ASON3 = 0xF8, ASOF3 = 0xF9,   // + 3 data bytes
+
+	// Node configuration (FLiM)
+	QNN   = 0x0D, RQNP  = 0x10, SNN   = 0x42, RQNN  = 0x50, NNACK = 0x52,
+	NNLRN = 0x53, NNULN = 0x54, NNCLR = 0x55, NNEVN = 0x56, NERD  = 0x57,
+	RQEVN = 0x58, WRACK = 0x59, CMDERR = 0x6F, EVNLF = 0x70, NUMEV = 0x74,
+	EVULN = 0x95, REVAL = 0x9C, NEVAL = 0xB5, PNN   = 0xB6, EVLRN = 0xD2,
+	PARAMS = 0xEF, ENRSP = 0xF2
+};
+
+typedef struct {
+	byte opcode;
+	byte nodeNumberHigh;
+	byte nodeNumberLow;
+	byte eventNumberHigh;
+	byte eventNumberLow;
+	byte param1;
+	byte param2;
+	byte param3;
+} __attribute__((packed)) CBUSPacket;
+
+enum CBUSEventType { CBUS_EVENT_LONG = 0, CBUS_EVENT_SHORT, CBUS_EVENT_COMMAND };
+
+#define CBUS_MAX_EVENT_DATA 3
+
+// Where a frame came from
+enum CBUSSource { CBUS_SOURCE_CAN = 0, CBUS_SOURCE_INJECTED, CBUS_SOURCE_DRY_RUN };
+
+// A decoded accessory event, or a node configuration command
+typedef struct {
+	byte opcode;
+	byte type;                        // CBUSEventType
+	byte on;                          // 1 for ACONn/ASONn, 0 for ACOFn/ASOFn
+	byte dataLength;                  // Data bytes carried by the n variants
+	int nodeNumber;                   // Always 0 for short events (the sender's NN is not part of the event)
+	int eventNumber;                  // Device number for short events. Bytes 3-4 of commands
+	byte data[CBUS_MAX_EVENT_DATA];   // Bytes after the event number
+	unsigned long timestamp;          // When the frame was received (micros())
+	byte source;                      // CBUSSource. Dry run events are resolved and journaled, but no action is run
+} CBUSEvent;
+
+// Index into cbusDecoders
+enum CBUSDecoder { CBUS_DECODE_NONE = 0, CBUS_DECODE_LONG_EVENT, CBUS_DECODE_SHORT_EVENT, CBUS_DECODE_COMMAND, CBUS_DECODERS };
+
+typedef struct {
+	byte length;    // Bytes after the opcode
+	byte decoder;   // CBUSDecoder
+} CBUSOpcodeInfo;
+
+// Evaluated at compile time only, to build the table below
+constexpr byte cbusDecoderFor(int op){
+	return (op == ACON || op == ACOF || op == ACON1 || op == ACOF1 || op == ACON2 || op == ACOF2 || op == ACON3 || op == ACOF3) ? CBUS_DECODE_LONG_EVENT :
+	       (op == ASON || op == ASOF || op == ASON1 || op == ASOF1 || op == ASON2 || op == ASOF2 || op == ASON3 || op == ASOF3) ? CBUS_DECODE_SHORT_EVENT :
+	       (op == QNN || op == RQNP || op == SNN || op == NNLRN || op == NNULN || op == NNCLR || op == NNEVN || op == NERD ||
+	        op == RQEVN || op == EVULN || op == REVAL || op == EVLRN) ? CBUS_DECODE_COMMAND :
+	       CBUS_DECODE_NONE;
+}
+
+constexpr CBUSOpcodeInfo cbusOpcodeInfo(int op){
+	return { (byte)(op >> 5), cbusDecoderFor(op) };
+}
+
+#define CBUS_OPC_ROW(b) \
+	cbusOpcodeInfo(b + 0x0), cbusOpcodeInfo(b + 0x1), cbusOpcodeInfo(b + 0x2), cbusOpcodeInfo(b + 0x3), \
+	cbusOpcodeInfo(b + 0x4), cbusOpcodeInfo(b + 0x5), cbusOpcodeInfo(b + 0x6), cbusOpcodeInfo(b + 0x7), \
+	cbusOpcodeInfo(b + 0x8), cbusOpcodeInfo(b + 0x9), cbusOpcodeInfo(b + 0xA), cbusOpcodeInfo(b + 0xB), \
+	cbusOpcodeInfo(b + 0xC), cbusOpcodeInfo(b + 0xD), cbusOpcodeInfo(b + 0xE), cbusOpcodeInfo(b + 0xF)
+
+// One entry per opcode, lives in flash. Decoding is a single lookup by opcode.
+constexpr CBUSOpcodeInfo cbusOpcodes[256] = {
+	CBUS_OPC_ROW(0x00), CBUS_OPC_ROW(0x10), CBUS_OPC_ROW(0x20), CBUS_OPC_ROW(0x30),
+	CBUS_OPC_ROW(0x40), CBUS_OPC_ROW(0x50), CBUS_OPC_ROW(0x60), CBUS_OPC_ROW(0x70),
+	CBUS_OPC_ROW(0x80), CBUS_OPC_ROW(0x90), CBUS_OPC_ROW(0xA0), CBUS_OPC_ROW(0xB0),
+	CBUS_OPC_ROW(0xC0), CBUS_OPC_ROW(0xD0), CBUS_OPC_ROW(0xE0), CBUS_OPC_ROW(0xF0)
+};
+
+#undef CBUS_OPC_ROW
+
+static_assert(cbusOpcodes[ACON].decoder == CBUS_DECODE_LONG_EVENT && cbusOpcodes[ACON].length == 4, "ACON entry");
+static_assert(cbusOpcodes[ASOF3].decoder == CBUS_DECODE_SHORT_EVENT && cbusOpcodes[ASOF3].length == 7, "ASOF3 entry");
+static_assert(cbusOpcodes[EVLRN].decoder == CBUS_DECODE_COMMAND && cbusOpcodes[EVLRN].length == 6, "EVLRN entry");
+
+class CBUSOpcodeDecoder {
+
+	static int decodeNone(const CBUSPacket & packet, CBUSEvent & event){
+		return 0;
+	};
+
+	static void decodeEvent(const CBUSPacket & packet, CBUSEvent & event){
+		event.on = !(packet.opcode & 0x01);
+		event.eventNumber = (packet.eventNumberHigh << 8) | packet.eventNumberLow;
+		event.dataLength = cbusOpcodes[packet.opcode].length - 4;
+		memcpy(event.data, &packet.param1, event.dataLength);
+	};
+
+	static int decodeLongEvent(const CBUSPacket & packet, CBUSEvent & event){
+		decodeEvent(packet, event);
+		event.type = CBUS_EVENT_LONG;
+		event.nodeNumber = (packet.nodeNumberHigh << 8) | packet.nodeNumberLow;
+		return 1;
+	};
+
+	static int decodeShortEvent(const CBUSPacket & packet, CBUSEvent & event){
+		decodeEvent(packet, event);
+		event.type = CBUS_EVENT_SHORT;
+		event.nodeNumber = 0;
+		return 1;
+	};
+
+	// Node commands: {NN}, {NN}{EN} and {NN}{EN}{data} layouts, depending on the opcode's length
+	static int decodeCommand(const CBUSPacket & packet, CBUSEvent & event){
+		byte length = cbusOpcodes[packet.opcode].length;
+		event.type = CBUS_EVENT_COMMAND;
+		if(length >= 2){
+			event.nodeNumber = (packet.nodeNumberHigh << 8) | packet.nodeNumberLow;
+		}
+		if(length >= 4){
+			event.eventNumber = (packet.eventNumberHigh << 8) | packet.eventNumberLow;
+		}
+		if(length > 4){
+			event.dataLength = length - 4;
+			memcpy(event.data, &packet.param1, event.dataLength);
+		}
+		return 1;
+	};
+
+public:
+
+	/*
+		Decodes packet into event. length is the number of bytes received (opcode included).
+		Returns 0 if the opcode is not an event we handle or the frame is too short for it.
+	*/
+	static int decode(const CBUSPacket & packet, int length, CBUSEvent & event){
+		typedef int (*decoder)(const CBUSPacket &, CBUSEvent &);
+		static const decoder decoders[CBUS_DECODERS] = { decodeNone, decodeLongEvent, decodeShortEvent, decodeCommand };
+
+		const CBUSOpcodeInfo & info = cbusOpcodes[packet.opcode];
+		if(length < 1 + info.length){
+			return 0;
+		}
+		memset(&event, 0, sizeof(event));
+		event.opcode = packet.opcode;
+		return decoders[info.decoder](packet, event);
+	};
+
+	static int isSupported(byte opcode){
+		return cbusOpcodes[opcode].decoder != CBUS_DECODE_NONE;
+	};
+};
+
+#endif
@@ -0,0 +1,251 @@
+#ifndef CBUS_TRAFFIC_H
+#define CBUS_TRAFFIC_H
+
+#include <SD.h>
+
+#include "Defaults.h"
+#include "CBUS.h"
+#include "CBUSJournal.h"
+
+extern TraceLogger trace;
+
+enum CBUSTrafficMode { CBUS_TRAFFIC_IDLE = 0, CBUS_TRAFFIC_LOAD, CBUS_TRAFFIC_REPLAY };
+
+/*
+  Feeds frames into the CBUS receive queue, through the same path as the CAN interrupt, so the real
+  decoding, mapping and Actions code is exercised on the device:
+  - Load: N producer nodes sending M events/s each. Producer 0 uses our node number (mapped events),
+    the others node number + 1..N-1 (foreign events). Events cycle through 1..CBUS_LOAD_EVENTS, ON then OFF.
+  - Replay: a capture file in the SD card. One frame per line: "{ms since start} {opcode} {data bytes}", in hex
+    except the time, e.g. "1500 90 00 80 00 08". Lines starting with # are ignored.
+  Injected frames skip the acceptance filters. By default they are dry run: actions are resolved and journaled,
+  but the relay and audio board are not touched. The resulting action sequence is in the journal.
+*/
+class CBUSTraffic {
+
+  CBUS * cbus;
+  CBUSJournal * journal;
+  int nodeNumber;
+
+  int mode;
+  byte source;                  // CBUS_SOURCE_DRY_RUN or CBUS_SOURCE_INJECTED
+
+  // Load
+  int nodes;
+  unsigned long interval;       // uS between frames, all producers together
+  unsigned long nextDue;        // micros()
+  unsigned long sequence;
+  unsigned long duration;       // mS
+
+  // Replay
+  File file;
+  unsigned long nextAt;         // mS since start of the next frame
+  byte next[8];
+  int nextLength;
+
+  // Results
+  unsigned long started;        // millis()
+  unsigned long elapsed;
+  unsigned long injected;
+  unsigned long dropped;        // RX queue full
+  unsigned long overflowsAtStart;
+  unsigned long processedAtStart;
+
+  void start(int newMode, byte newSource){
+    mode = newMode;
+    source = newSource;
+    started = millis();
+    elapsed = 0;
+    injected = 0;
+    dropped = 0;
+    overflowsAtStart = cbus->getOverflows();
+    processedAtStart = journal->getTotal();
+    journal->resetLatency();
+  };
+
+  void finish(){
+    elapsed = millis() - started;
+    if(file){
+      file.close();
+    }
+    mode = CBUS_TRAFFIC_IDLE;
+    LOG_TRACE(CBUSTraffic, "Finished. Frames injected: ", injected);
+    LOG_TRACE(CBUSTraffic, "Frames dropped: ", dropped);
+  };
+
+  void inject(const byte * bytes, int length){
+    if(cbus->inject(bytes, length, source)){
+      injected++;
+    } else {
+      dropped++;
+    }
+  };
+
+  void pollLoad(){
+    if(millis() - started >= duration){
+      finish();
+      return;
+    }
+
+    // If the loop was late we inject everything that was due: the bus would have delivered it
+    while((long)(micros() - nextDue) >= 0){
+      int producer = sequence % nodes;
+      unsigned long round = sequence / nodes;
+      int event = round % CBUS_LOAD_EVENTS + 1;
+      byte opcode = ((round / CBUS_LOAD_EVENTS) & 0x01) ? ACOF : ACON;
+      int node = nodeNumber + producer;
+      byte bytes[] = { opcode, (byte)(node >> 8), (byte)node, (byte)(event >> 8), (byte)event };
+      inject(bytes, sizeof(bytes));
+      sequence++;
+      nextDue += interval;
+    }
+  };
+
+  // Reads the next frame of the capture into next/nextAt. Returns 0 at the end of the file
+  int readNext(){
+    char line[64];
+    while(file.available()){
+      int index = 0;
+      while(file.available() && index < (int)sizeof(line) - 1){
+        char c = file.read();
+        if(c == '\n') break;
+        line[index++] = c;
+      }
+      line[index] = '\0';
+      if(line[0] == '#' || line[0] == '\0' || line[0] == '\r'){
+        continue;
+      }
+
+      char * p = line;
+      char * end;
+      nextAt = strtoul(p, &end, 10);
+      nextLength = 0;
+      for(p = end; nextLength < (int)sizeof(next); p = end){
+        unsigned long b = strtoul(p, &end, 16);
+        if(end == p){
+          break;
+        }
+        next[nextLength++] = b;
+      }
+      if(nextLength > 0){
+        return 1;
+      }
+    }
+    return 0;
+  };
+
+  void pollReplay(){
+    while(millis() - started >= nextAt){
+      inject(next, nextLength);
+      if(!readNext()){
+        finish();
+        return;
+      }
+    }
+  };
+
+public:
+
+  CBUSTraffic() : cbus(nullptr), journal(nullptr), nodeNumber(0), mode(CBUS_TRAFFIC_IDLE), source(CBUS_SOURCE_DRY_RUN),
+                  nodes(0), interval(0), nextDue(0), sequence(0), duration(0), nextAt(0), nextLength(0),
+                  started(0), elapsed(0), injected(0), dropped(0), overflowsAtStart(0), processedAtStart(0) {
+  };
+
+  void init(CBUS * cbus, CBUSJournal * journal){
+    this->cbus = cbus;
+    this->journal = journal;
+  };
+
+  /*
+    producers nodes at rate events/s each, for seconds. live: run the actions too.
+    Up to CBUS_LOAD_MAX_RATE frames/s in total: pollLoad catches up frame by frame, so it must inject faster
+  */
+  int startLoad(int nodeNumber, int producers, int rate, int seconds, int live){
+    if(mode != CBUS_TRAFFIC_IDLE || producers <= 0 || rate <= 0 || seconds <= 0){
+      return 0;
+    }
+    if((unsigned long long)producers * rate > CBUS_LOAD_MAX_RATE){
+      return 0;
+    }
+    this->nodeNumber = nodeNumber;
+    nodes = producers;
+    interval = 1000000UL / ((unsigned long)producers * rate);
+    duration = seconds * 1000UL;
+    sequence = 0;
+    start(CBUS_TRAFFIC_LOAD, live ? CBUS_SOURCE_INJECTED : CBUS_SOURCE_DRY_RUN);
+    nextDue = micros();
+    return 1;
+  };
+
+  int startReplay(const char * filename, int live){
+    if(mode != CBUS_TRAFFIC_IDLE){
+      return 0;
+    }
+    file = SD.open(filename);
+    if(!file){
+      return 0;
+    }
+    start(CBUS_TRAFFIC_REPLAY, live ? CBUS_SOURCE_INJECTED : CBUS_SOURCE_DRY_RUN);
+    if(!readNext()){
+      finish();
+    }
+    return 1;
+  };
+
+  void stop(){
+    if(mode != CBUS_TRAFFIC_IDLE){
+      finish();
+    }
+  };
+
+  // Called from the main loop
+  void poll(){
+    switch(mode){
+      case CBUS_TRAFFIC_LOAD:
+        pollLoad();
+        break;
+      case CBUS_TRAFFIC_REPLAY:
+        pollReplay();
+        break;
+    }
+  };
+
+  int isRunning(){
+    return mode != CBUS_TRAFFIC_IDLE;
+  };
+
+  void printReport(Print & out){
+    const char * modes[] = {"Idle", "Load", "Replay"};
+    unsigned long ms = isRunning() ? millis() - started : elapsed;
+    out.print("Mode: ");
+    out.print(modes[mode]);
+    out.print(source == CBUS_SOURCE_DRY_RUN ? " (dry run)" : " (live)");
+    out.print(", Elapsed: ");
+    out.print(ms);
+    out.println(" mS");
+    if(mode == CBUS_TRAFFIC_LOAD){
+      out.print("Producers: ");
+      out.print(nodes);
+      out.print(", Frames/s: ");
+      out.println(interval ? 1000000UL / interval : 0);
+    }
+    out.print("Injected: ");
+    out.print(injected);
+    out.print(", Dropped (RX queue full): ");
+    out.print(dropped);
+    out.print(", CAN overflows: ");
+    out.println(cbus->getOverflows() - overflowsAtStart);
+    out.print("Processed: ");
+    out.print(journal->getTotal() - processedAtStart);
+    out.print(", Still queued: ");
+    out.println(cbus->available());
+    out.print("Latency reception to action (uS). Min: ");
+    out.print(journal->getLatencyMin());
+    out.print(", Mean: ");
+    out.print(journal->getLatencyMean());
+    out.print(", Max: ");
+    out.println(journal->getLatencyMax());
+  };
+};
+
+#endif
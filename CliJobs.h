@@ -0,0 +1,309 @@
+#ifndef CLI_JOBS_H
+#define CLI_JOBS_H
+
+#include <SD.h>
+
+#include "Defaults.h"
+#include "LogIndex.h"
+#include "Logger.h"
+#include "Utils.h"
+
+#define CLI_JOB_MAX_DEPTH   4       // Directory levels a listing descends
+#define CLI_JOB_BLOCK       256     // Bytes a dump prints per step
+
+/*
+  Long CLI commands (listings, dumps, removing logs) as resumable jobs. A job is an explicit state machine:
+  each step does a bounded amount of work (a directory entry, a block of a file) and keeps its position
+  in members, so CliDevice can run it in time slices between main loop passes (see CliDevice::run).
+*/
+class CliJob {
+public:
+  virtual unsigned long getBudget() = 0;    // uS of steps per slice
+  virtual int step(Print & out) = 0;        // Returns 0 when there's nothing left to do
+  virtual void stop() = 0;                  // Closes files. Also when cancelled
+};
+
+/*
+  Lists a directory, with sizes, descending into subdirectories up to CLI_JOB_MAX_DEPTH levels.
+  With a suffix, only the names of the files in path that end with it (e.g. ".MP3").
+*/
+class DirectoryJob : public CliJob {
+
+  File dirs[CLI_JOB_MAX_DEPTH];
+  int depth;                    // Index in dirs of the directory being read. -1: done
+  const char * suffix;
+
+  int matches(const char * name){
+    size_t n = strlen(name);
+    size_t s = strlen(suffix);
+    return n > s && strcmp(name + n - s, suffix) == 0;
+  };
+
+public:
+
+  DirectoryJob() : depth(-1), suffix(nullptr) {
+  };
+
+  int start(const char * path, const char * suffix = nullptr){
+    this->suffix = suffix;
+    dirs[0] = SD.open(path);
+    depth = dirs[0] ? 0 : -1;
+    return depth == 0;
+  };
+
+  virtual unsigned long getBudget(){
+    return CLI_BUDGET_LIST;
+  };
+
+  virtual int step(Print & out){
+    if(depth < 0){
+      return 0;
+    }
+    File entry = dirs[depth].openNextFile();
+    if(!entry){
+      dirs[depth].close();
+      depth--;
+      return depth >= 0;
+    }
+
+    if(suffix){
+      if(!entry.isDirectory() && matches(entry.name())){
+        out.println(entry.name());
+      }
+      entry.close();
+      return 1;
+    }
+
+    for(int i = 0; i < depth; i++){
+      out.print('\t');
+    }
+    out.print(entry.name());
+    if(entry.isDirectory()){
+      out.println("/");
+      if(depth + 1 < CLI_JOB_MAX_DEPTH){
+        dirs[++depth] = entry;
+        return 1;
+      }
+    } else {
+      // files have sizes, directories do not
+      out.print("\t\t");
+      out.println(entry.size(), DEC);
+    }
+    entry.close();
+    return 1;
+  };
+
+  virtual void stop(){
+    for(; depth >= 0; depth--){
+      dirs[depth].close();
+    }
+  };
+};
+
+// Prints a file, CLI_JOB_BLOCK bytes per step. Log files are NUL padded (LogFileWriter): skipNul
+class FileDumpJob : public CliJob {
+
+  File file;
+  int hex;
+  int skipNul;
+
+public:
+
+  FileDumpJob() : hex(0), skipNul(0) {
+  };
+
+  int start(const char * name, int hex, int skipNul){
+    this->hex = hex;
+    this->skipNul = skipNul;
+    file = SD.open(name, O_READ);
+    return file ? 1 : 0;
+  };
+
+  virtual unsigned long getBudget(){
+    return CLI_BUDGET_DUMP;
+  };
+
+  virtual int step(Print & out){
+    if(!file){
+      return 0;
+    }
+    if(!file.available()){
+      file.close();
+      return 0;
+    }
+
+    char b[CLI_JOB_BLOCK];
+    int r = file.readBytes(b, sizeof(b));
+    if(hex){
+      Utils::dumpHex(&out, b, r);
+      return 1;
+    }
+    int start = 0;
+    for(int i = 0; i <= r; i++){
+      if(i == r || (skipNul && b[i] == '\0')){
+        if(i > start){
+          out.write(b + start, i - start);
+        }
+        start = i + 1;
+      }
+    }
+    return 1;
+  };
+
+  virtual void stop(){
+    if(file){
+      file.close();
+    }
+  };
+};
+
+// All the error log segments in the index, oldest first
+class LogDumpJob : public CliJob {
+
+  LogIndex index;
+  FileDumpJob segment;
+  int oldest;
+  int next;                     // Segments opened so far
+
+public:
+
+  LogDumpJob() : oldest(-1), next(0) {
+  };
+
+  int start(){
+    if(!index.open(0)){
+      return 0;
+    }
+    oldest = index.oldest();
+    next = 0;
+    return 1;
+  };
+
+  virtual unsigned long getBudget(){
+    return CLI_BUDGET_DUMP;
+  };
+
+  virtual int step(Print & out){
+    if(segment.step(out)){
+      return 1;
+    }
+    // One segment opened per step, so an empty index doesn't take a long slice
+    for(; oldest >= 0 && next < LOG_SEGMENTS; next++){
+      LogSegment s;
+      if(index.read((oldest + next) % LOG_SEGMENTS, s) && s.sequence){
+        char fileName[30];
+        LogIndex::segmentName(fileName, sizeof(fileName), s.sequence);
+        next++;
+        segment.start(fileName, 0, 1);
+        return 1;
+      }
+    }
+    index.close();
+    return 0;
+  };
+
+  virtual void stop(){
+    segment.stop();
+    index.close();
+    next = LOG_SEGMENTS;
+  };
+};
+
+/*
+  Removes the error log segments and the index, then everything else in the folder (journal, files from
+  older versions). One file per step. The error log must be closed (FileLogger::close).
+*/
+class LogRemoveJob : public CliJob {
+
+  enum { SEGMENTS, INDEX, FOLDER, DONE } state;
+  LogIndex index;
+  File folder;
+  FileLogger * log;             // Suspended until the job ends, so it doesn't reopen the files being removed
+  int slot;
+  int removed;
+
+public:
+
+  LogRemoveJob() : state(DONE), log(nullptr), slot(0), removed(0) {
+  };
+
+  void start(FileLogger * log){
+    this->log = log;
+    log->suspend();
+    removed = 0;
+    slot = 0;
+    state = index.open(0) ? SEGMENTS : FOLDER;
+  };
+
+  virtual unsigned long getBudget(){
+    return CLI_BUDGET_REMOVE;
+  };
+
+  virtual int step(Print & out){
+    switch(state){
+      case SEGMENTS: {
+        LogSegment s;
+        if(index.read(slot, s) && s.sequence){
+          char fileName[30];
+          LogIndex::segmentName(fileName, sizeof(fileName), s.sequence);
+          if(SD.remove(fileName)){ removed++; }
+        }
+        if(++slot == LOG_SEGMENTS){
+          index.close();
+          state = INDEX;
+        }
+        return 1;
+      }
+
+      case INDEX:
+        if(SD.remove(LOG_INDEX_FILE)){ removed++; }
+        state = FOLDER;
+        return 1;
+
+      case FOLDER: {
+        if(!folder){
+          folder = SD.open("LOG");
+          if(!folder){
+            state = DONE;
+            return 1;
+          }
+        }
+        File entry = folder.openNextFile();
+        if(!entry){
+          folder.close();
+          state = DONE;
+          return 1;
+        }
+        char fileName[30];
+        snprintf(fileName, sizeof(fileName), "LOG/%s", entry.name());
+        entry.close();
+        if(SD.remove(fileName)){ removed++; }
+        return 1;
+      }
+
+      default:
+        if(removed == 0){
+          out.println("No files to remove");
+        } else {
+          out.print("Removed ");
+          out.print(removed);
+          out.println(" files.");
+        }
+        return 0;
+    }
+  };
+
+  virtual void stop(){
+    index.close();
+    if(folder){
+      folder.close();
+    }
+    if(log){
+      log->resume();
+      log = nullptr;
+    }
+    state = DONE;
+  };
+};
+
+#endif
@@ -13,17 +13,37 @@
 #include "Relay.h"
 #include "AudioBoard.h"
 #include "CBUSConfig.h"
-
-ConsoleLogger trace("DEBUG");
-ConsoleLogger info("INFO ");
+#include "CBUSNode.h"
+#include "CBUSJournal.h"
+#include "CBUSTraffic.h"
+#include "Idle.h"
+#include "LatencyTrace.h"
+
+LogRing logRing;
+TraceLogger trace("DEBUG");
+InfoLogger info("INFO ");
 FileLogger    error("ERROR", 1);   //1: Verbose
 
 // Core modules
 Actions actions;
 Dispatcher<Actions> dispatcher(&actions);
+
+// Common actions, fixed at compile time. Periods in mS
+StaticTasks<Actions,
+  STATIC_TASK(Actions, "CBUS", &Actions::checkCBUSCommandAction, 10),           //Frames are queued by the CAN interrupt, drain them often
+  STATIC_TASK(Actions, "KEYS", &Actions::checkKeyAction, 50),                   //The activity ends on a one-shot timer (ACTIVITY_DURATION)
+  STATIC_TASK(Actions, "AUDI", &Actions::checkAudioActivity, 100),              //Produces track start/end events
+  STATIC_TASK(Actions, "JRNL", &Actions::checkCBUSJournal, SEC_TO_MILLIS(1)),   //Writes the CBUS event journal to SD
+  STATIC_TASK(Actions, "CANH", &Actions::checkCBUSHealth, SEC_TO_MILLIS(1))     //Samples CAN controller errors and bus load
+> tasks;
 Keys keys;
 CBUS cbus;
 CBUSConfig config;
+CBUSNode node;
+CBUSJournal journal;
+CBUSTraffic traffic;
+Idle idle;
+LatencyTracer latency;
 Relay relay;
 AudioBoard audio;
 
@@ -36,16 +56,41 @@ void keepAlive(){
   Watchdog.reset();
 }
 
+// Track names in the configuration resolve to audio catalog handles
+int resolveTrack(const char * track){
+  return audio.find(track);
+}
+
 static CliContext context = {
   .relay = &relay,
   .audio = &audio,
   .dispatcher = &dispatcher,
   .config = &config,
+  .cbus = &cbus,
+  .node = &node,
+  .journal = &journal,
+  .traffic = &traffic,
+  .idle = &idle,
+  .latency = &latency,
   .keepAlive = keepAlive
 };
 
 static CliDevice cli(&Serial, &Serial, &context);
 
+/*
+  How long loop() can sleep: until the next dispatcher deadline, unless there's work pending.
+  Log records waiting for Serial: one SysTick, USB TX completes on an interrupt.
+*/
+unsigned long idleTime(){
+  if(cbus.available() || cbus.getTxQueued() || node.isBusy() || traffic.isRunning() || cli.isBusy() || Serial.available()){
+    return 0;
+  }
+  if(logRing.pending()){
+    return 1;
+  }
+  return dispatcher.millisToNextDue(audio.isPlaying() ? AUDIO_FEED_INTERVAL : IDLE_MAX_SLEEP);
+}
+
 void setup(){
 
   Watchdog.disable();
@@ -58,30 +103,40 @@ void setup(){
   //Initialize hardware & halt if any failures (can't function with these modules down)
   relay.init();
   auto ret = audio.init();
+  config.setTrackResolver(resolveTrack);   //Catalog built by audio.init
   ret += config.init("CBCFG.TXT");
-  ret += cbus.init();
+  ret += cbus.init(config.getNodeNumber(), config.getModuleNodeNumber(), config.useHardwareFilters());  //Config must be loaded first: filters are built from NN
 
   if(ret > 0){
-    trace.log("Main", "Initialization failed. Halting execution");
+    LOG_INFO(Main, "Initialization failed. Halting execution");
+    logRing.drainAll(Serial);
+    error.flush();
     while(1){
       delay(10);
     }
   }
 
-  actions.init(&relay, &audio, &cbus, &config, &keys, &dispatcher, keepAlive);
+  cbus.setCanId(config.getCanId());
+  audio.setQueueing(config.getAudioQueue());
+  for(int i = 0; i < config.getBankCount(); i++){
+    audio.preload(config.getBankTrack(i));
+  }
+  node.init(&cbus, &config);
+  traffic.init(&cbus, &journal);
+  keys.attachInterrupt();
+  idle.init(&cbus, &keys, &Serial);
+
+  actions.init(&relay, &audio, &cbus, &config, &node, &journal, &keys, &dispatcher, keepAlive);
 
-  // //Common actions -> 1 TICK = 1 sec (TICK_IN_MILLIS in Defaults.h) 
-  dispatcher.add("CBUS", "Looks for CBUS Commands", &Actions::checkCBUSCommandAction, SEC_TO_TICKS(1));
-  dispatcher.add("KEYS", "Check for Pushbutton press", &Actions::checkKeyAction, HALF_SECOND);       //These 2 tasks work jointly, and must have the same scheduling
-  dispatcher.add( "ACTI", "Checks module activity", &Actions::checkPushButtonActivity, HALF_SECOND);
+  dispatcher.setTasks(&tasks);
 
   //Uncomment for testing actions through the CLIs
   #ifndef RELEASE
     dispatcher.disableAllActions();
   #endif
 
-  trace.log("Main", "Startup complete");
-  trace.log("Main - V:", DEVICE_VERSION); 
+  LOG_INFO(Main, "Startup complete");
+  LOG_INFO(Main, "Version: ", DEVICE_VERSION); 
 
   //Last acction is to enable WDT with ~10 seconds alarm. Anything that will take time should call "keepALive" tpo avoid a reset.
   Watchdog.enable(WDT_TIMEOUT);
@@ -94,6 +149,25 @@ void loop(){
   
   dispatcher.dispatch();
 
+  // Reads ahead the track playing. The DREQ interrupt sends it
+  audio.poll();
+
+  // Produced events and FLiM responses are queued, load them into the CAN controller as TX buffers free up
+  node.poll();
+  cbus.pumpTx();
+
+  // Replay and load tests (CLI), idle otherwise
+  traffic.poll();
+
   // If no actions, check if tehre are any commands on the terminal
   cli.run();
+
+  // Console log records, as much as Serial takes without blocking, if the host has the port open
+  logRing.drain(Serial, Serial.dtr());
+
+  // Buffered error log records, on a timer
+  error.poll();
+
+  // Nothing to do until the next deadline. CAN, the push button or Serial wake us earlier
+  idle.sleep(idleTime());
 }
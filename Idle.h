@@ -0,0 +1,129 @@
+#ifndef IDLE_H
+#define IDLE_H
+
+#include <Arduino.h>
+
+#include "Defaults.h"
+#include "CBUS.h"
+#include "Keys.h"
+
+enum IdleWake { IDLE_WAKE_DEADLINE = 0, IDLE_WAKE_CAN, IDLE_WAKE_KEY, IDLE_WAKE_SERIAL, IDLE_WAKE_SOURCES };
+
+/*
+  Sleeps (WFI) from the end of loop() until the next dispatcher deadline, instead of spinning.
+  IDLE sleep mode 0 only stops the CPU clock: USB, SPI, the EIC and SysTick (millis) keep running, and any
+  interrupt wakes the core. We go back to sleep unless the deadline passed or there is something for loop():
+  a frame queued by CAN_INT, the push button, or input on Serial. The VS1053 is fed from its DREQ interrupt,
+  out of RAM. While a track plays, the sketch caps the sleep at AUDIO_FEED_INTERVAL, so the audio feeder
+  reads ahead from SD in time.
+  Standby is not used: it stops USB and SysTick. Sleeps are capped at IDLE_MAX_SLEEP, well below
+  WDT_TIMEOUT, and loop() kicks the watchdog every time round.
+*/
+class Idle {
+
+  CBUS * cbus;
+  Keys * keys;
+  Stream * serial;
+  int enabled;
+
+  unsigned long long asleep;      // uS
+  unsigned long long awake;       // uS
+  unsigned long lastWake;         // micros()
+  unsigned long sleeps;
+  unsigned long wakes[IDLE_WAKE_SOURCES];
+
+public:
+
+  Idle() : cbus(nullptr), keys(nullptr), serial(nullptr), enabled(IDLE_ENABLED) {
+    resetStats();
+  };
+
+  // keys: with its interrupt attached (Keys::attachInterrupt)
+  void init(CBUS * cbus, Keys * keys, Stream * serial){
+    this->cbus = cbus;
+    this->keys = keys;
+    this->serial = serial;
+    lastWake = micros();
+  };
+
+  int isEnabled(){
+    return enabled;
+  };
+
+  void setEnabled(int e){
+    enabled = e;
+  };
+
+  // Sleeps up to ms (IDLE_MAX_SLEEP at most). Returns the IDLE_WAKE_* reason
+  int sleep(unsigned long ms){
+    if(!enabled || ms == 0){
+      return IDLE_WAKE_DEADLINE;
+    }
+    if(ms > IDLE_MAX_SLEEP){
+      ms = IDLE_MAX_SLEEP;
+    }
+
+    unsigned long start = micros();
+    awake += start - lastWake;
+    unsigned long edges = keys->getEdges();
+    int reason = IDLE_WAKE_DEADLINE;
+
+    SCB->SCR &= ~SCB_SCR_SLEEPDEEP_Msk;
+    PM->SLEEP.reg = PM_SLEEP_IDLE_CPU;
+    while(micros() - start < ms * 1000UL){
+      if(cbus->available()){
+        reason = IDLE_WAKE_CAN;
+        break;
+      }
+      if(keys->getEdges() != edges){
+        reason = IDLE_WAKE_KEY;
+        break;
+      }
+      if(serial->available()){
+        reason = IDLE_WAKE_SERIAL;
+        break;
+      }
+      __DSB();
+      __WFI();
+    }
+
+    lastWake = micros();
+    asleep += lastWake - start;
+    sleeps++;
+    wakes[reason]++;
+    return reason;
+  };
+
+  void resetStats(){
+    asleep = 0;
+    awake = 0;
+    sleeps = 0;
+    memset(wakes, 0, sizeof(wakes));
+    lastWake = micros();
+  };
+
+  void printStats(Print & out){
+    unsigned long long total = asleep + awake;
+    out.print("Idle: ");
+    out.print(enabled ? "enabled" : "disabled");
+    out.print(", Asleep: ");
+    out.print((unsigned long)(asleep / 1000));
+    out.print(" mS, Awake: ");
+    out.print((unsigned long)(awake / 1000));
+    out.print(" mS, Asleep: ");
+    out.print(total ? (unsigned long)(asleep * 100 / total) : 0);
+    out.println("%");
+    out.print("Sleeps: ");
+    out.print(sleeps);
+    out.print(". Woken by deadline: ");
+    out.print(wakes[IDLE_WAKE_DEADLINE]);
+    out.print(", CAN: ");
+    out.print(wakes[IDLE_WAKE_CAN]);
+    out.print(", Push button: ");
+    out.print(wakes[IDLE_WAKE_KEY]);
+    out.print(", Serial: ");
+    out.println(wakes[IDLE_WAKE_SERIAL]);
+  };
+};
+
+#endif
@@ -0,0 +1,155 @@
+#ifndef LATENCY_TRACE_H
+#define LATENCY_TRACE_H
+
+#include <Arduino.h>
+
+#include "Defaults.h"
+
+// Points on the way from a trigger to sound. Each is stamped once per trace
+enum LatencyStage {
+  LATENCY_TRIGGER = 0,    // CAN interrupt read the frame / push button edge interrupt
+  LATENCY_PICKUP,         // Main loop took the frame from the queue / saw the button
+  LATENCY_LOOKUP,         // Config lookup done (mappings, default track)
+  LATENCY_PLAY,           // AudioBoard::play entered
+  LATENCY_OPEN,           // Track file open (ID3 skipped)
+  LATENCY_FEED,           // First data written to the VS1053
+  LATENCY_STAGES
+};
+
+enum LatencyPath { LATENCY_PATH_CAN = 0, LATENCY_PATH_BUTTON, LATENCY_PATHS };
+
+// Where the first bytes came from
+enum LatencySource { LATENCY_SOURCE_SD = 0, LATENCY_SOURCE_BANK, LATENCY_SOURCES };
+
+typedef struct {
+  byte path;
+  byte source;
+  byte stamped;                     // Bit per stage
+  unsigned long at[LATENCY_STAGES]; // micros()
+} LatencyRecord;
+
+/*
+  Trigger to sound latency. A trace is started by the trigger (begin), stamped along the way (mark) and kept
+  (end) only if it got to AudioBoard::play: the last LATENCY_TRACES of them, in a RAM ring. The report gives,
+  per path, source and stage, p50/p95/max of the time since the previous stage stamped, and of the whole
+  trigger to feed. Sound bank clips are fed before their file is opened, so they have no open stage.
+  Stamps are micros(): the SysTick counter, 1 uS resolution, readable from ISRs. It is the clock the CAN
+  interrupt already stamps frames with, so the first stage comes for free.
+  Main loop only (the ISR stamps arrive through the frame and Keys).
+*/
+class LatencyTracer {
+
+  LatencyRecord records[LATENCY_TRACES];
+  int head;                         // Next record to write
+  int count;
+  LatencyRecord current;
+  int active;
+
+  // Time to stage from the previous one stamped (stage 0: the whole trace, trigger to feed), sorted
+  int collect(int path, int source, int stage, unsigned long * values){
+    int to = stage ? stage : LATENCY_FEED;
+    int n = 0;
+    for(int i = 0; i < count; i++){
+      const LatencyRecord & r = records[i];
+      if(r.path != path || r.source != source || !(r.stamped & (1 << to))){
+        continue;
+      }
+      int from = stage ? stage - 1 : LATENCY_TRIGGER;
+      for(; from > LATENCY_TRIGGER && !(r.stamped & (1 << from)); from--);
+      values[n++] = r.at[to] - r.at[from];
+    }
+    // Insertion sort: at most LATENCY_TRACES values
+    for(int i = 1; i < n; i++){
+      unsigned long v = values[i];
+      int j = i - 1;
+      for(; j >= 0 && values[j] > v; j--){
+        values[j + 1] = values[j];
+      }
+      values[j + 1] = v;
+    }
+    return n;
+  };
+
+public:
+
+  LatencyTracer() : head(0), count(0), active(0) {
+  };
+
+  // at: when the trigger happened (frame timestamp, button edge)
+  void begin(byte path, unsigned long at){
+    memset(&current, 0, sizeof(current));
+    current.path = path;
+    current.at[LATENCY_TRIGGER] = at;
+    current.stamped = 1 << LATENCY_TRIGGER;
+    active = 1;
+  };
+
+  void setSource(byte source){
+    current.source = source;
+  };
+
+  void mark(byte stage){
+    if(active && !(current.stamped & (1 << stage))){
+      current.at[stage] = micros();
+      current.stamped |= 1 << stage;
+    }
+  };
+
+  void end(){
+    if(active && (current.stamped & (1 << LATENCY_PLAY))){
+      records[head] = current;
+      head = (head + 1) % LATENCY_TRACES;
+      if(count < LATENCY_TRACES){
+        count++;
+      }
+    }
+    active = 0;
+  };
+
+  void reset(){
+    head = 0;
+    count = 0;
+    active = 0;
+  };
+
+  void printReport(Print & out){
+    static const char * paths[] = { "CAN event", "Push button" };
+    static const char * sources[] = { "SD card", "Sound bank" };
+    static const char * stages[] = { "Trigger to feed", "Pickup", "Lookup", "Play", "Open", "Feed" };
+    unsigned long values[LATENCY_TRACES];
+
+    out.print("Traces: ");
+    out.print(count);
+    out.print("/");
+    out.println(LATENCY_TRACES);
+    for(int path = 0; path < LATENCY_PATHS; path++){
+      for(int source = 0; source < LATENCY_SOURCES; source++){
+        if(!collect(path, source, LATENCY_TRIGGER, values)){
+          continue;
+        }
+        out.print(paths[path]);
+        out.print(", ");
+        out.print(sources[source]);
+        out.println(". uS since the previous stage: n, p50, p95, max");
+        for(int stage = 0; stage < LATENCY_STAGES; stage++){
+          int n = collect(path, source, stage, values);
+          if(!n){
+            continue;
+          }
+          out.print("  ");
+          out.print(stages[stage]);
+          out.print(": ");
+          out.print(n);
+          out.print(", ");
+          out.print(values[(n - 1) * 50 / 100]);
+          out.print(", ");
+          out.print(values[(n - 1) * 95 / 100]);
+          out.print(", ");
+          out.println(values[n - 1]);
+        }
+      }
+    }
+  };
+};
+
+#endif
@@ -0,0 +1,133 @@
+#ifndef LOG_BINARY_H
+#define LOG_BINARY_H
+
+#include <Arduino.h>
+
+/*
+  Tokenized log records. Instead of "LEVEL|module|msg|value" a record carries the ID of "module|msg"
+  (FNV-1a, computed by the compiler), a timestamp and the raw argument:
+
+    byte 0     level (low nibble, LOG_LEVEL_*) | clock (high nibble, LOG_CLOCK_*)
+    byte 1     argument type (LOG_ARG_*)
+    bytes 2-5  ID, little endian
+    bytes 6-9  timestamp, little endian
+    argument   STRING/BUFFER: length (1 byte) + bytes. VALUE: 4 bytes LE. HEX: 1 byte.
+               ENCODED: content type as STRING, then length (2 bytes LE) + body
+
+  Records are written as a text line: LOG_BINARY_MARK, the record in base64, '\n'. That keeps them
+  line framed, so they go through the log ring (which drops whole lines), NUL padded log files and
+  serial captures mixed with CLI output. tools/logdecode.py turns them back into text, with the ID
+  table that tools/logtable.py extracts from the sources.
+*/
+
+#define LOG_BINARY_MARK   '~'
+
+#define LOG_CLOCK_MILLIS  0     //Console: millis()
+#define LOG_CLOCK_EPOCH   1     //Files: RTC epoch
+
+enum LogArgType { LOG_ARG_NONE = 0, LOG_ARG_STRING, LOG_ARG_VALUE, LOG_ARG_HEX, LOG_ARG_BUFFER, LOG_ARG_ENCODED };
+
+// FNV-1a. constexpr: IDs of literal messages are computed at compile time (see LOG_ID in Logger.h)
+constexpr uint32_t logHash(const char * s, uint32_t h = 2166136261UL){
+  return *s ? logHash(s + 1, (h ^ (uint8_t)*s) * 16777619UL) : h;
+}
+
+// Forces the hash into a compile time constant
+template<uint32_t ID>
+struct LogId {
+  static constexpr uint32_t value = ID;
+};
+
+// Base64 encodes what is written to it into out
+class LogBinaryWriter : public Print {
+
+  Print & out;
+  byte group[3];
+  int count;
+
+  void emit(int n){
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    char chars[4];
+    chars[0] = alphabet[group[0] >> 2];
+    chars[1] = alphabet[((group[0] & 0x03) << 4) | (group[1] >> 4)];
+    chars[2] = n > 1 ? alphabet[((group[1] & 0x0F) << 2) | (group[2] >> 6)] : '=';
+    chars[3] = n > 2 ? alphabet[group[2] & 0x3F] : '=';
+    out.write((const uint8_t *)chars, sizeof(chars));
+  };
+
+  void writeWord(uint32_t value){
+    for(int i = 0; i < 4; i++){
+      write((uint8_t)(value >> (8 * i)));
+    }
+  };
+
+public:
+
+  LogBinaryWriter(Print & out) : out(out), count(0) {
+  };
+
+  virtual size_t write(uint8_t c){
+    group[count++] = c;
+    if(count == 3){
+      emit(3);
+      count = 0;
+    }
+    return 1;
+  };
+
+  using Print::write;
+
+  void begin(byte level, byte clock, byte type, uint32_t id, uint32_t time){
+    count = 0;
+    out.write(LOG_BINARY_MARK);
+    write((uint8_t)((level & 0x0F) | (clock << 4)));
+    write(type);
+    writeWord(id);
+    writeWord(time);
+  };
+
+  void writeString(const char * s){
+    size_t length = s ? strlen(s) : 0;
+    if(length > 255){
+      length = 255;
+    }
+    write((uint8_t)length);
+    write((const uint8_t *)s, length);
+  };
+
+  void writeValue(uint32_t value){
+    writeWord(value);
+  };
+
+  void writeBuffer(const char * buffer, size_t length){
+    if(length > 255){
+      length = 255;
+    }
+    write((uint8_t)length);
+    write((const uint8_t *)buffer, length);
+  };
+
+  void writeBody(const char * body){
+    size_t length = strlen(body);
+    if(length > 0xFFFF){
+      length = 0xFFFF;
+    }
+    write((uint8_t)length);
+    write((uint8_t)(length >> 8));
+    write((const uint8_t *)body, length);
+  };
+
+  // Pads the last group and ends the line
+  void end(){
+    if(count){
+      for(int i = count; i < 3; i++){
+        group[i] = 0;
+      }
+      emit(count);
+      count = 0;
+    }
+    out.write('\n');
+  };
+};
+
+#endif
@@ -0,0 +1,119 @@
+#ifndef LOG_INDEX_H
+#define LOG_INDEX_H
+
+#include <SD.h>
+
+#include "Defaults.h"
+
+#define LOG_SEGMENTS    (LOG_TOTAL_SIZE / LOG_SEGMENT_SIZE)
+
+static_assert(LOG_SEGMENT_SIZE % LOG_FILE_PREALLOC == 0, "LOG_SEGMENT_SIZE must be a multiple of LOG_FILE_PREALLOC");
+static_assert(LOG_SEGMENTS >= 2, "LOG_TOTAL_SIZE must hold at least 2 segments");
+
+// One per segment. sequence 0: free slot
+typedef struct {
+  uint32_t sequence;
+  uint32_t first;       // Epoch of the first record
+  uint32_t last;        // Epoch of the last record
+  uint32_t records;
+  uint32_t bytes;       // Written, without the NUL padding
+} LogSegment;
+
+/*
+  The error log is a set of fixed size segment files (LOG/Ennnnnnn.LOG, nnnnnnn: sequence). LOG_INDEX_FILE has a
+  slot per segment, sequence % LOG_SEGMENTS, so the segment that a new one replaces is the one in its slot:
+  starting a segment removes the oldest, and the total stays under LOG_TOTAL_SIZE.
+  Listing, dumping and removing logs read the index instead of walking the LOG folder.
+*/
+class LogIndex {
+
+  File file;
+
+public:
+
+  static int slotOf(uint32_t sequence){
+    return sequence % LOG_SEGMENTS;
+  };
+
+  static void segmentName(char * name, size_t size, uint32_t sequence){
+    snprintf(name, size, "LOG/E%07lu.LOG", (unsigned long)sequence);
+  };
+
+  // Opens (creating it, and the LOG folder, if needed) the index. writable: for the logger
+  int open(int writable){
+    if(file){
+      return 1;
+    }
+    if(!writable){
+      file = SD.open(LOG_INDEX_FILE);
+      return file ? 1 : 0;
+    }
+    if(!SD.exists("LOG") && !SD.mkdir("LOG")){
+      return 0;
+    }
+    file = SD.open(LOG_INDEX_FILE, O_READ | O_WRITE | O_CREAT);
+    if(!file){
+      return 0;
+    }
+    // All the slots exist, empty, so updates never extend the file
+    if(file.size() < LOG_SEGMENTS * sizeof(LogSegment)){
+      LogSegment empty;
+      memset(&empty, 0, sizeof(empty));
+      file.seek(file.size() / sizeof(LogSegment) * sizeof(LogSegment));
+      while(file.position() < LOG_SEGMENTS * sizeof(LogSegment)){
+        file.write((const uint8_t *)&empty, sizeof(empty));
+      }
+      file.flush();
+    }
+    return 1;
+  };
+
+  void close(){
+    if(file){
+      file.close();
+    }
+  };
+
+  int read(int slot, LogSegment & segment){
+    if(!file.seek(slot * sizeof(LogSegment)) || file.read(&segment, sizeof(segment)) != sizeof(segment)){
+      memset(&segment, 0, sizeof(segment));
+      return 0;
+    }
+    return 1;
+  };
+
+  int write(const LogSegment & segment){
+    if(!file.seek(slotOf(segment.sequence) * sizeof(LogSegment)) || file.write((const uint8_t *)&segment, sizeof(segment)) != sizeof(segment)){
+      return 0;
+    }
+    file.flush();
+    return 1;
+  };
+
+  // Slot of the oldest segment, so slots can be walked in order: (oldest() + i) % LOG_SEGMENTS. -1: empty
+  int oldest(){
+    int slot = -1;
+    uint32_t sequence = 0;
+    LogSegment segment;
+    for(int i = 0; i < LOG_SEGMENTS; i++){
+      if(read(i, segment) && segment.sequence && (slot < 0 || segment.sequence < sequence)){
+        slot = i;
+        sequence = segment.sequence;
+      }
+    }
+    return slot;
+  };
+
+  // Newest segment, sequence 0 if there's none
+  void newest(LogSegment & newest){
+    memset(&newest, 0, sizeof(newest));
+    LogSegment segment;
+    for(int i = 0; i < LOG_SEGMENTS; i++){
+      if(read(i, segment) && segment.sequence > newest.sequence){
+        newest = segment;
+      }
+    }
+  };
+};
+
+#endif
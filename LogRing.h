@@ -0,0 +1,239 @@
+#ifndef LOG_RING_H
+#define LOG_RING_H
+
+#include <Arduino.h>
+
+#include "Defaults.h"
+
+/*
+  RAM sink for the console loggers. A record is formatted into a line buffer (beginRecord, print..., endRecord)
+  and then copied whole into the ring, after a length byte, so logging never waits for Serial. The ring is
+  drained from the main loop. When a record does not fit, the oldest whole records are dropped (and counted):
+  a hex dump is one record of several lines. Main loop only: not for ISRs.
+  The USB serial port reports 63 bytes free whether or not the host is reading (availableForWrite), and a
+  write then waits for the USB timeout. So drain only writes while the host has the port open (DTR), a USB
+  packet at a time, and backs off for LOG_DRAIN_BACKOFF when a write was slow.
+*/
+class LogRing : public Print {
+
+  static_assert(LOG_RING_SIZE > 0 && (LOG_RING_SIZE & (LOG_RING_SIZE - 1)) == 0, "LOG_RING_SIZE must be a power of 2");
+  static_assert(LOG_RECORD_SIZE <= 255, "LOG_RECORD_SIZE must fit the record length byte");
+
+  char ring[LOG_RING_SIZE];
+  unsigned int head;              // Free running. Next byte to write
+  unsigned int tail;              // Free running. Next byte to drain
+  unsigned int drainLeft;         // Bytes of the record at tail not drained yet. 0: tail is at a length byte
+
+  char record[LOG_RECORD_SIZE];
+  unsigned int recordLength;
+  int recordTruncated;
+
+  unsigned long records;
+  unsigned long dropped;          // Records lost to make room for newer ones
+  unsigned long truncated;        // Records longer than LOG_RECORD_SIZE
+  unsigned long bytesLogged;
+  unsigned long bytesDrained;
+  unsigned long stalls;           // Drains with data pending but no TX space, the port closed or the host not reading
+  unsigned long backoffAt;        // millis() of the last slow write. 0: none
+  unsigned int maxUsed;
+  unsigned long since;            // millis() of the last resetStats
+
+  unsigned int used() const {
+    return head - tail;
+  };
+
+  char & at(unsigned int position){
+    return ring[position & (LOG_RING_SIZE - 1)];
+  };
+
+  /*
+    Drops the oldest whole record. If the one at tail is being drained, the one after it goes instead, and the
+    rest of the one being drained moves up to take its place, so the console never gets part of a record.
+  */
+  void dropOldest(){
+    if(!drainLeft){
+      tail += 1 + (byte)at(tail);
+      dropped++;
+      return;
+    }
+    unsigned int next = tail + drainLeft;
+    if(next == head){
+      tail = head;
+      drainLeft = 0;
+      dropped++;
+      return;
+    }
+    unsigned int skip = 1 + (byte)at(next);
+    for(unsigned int i = drainLeft; i-- > 0; ){
+      at(tail + skip + i) = at(tail + i);
+    }
+    tail += skip;
+    dropped++;
+  };
+
+public:
+
+  LogRing() : head(0), tail(0), drainLeft(0), recordLength(0), recordTruncated(0), backoffAt(0) {
+    resetStats();
+  };
+
+  void beginRecord(){
+    recordLength = 0;
+    recordTruncated = 0;
+  };
+
+  // Print: appends to the record being formatted
+  virtual size_t write(uint8_t c){
+    if(recordLength >= sizeof(record)){
+      recordTruncated = 1;
+      return 0;
+    }
+    record[recordLength++] = c;
+    return 1;
+  };
+
+  using Print::write;
+
+  void endRecord(){
+    if(recordTruncated){
+      record[recordLength - 1] = '\n';
+      truncated++;
+    }
+    if(!recordLength){
+      return;
+    }
+
+    while(LOG_RING_SIZE - used() < recordLength + 1){
+      dropOldest();
+    }
+    at(head) = recordLength;
+    for(unsigned int i = 0; i < recordLength; i++){
+      at(head + 1 + i) = record[i];
+    }
+    head += recordLength + 1;
+
+    records++;
+    bytesLogged += recordLength;
+    if(used() > maxUsed){
+      maxUsed = used();
+    }
+  };
+
+  // Bytes waiting to be drained
+  unsigned int pending() const {
+    return used();
+  };
+
+  /*
+    Writes to out up to a USB packet (LOG_DRAIN_CHUNK), if it takes it without blocking. connected: the host
+    has the port open (Serial.dtr()). Returns the bytes written
+  */
+  int drain(Print & out, int connected = 1){
+    if(!used()){
+      return 0;
+    }
+    if(backoffAt && millis() - backoffAt < LOG_DRAIN_BACKOFF){
+      return 0;
+    }
+    backoffAt = 0;
+
+    unsigned int space = out.availableForWrite();
+    if(!space || !connected){
+      stalls++;
+      return 0;
+    }
+    if(space > LOG_DRAIN_CHUNK){
+      space = LOG_DRAIN_CHUNK;
+    }
+
+    unsigned long start = micros();
+    unsigned int written = 0;
+    while(written < space && used()){
+      if(!drainLeft){
+        drainLeft = (byte)at(tail);
+        tail++;
+      }
+      // Up to the end of the record, or of the ring
+      unsigned int offset = tail & (LOG_RING_SIZE - 1);
+      unsigned int n = space - written;
+      if(n > drainLeft){
+        n = drainLeft;
+      }
+      if(n > LOG_RING_SIZE - offset){
+        n = LOG_RING_SIZE - offset;
+      }
+      n = out.write((const uint8_t *)&ring[offset], n);
+      if(!n){
+        break;
+      }
+      tail += n;
+      drainLeft -= n;
+      written += n;
+    }
+    bytesDrained += written;
+
+    if(micros() - start > LOG_DRAIN_SLOW){
+      stalls++;
+      backoffAt = millis() | 1;
+    }
+    return written;
+  };
+
+  // Blocking. For paths that don't return to the main loop (halt, reset)
+  void drainAll(Print & out){
+    while(used()){
+      if(!drainLeft){
+        drainLeft = (byte)at(tail);
+        tail++;
+        continue;
+      }
+      out.write(at(tail));
+      tail++;
+      drainLeft--;
+      bytesDrained++;
+    }
+  };
+
+  void resetStats(){
+    records = 0;
+    dropped = 0;
+    truncated = 0;
+    bytesLogged = 0;
+    bytesDrained = 0;
+    stalls = 0;
+    maxUsed = used();
+    since = millis();
+  };
+
+  void printStats(Print & out){
+    unsigned long seconds = (millis() - since) / 1000;
+    out.print("Log ring: ");
+    out.print(used());
+    out.print("/");
+    out.print(LOG_RING_SIZE);
+    out.print(" bytes, Max used: ");
+    out.println(maxUsed);
+    out.print("Records: ");
+    out.print(records);
+    out.print(", Dropped: ");
+    out.print(dropped);
+    out.print(", Truncated: ");
+    out.println(truncated);
+    out.print("Bytes logged: ");
+    out.print(bytesLogged);
+    out.print(", Drained: ");
+    out.print(bytesDrained);
+    out.print(", Stalled (TX full, port closed or slow host): ");
+    out.println(stalls);
+    if(seconds > 0){
+      out.print("Per second. Records: ");
+      out.print(records / seconds);
+      out.print(", Bytes logged: ");
+      out.print(bytesLogged / seconds);
+      out.print(", Bytes drained: ");
+      out.println(bytesDrained / seconds);
+    }
+  };
+};
+
+#endif
@@ -7,60 +7,411 @@
 #include "Defaults.h"
 #include "StringStream.h"
 #include "Utils.h"
+#include "LogRing.h"
+#include "LogBinary.h"
+#include "LogIndex.h"
+
+extern LogRing logRing;
+
+// Log levels. Console logging below LOG_LEVEL (Defaults.h) is removed at compile time
+#define LOG_LEVEL_TRACE   0
+#define LOG_LEVEL_INFO    1
+#define LOG_LEVEL_ERROR   2
+#define LOG_LEVEL_NONE    3
+
+// Modules, for the compile time (LOG_MODULES in Defaults.h) and runtime masks. The suffix is the name printed
+#define LOG_MODULE_Main         0x0001
+#define LOG_MODULE_Actions      0x0002
+#define LOG_MODULE_AudioBoard   0x0004
+#define LOG_MODULE_CBUS         0x0008
+#define LOG_MODULE_CBUSConfig   0x0010
+#define LOG_MODULE_CBUSNode     0x0020
+#define LOG_MODULE_CBUSTraffic  0x0040
+#define LOG_MODULE_Dispatcher   0x0080
+#define LOG_MODULES_ALL         0xFFFF
+
+typedef struct {
+  const char * name;
+  unsigned int mask;
+} LogModule;
+
+static const LogModule logModules[] = {
+  { "Main", LOG_MODULE_Main },
+  { "Actions", LOG_MODULE_Actions },
+  { "AudioBoard", LOG_MODULE_AudioBoard },
+  { "CBUS", LOG_MODULE_CBUS },
+  { "CBUSConfig", LOG_MODULE_CBUSConfig },
+  { "CBUSNode", LOG_MODULE_CBUSNode },
+  { "CBUSTraffic", LOG_MODULE_CBUSTraffic },
+  { "Dispatcher", LOG_MODULE_Dispatcher },
+  { nullptr, 0 }
+};
 
-//Simple logger to console (Serial)
+/*
+  Simple logger to console (Serial). Records go to logRing and are written from the main loop.
+  LEVEL is fixed at compile time: use the LOG_* macros below, so calls for a level or module that
+  is compiled out disappear, arguments included. Modules that are compiled in
+  can still be turned off at runtime (setMask).
+  In binary mode records are tokenized (LogBinary.h): id replaces module and msg.
+*/
+template<int LEVEL>
 class ConsoleLogger {
   const char * level;
+  unsigned int mask;
+  int binary;
 
   void logHeader(const char * module, const char * msg){
-    Serial.print(level);
-    Serial.print("|");
-    Serial.print(module);
-    Serial.print("|");
-    Serial.print(msg);
+    logRing.beginRecord();
+    logRing.print(level);
+    logRing.print("|");
+    logRing.print(module);
+    logRing.print("|");
+    logRing.print(msg);
   }
-  
+
+  void binaryHeader(LogBinaryWriter & w, byte type, uint32_t id){
+    logRing.beginRecord();
+    w.begin(LEVEL, LOG_CLOCK_MILLIS, type, id, millis());
+  }
+
 public:
-  ConsoleLogger(const char * level){
+  ConsoleLogger(const char * level) : mask(LOG_MODULES_ALL), binary(0) {
     this->level = level;
   };
 
-  void log(const char * module, const char * msg, const char * msg2 = nullptr){
+  static constexpr bool isCompiled(unsigned int module){
+    return LEVEL >= LOG_LEVEL && (module & LOG_MODULES) != 0;
+  };
+
+  bool isEnabled(unsigned int module) const {
+    return (mask & module) != 0;
+  };
+
+  unsigned int getMask() const {
+    return mask;
+  };
+
+  void setMask(unsigned int m){
+    mask = m;
+  };
+
+  int isBinary() const {
+    return binary;
+  };
+
+  void setBinary(int b){
+    binary = b;
+  };
+
+  void log(uint32_t id, const char * module, const char * msg, const char * msg2 = nullptr){
+    if(binary){
+      LogBinaryWriter w(logRing);
+      binaryHeader(w, msg2 ? LOG_ARG_STRING : LOG_ARG_NONE, id);
+      if(msg2){
+        w.writeString(msg2);
+      }
+      w.end();
+      logRing.endRecord();
+      return;
+    }
     logHeader(module, msg);
     if(msg2){
-      Serial.print("|");
-      Serial.print(msg2);
+      logRing.print("|");
+      logRing.print(msg2);
     }
-    Serial.println();
+    logRing.println();
+    logRing.endRecord();
   };
 
-  void log(const char * module, const char * msg, const unsigned long value){
+  void log(uint32_t id, const char * module, const char * msg, const unsigned long value){
+    if(binary){
+      LogBinaryWriter w(logRing);
+      binaryHeader(w, LOG_ARG_VALUE, id);
+      w.writeValue(value);
+      w.end();
+      logRing.endRecord();
+      return;
+    }
     logHeader(module, msg);
-    Serial.print("|");
-    Serial.println(value);
+    logRing.print("|");
+    logRing.println(value);
+    logRing.endRecord();
   };
 
-  void logHex(const char * module, const char * msg, const char value){
+  void logHex(uint32_t id, const char * module, const char * msg, const char value){
+    if(binary){
+      LogBinaryWriter w(logRing);
+      binaryHeader(w, LOG_ARG_HEX, id);
+      w.write((uint8_t)value);
+      w.end();
+      logRing.endRecord();
+      return;
+    }
     logHeader(module, msg);
-    Serial.print("|");
-    Serial.println(value, HEX);
+    logRing.print("|");
+    logRing.println(value, HEX);
+    logRing.endRecord();
   };
 
-  void logHex(const char * module, const char * msg, const char * buffer, size_t length){
+  void logHex(uint32_t id, const char * module, const char * msg, const char * buffer, size_t length){
+    if(binary){
+      LogBinaryWriter w(logRing);
+      binaryHeader(w, LOG_ARG_BUFFER, id);
+      w.writeBuffer(buffer, length);
+      w.end();
+      logRing.endRecord();
+      return;
+    }
     logHeader(module, msg);
-    Serial.println();
-    Utils::dumpHex(&Serial, buffer, length);
+    logRing.println();
+    Utils::dumpHex(&logRing, buffer, length);
+    logRing.endRecord();
   }
 };
 
+typedef ConsoleLogger<LOG_LEVEL_TRACE> TraceLogger;
+typedef ConsoleLogger<LOG_LEVEL_INFO> InfoLogger;
+
+/*
+  module is one of the LOG_MODULE_ suffixes (not a string) and msg must be a string literal: the
+  record ID is the hash of "module|msg", computed by the compiler. tools/logtable.py finds the same
+  pairs in the sources.
+  The first test in LOG_ENABLED is a constant: when it's false the whole statement is dead code.
+*/
+#define LOG_ID(module, msg)         (LogId<logHash(#module "|" msg)>::value)
+#define LOG_ENABLED(logger, module) (decltype(logger)::isCompiled(LOG_MODULE_##module) && logger.isEnabled(LOG_MODULE_##module))
+#define LOG_TRACE(module, msg, ...)     do { if(LOG_ENABLED(trace, module)) trace.log(LOG_ID(module, msg), #module, msg, ##__VA_ARGS__); } while(0)
+#define LOG_TRACE_HEX(module, msg, ...) do { if(LOG_ENABLED(trace, module)) trace.logHex(LOG_ID(module, msg), #module, msg, ##__VA_ARGS__); } while(0)
+#define LOG_INFO(module, msg, ...)      do { if(LOG_ENABLED(info, module)) info.log(LOG_ID(module, msg), #module, msg, ##__VA_ARGS__); } while(0)
+#define LOG_ERROR(module, msg, ...)     error.log(LOG_ID(module, msg), #module, msg, ##__VA_ARGS__)
+
 typedef enum { MODE_MSG, MODE_VALUE, MODE_ENCODED } MSG_MODE;
 
+#define LOG_SECTOR_SIZE 512
+#define LOG_FILE_MODE   (O_READ | O_WRITE | O_CREAT)    //Not FILE_WRITE: O_APPEND would not let us rewrite the last sector
+
+/*
+  Write-behind buffer for a log file that stays open. The file is preallocated (filled with NULs) in
+  LOG_FILE_PREALLOC chunks, so appends overwrite existing clusters instead of extending the FAT chain.
+  Data goes to the card one whole sector at a time: a sector is written when it's full, or (partially
+  filled, NUL padded) by flush. A partial sector is written again, at the same position, on the next flush.
+  Readers must skip NULs.
+*/
+class LogFileWriter : public Stream {
+
+  File file;
+  char fileName[30];
+  char sector[LOG_SECTOR_SIZE];
+  unsigned int length;            // Bytes of sector in use
+  uint32_t sectorStart;           // File position of sector
+  uint32_t allocated;             // Preallocated file size
+  uint32_t size;                  // File size the writer starts a new file at (isFull)
+  int dirty;                      // sector has data not on the card yet
+  unsigned long lastFlush;        // millis()
+
+  unsigned long sectorWrites;
+  unsigned long flushes;
+  unsigned long openFailures;
+
+  int writeSector(){
+    memset(sector + length, 0, sizeof(sector) - length);
+    if(!file.seek(sectorStart) || file.write((const uint8_t *)sector, sizeof(sector)) != sizeof(sector)){
+      return 0;
+    }
+    sectorWrites++;
+    dirty = 0;
+    return 1;
+  };
+
+  // Fills [from, from + LOG_FILE_PREALLOC) with NULs
+  int preallocate(uint32_t from){
+    memset(sector, 0, sizeof(sector));
+    if(!file.seek(from)){
+      return 0;
+    }
+    for(uint32_t i = 0; i < LOG_FILE_PREALLOC; i += sizeof(sector)){
+      if(file.write((const uint8_t *)sector, sizeof(sector)) != sizeof(sector)){
+        return 0;
+      }
+    }
+    file.flush();
+    allocated = from + LOG_FILE_PREALLOC;
+    return 1;
+  };
+
+  // The sector at position holds records: anything but the NUL padding
+  int hasData(uint32_t position){
+    if(!file.seek(position) || file.read((uint8_t *)sector, sizeof(sector)) != sizeof(sector)){
+      return 0;
+    }
+    for(unsigned int i = 0; i < sizeof(sector); i++){
+      if(sector[i]){
+        return 1;
+      }
+    }
+    return 0;
+  };
+
+  // Sector full: write it and move to the next one. A record that doesn't fit extends the file
+  void nextSector(){
+    writeSector();
+    sectorStart += sizeof(sector);
+    length = 0;
+    if(sectorStart >= allocated){
+      preallocate(sectorStart);
+    }
+  };
+
+public:
+
+  LogFileWriter() : length(0), sectorStart(0), allocated(0), size(0), dirty(0), lastFlush(0), sectorWrites(0), flushes(0), openFailures(0) {
+    fileName[0] = '\0';
+  };
+
+  int isOpen(){
+    return file ? 1 : 0;
+  };
+
+  /*
+    Opens name for appending, up to size bytes. An existing file (e.g. after a reset) continues on the
+    sector boundary after from, the gap is NULs. from comes from the index, which is only updated on flush:
+    full sectors written after it are skipped too, up to the first empty one.
+  */
+  int open(const char * name, uint32_t size, uint32_t from){
+    if(!SD.begin(SD_CS)){
+      openFailures++;
+      return 0;
+    }
+    file = SD.open(name, LOG_FILE_MODE);
+    if(!file){
+      openFailures++;
+      return 0;
+    }
+    strncpy(fileName, name, sizeof(fileName) - 1);
+    fileName[sizeof(fileName) - 1] = '\0';
+    this->size = size;
+    length = 0;
+    dirty = 0;
+    allocated = file.size();
+    sectorStart = from / sizeof(sector) * sizeof(sector);
+    while(sectorStart < allocated && hasData(sectorStart)){
+      sectorStart += sizeof(sector);
+    }
+    if(sectorStart >= allocated && !preallocate(sectorStart)){
+      openFailures++;
+      file.close();
+      return 0;
+    }
+    return 1;
+  };
+
+  // Writes the sector in progress (if there's anything new) and syncs the directory entry
+  void flush(){
+    lastFlush = millis();
+    if(!file || !dirty){
+      return;
+    }
+    writeSector();
+    file.flush();
+    flushes++;
+  };
+
+  void close(){
+    if(file){
+      flush();
+      file.close();
+    }
+    length = 0;
+    allocated = 0;
+  };
+
+  // Called from the main loop. Returns 1 if it wrote to the card
+  int poll(){
+    if(dirty && millis() - lastFlush >= LOG_FLUSH_INTERVAL){
+      flush();
+      return 1;
+    }
+    return 0;
+  };
+
+  // Less than a sector left before size: time for a new file
+  int isFull(){
+    return !file || sectorStart + length + sizeof(sector) > size;
+  };
+
+  // Bytes written, NUL padding excluded
+  uint32_t getSize(){
+    return sectorStart + length;
+  };
+
+  const char * getFileName(){
+    return fileName;
+  };
+
+  unsigned long getSectorWrites(){
+    return sectorWrites;
+  };
+
+  unsigned long getFlushes(){
+    return flushes;
+  };
+
+  unsigned long getOpenFailures(){
+    return openFailures;
+  };
+
+  unsigned int getBuffered(){
+    return dirty ? length : 0;
+  };
+
+  // Print
+  virtual size_t write(uint8_t c){
+    if(!file){
+      return 0;
+    }
+    sector[length++] = c;
+    dirty = 1;
+    if(length == sizeof(sector)){
+      nextSector();
+    }
+    return 1;
+  };
+
+  using Print::write;
+
+  // Stream. Write only
+  virtual int available(){
+    return 0;
+  };
+
+  virtual int read(){
+    return -1;
+  };
+
+  virtual int peek(){
+    return -1;
+  };
+};
+
+/*
+  Error log. Records go to segment files of LOG_SEGMENT_SIZE bytes, listed in the index (LogIndex.h).
+  The index entry of the segment in use is rewritten when its data is flushed.
+*/
 class FileLogger {
 
-  ConsoleLogger verboseLogger;
+  ConsoleLogger<LOG_LEVEL_ERROR> verboseLogger;   //Errors are always compiled in
+  LogFileWriter writer;
+  LogIndex index;
+  LogSegment segment;             // In use. sequence 0: not known yet, read the index
+  int indexDirty;
+  unsigned long segments;         // Started since boot
+  unsigned long evicted;          // Removed to stay under LOG_TOTAL_SIZE
   RTCZero rtc;
   const char * level;
   int verbose;
+  int binary;
+  int suspended;                  // Log files are being removed: records are rejected
+  unsigned long rejected;
 
   void printHeader(Stream & out, const char * module){
     out.print(rtc.getEpoch());
@@ -71,80 +422,219 @@ class FileLogger {
     out.print("|");
   }
 
+  void updateIndex(){
+    if(indexDirty){
+      segment.bytes = writer.getSize();
+      index.write(segment);
+      indexDirty = 0;
+    }
+  };
+
+  // After a reset the newest segment continues if it has room. Otherwise the next one replaces the oldest
+  int openSegment(){
+    if(writer.isOpen()){
+      writer.flush();
+      updateIndex();
+      writer.close();
+    }
+    if(!SD.begin(SD_CS) || !index.open(1)){
+      return 0;
+    }
+
+    char fileName[30];  // 123456789012345678901234567890 
+                        // LOG/Ennnnnnn.LOG
+    if(!segment.sequence){
+      index.newest(segment);
+      if(segment.sequence){
+        LogIndex::segmentName(fileName, sizeof(fileName), segment.sequence);
+        if(writer.open(fileName, LOG_SEGMENT_SIZE, segment.bytes) && !writer.isFull()){
+          return 1;
+        }
+        writer.close();
+      }
+    }
+
+    uint32_t sequence = segment.sequence + 1;
+    LogSegment oldest;
+    if(index.read(LogIndex::slotOf(sequence), oldest) && oldest.sequence){
+      LogIndex::segmentName(fileName, sizeof(fileName), oldest.sequence);
+      SD.remove(fileName);
+      evicted++;
+    }
+
+    memset(&segment, 0, sizeof(segment));
+    segment.sequence = sequence;
+    segment.first = rtc.getEpoch();
+    LogIndex::segmentName(fileName, sizeof(fileName), sequence);
+    SD.remove(fileName);    // Left over from a lost index
+    if(!index.write(segment) || !writer.open(fileName, LOG_SEGMENT_SIZE, 0)){
+      return 0;
+    }
+    segments++;
+    return 1;
+  };
+
   //Mode defines if msg2 is a string or a number:
   // 1: string
   // 2: number
-  void log(const char * module, MSG_MODE mode, const char * msg, const char * contentType, const char * msg2, unsigned long value){
+  void log(uint32_t id, const char * module, MSG_MODE mode, const char * msg, const char * contentType, const char * msg2, unsigned long value){
 
-    File f;
-
-    if(!SD.begin(SD_CS)){
+    if(suspended){
+      rejected++;
       return;
     }
-
-    char fileName[30];  // 123456789012345678901234567890 
-                        // LOG/MMDDHHMM.LOG
-    snprintf(fileName, sizeof(fileName), "LOG/%02d%02d%02d%02d.LOG", rtc.getMonth(), rtc.getDay(), rtc.getHours(), rtc.getMinutes());
-    
-    f = SD.open(fileName, FILE_WRITE);
-    if(!f) return;
-    f.seek(f.size()); //Go to the end to append
+    if(writer.isFull() && !openSegment()){
+      return;
+    }
+    segment.last = rtc.getEpoch();
+    segment.records++;
+    indexDirty = 1;
     
-    printHeader(f, module);
-    f.print(msg);
-    f.print("|");
-    f.print(contentType);
-    f.print("|");
+    if(binary){
+      logBinary(id, mode, contentType, msg2, value);
+      return;
+    }
+
+    printHeader(writer, module);
+    writer.print(msg);
+    writer.print("|");
+    writer.print(contentType);
+    writer.print("|");
       
     switch(mode){
       case MODE_MSG:
         if(msg2){ 
-          f.println(msg2); 
+          writer.print(msg2); 
         }
+        writer.println();
         break;
 
       case MODE_VALUE:
-        f.println(value);
+        writer.println(value);
         break;
 
       case MODE_ENCODED:
-        urlEncodedStream encoded(&f);
+        urlEncodedStream encoded(&writer);
         for(int i=0,j=strlen(msg2); i<j; i++){
-          int c = msg2[i];
-          encoded.write(c);
-          Serial.write(c);
+          encoded.write(msg2[i]);
         }
-        f.println();
+        writer.println();
         break;
     }
-    
-    f.close();
+  }
+
+  void logBinary(uint32_t id, MSG_MODE mode, const char * contentType, const char * msg2, unsigned long value){
+    LogBinaryWriter w(writer);
+    switch(mode){
+      case MODE_MSG:
+        w.begin(LOG_LEVEL_ERROR, LOG_CLOCK_EPOCH, msg2 ? LOG_ARG_STRING : LOG_ARG_NONE, id, rtc.getEpoch());
+        if(msg2){
+          w.writeString(msg2);
+        }
+        break;
+
+      case MODE_VALUE:
+        w.begin(LOG_LEVEL_ERROR, LOG_CLOCK_EPOCH, LOG_ARG_VALUE, id, rtc.getEpoch());
+        w.writeValue(value);
+        break;
+
+      case MODE_ENCODED:
+        w.begin(LOG_LEVEL_ERROR, LOG_CLOCK_EPOCH, LOG_ARG_ENCODED, id, rtc.getEpoch());
+        w.writeString(contentType);
+        w.writeBody(msg2);
+        break;
+    }
+    w.end();
   }
 
 public:
 
-  FileLogger(const char * level, int verbose=0) : level(level), verbose(verbose), verboseLogger("ERRDBG"){
+  FileLogger(const char * level, int verbose=0) : level(level), verbose(verbose), binary(0), verboseLogger("ERRDBG"),
+                                                  suspended(0), rejected(0), indexDirty(0), segments(0), evicted(0){
     this->level = level;
+    memset(&segment, 0, sizeof(segment));
   }
   
-  void log(const char * module, const char * msg, const char * msg2 = nullptr){
-    log(module, MODE_MSG, msg, "text/plain", msg2, 0);
+  // Use LOG_ERROR, which computes id
+  void log(uint32_t id, const char * module, const char * msg, const char * msg2 = nullptr){
+    log(id, module, MODE_MSG, msg, "text/plain", msg2, 0);
     if(verbose){
-      verboseLogger.log(module, msg, msg2);
+      verboseLogger.log(id, module, msg, msg2);
     }
   };
   
-  void log(const char * module, const char * msg, const unsigned long value){ 
-    log(module, MODE_VALUE, msg, "text/plain", nullptr, value);
+  void log(uint32_t id, const char * module, const char * msg, const unsigned long value){ 
+    log(id, module, MODE_VALUE, msg, "text/plain", nullptr, value);
     if(verbose){
-      verboseLogger.log(module, msg, value);
+      verboseLogger.log(id, module, msg, value);
     }
   };
 
-  void logEncodedBody(const char * module, const char * msg, const char * contentType, const char * body){
-    log(module, MODE_ENCODED, msg, contentType, body, 0);
+  int isBinary() const {
+    return binary;
+  };
+
+  // The verbose console echo follows the console loggers' format
+  void setBinary(int b){
+    binary = b;
+    verboseLogger.setBinary(b);
+  };
+
+  // Buffered records are written by poll (from the main loop), when a sector fills up, or by flush
+  void poll(){
+    if(writer.poll()){
+      updateIndex();
+    }
+  };
+
+  // Before a reset, or anything that reads or removes log files
+  void flush(){
+    writer.flush();
+    updateIndex();
+  };
+
+  // Before removing log files. The next record reads the index again
+  void close(){
+    flush();
+    writer.close();
+    index.close();
+    segment.sequence = 0;
+  };
+
+  // Closes, and rejects records until resume: removing log files takes several main loop passes (LogRemoveJob)
+  void suspend(){
+    close();
+    suspended = 1;
+  };
+
+  void resume(){
+    suspended = 0;
+  };
+
+  unsigned long getRejected(){
+    return rejected;
+  };
+
+  LogFileWriter * getWriter(){
+    return &writer;
+  };
+
+  const LogSegment & getSegment(){
+    return segment;
+  };
+
+  unsigned long getSegmentsStarted(){
+    return segments;
+  };
+
+  unsigned long getEvicted(){
+    return evicted;
+  };
+
+  void logEncodedBody(uint32_t id, const char * module, const char * msg, const char * contentType, const char * body){
+    log(id, module, MODE_ENCODED, msg, contentType, body, 0);
     if (verbose){
-      verboseLogger.logHex(module, msg, body, strlen(body));
+      verboseLogger.logHex(id, module, msg, body, strlen(body));
     }
     
   };
@@ -154,7 +644,8 @@ typedef enum { LOG_OK, LOG_NO_SD } LOG_MGR_STATUS;
 typedef enum { STREAM_MODE_CONTENT, STREAM_MODE_CHUNK } STREAM_MODES;
 
 /*
-  Class to manage logs in the SD card.
+  Class to manage logs in the SD card. Error log segments are found through the index (LogIndex.h), oldest first.
+  Dumping all the segments and removing all the logs are resumable jobs (CliJobs.h).
 */
 class LogManager {
 
@@ -162,35 +653,21 @@ class LogManager {
   const char * rootFolder;
   File root;
 
-  void printDirectory(Stream & out, File dir, int numTabs){
-    while(1){
-      (*keepAlive)();
-      File entry =  dir.openNextFile();
-      if(!entry){
-        break;
-      }
-      for(int i = 0; i < numTabs; i++){
-        out.print('\t');
-      }
-      out.print(entry.name());
-      if(entry.isDirectory()){
-        out.println("/");
-        printDirectory(out, entry, numTabs + 1);
-      }else{
-        // files have sizes, directories do not
-        out.print("\t\t");
-        out.println(entry.size(), DEC);
-      }
-      entry.close();
-    } 
-  };
-
+  // Log files are preallocated with NULs (see LogFileWriter), which are skipped
   void dumpLog(File & log, Stream & out){
     while(log.available()){
       (*keepAlive)();
       char b[512];
       int r = log.readBytes(b, sizeof(b));
-      out.write(b, r);
+      int start = 0;
+      for(int i = 0; i <= r; i++){
+        if(i == r || b[i] == '\0'){
+          if(i > start){
+            out.write(b + start, i - start);
+          }
+          start = i + 1;
+        }
+      }
     }
   };
 
@@ -214,10 +691,32 @@ public:
     return SD.mkdir("LOG");
   }
 
+  // Segments in the index: name, epoch of the first and last records, records and bytes
   void listLogs(Stream & out){
-    this->root = SD.open(this->rootFolder);
-    printDirectory(out, root, 0);
-    root.close();
+    LogIndex index;
+    if(!index.open(0)){
+      out.println("No error log index.");
+      return;
+    }
+    int oldest = index.oldest();
+    for(int i = 0; oldest >= 0 && i < LOG_SEGMENTS; i++){
+      LogSegment segment;
+      if(!index.read((oldest + i) % LOG_SEGMENTS, segment) || !segment.sequence){
+        continue;
+      }
+      char fileName[30];
+      LogIndex::segmentName(fileName, sizeof(fileName), segment.sequence);
+      out.print(fileName + strlen(rootFolder) + 1);
+      out.print("\t");
+      out.print(segment.first);
+      out.print("\t");
+      out.print(segment.last);
+      out.print("\t");
+      out.print(segment.records);
+      out.print("\t");
+      out.println(segment.bytes);
+    }
+    index.close();
   };
 
   int startLogFilesIterator(File & logFile){
@@ -236,24 +735,6 @@ public:
     this->root.close();
   }
 
-  void dumpAllLogs(Stream & out){
-    File logs = SD.open(this->rootFolder);
-    if(!logs){
-      logs.close();
-      return;
-    }
-
-    File logFile = logs.openNextFile();
-    while(logFile){
-      dumpLog(logFile, out);
-      logFile.close();
-      logFile = logs.openNextFile();
-    }
-
-    logs.close();
-    return;
-  };
-
   void dumpLog(Stream & out, const char * logName){
     char fileName[30];  // 123456789012345678901234567890 
                         // LOG/MMDDHHMM.LOG
@@ -269,21 +750,6 @@ public:
     return;  
   };
 
-  int removeAll(){
-    int removed = 0;
-    root = SD.open(this->rootFolder);
-    if(!root){ return removed; }
-    File logfile = root.openNextFile();
-    while(logfile){
-      (*keepAlive)();
-      if(this->remove(logfile.name())){ removed++; }
-      logfile.close();
-      logfile = root.openNextFile();
-    }
-    root.close();    
-    return removed;
-  };
-
   int remove(const char * name){
     char fileName[30];  // 123456789012345678901234567890 
                         // LOG/MMDDHHMM.LOG
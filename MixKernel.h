@@ -0,0 +1,82 @@
+#ifndef MIX_KERNEL_H
+#define MIX_KERNEL_H
+
+#include <stdint.h>
+
+/*
+  Fixed point mixing and IMA-ADPCM decoding, with no Arduino dependencies so the same code builds on the
+  host (tools/mixbench.cpp). Gains are Q8: 256 is unity.
+  The Cortex-M0+ has a single cycle 32x32 multiply but no saturating instructions and no DSP extension, so
+  voices are summed into 32 bit accumulators (no clipping per voice) and saturated once per output sample.
+  Q8 gains keep 8 voices at full scale inside the accumulator: 8 * 32767 * 256 < 2^31.
+*/
+
+#define MIX_GAIN_SHIFT  8
+#define MIX_GAIN_UNITY  (1 << MIX_GAIN_SHIFT)
+
+// acc[i] += in[i] * gain. Unrolled by 4: the M0+ has no branch predictor and 2 cycle taken branches
+static inline void mixAccumulate(int32_t * acc, const int16_t * in, int n, int32_t gain){
+  for(; n >= 4; n -= 4){
+    acc[0] += in[0] * gain;
+    acc[1] += in[1] * gain;
+    acc[2] += in[2] * gain;
+    acc[3] += in[3] * gain;
+    acc += 4;
+    in += 4;
+  }
+  for(; n > 0; n--){
+    *acc++ += *in++ * gain;
+  }
+}
+
+// out[i] = acc[i] / MIX_GAIN_UNITY, saturated to 16 bits
+static inline void mixSaturate(int16_t * out, const int32_t * acc, int n){
+  for(; n > 0; n--){
+    int32_t s = *acc++ >> MIX_GAIN_SHIFT;
+    if(s > 32767){
+      s = 32767;
+    } else if(s < -32768){
+      s = -32768;
+    }
+    *out++ = (int16_t)s;
+  }
+}
+
+typedef struct {
+  int32_t predictor;
+  int32_t index;
+} ImaState;
+
+static const int16_t IMA_STEPS[89] = {
+  7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+  50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190, 209, 230, 253, 279, 307,
+  337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876, 963, 1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066,
+  2272, 2499, 2749, 3024, 3327, 3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487, 12635, 13899,
+  15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767
+};
+
+static const int8_t IMA_INDEX[16] = { -1, -1, -1, -1, 2, 4, 6, 8, -1, -1, -1, -1, 2, 4, 6, 8 };
+
+// One 4 bit IMA-ADPCM code to a sample. Shifts and adds only, as in the reference decoder
+static inline int16_t imaDecode(ImaState & state, uint8_t nibble){
+  int32_t step = IMA_STEPS[state.index];
+  int32_t diff = step >> 3;
+  if(nibble & 4) diff += step;
+  if(nibble & 2) diff += step >> 1;
+  if(nibble & 1) diff += step >> 2;
+  state.predictor += (nibble & 8) ? -diff : diff;
+  if(state.predictor > 32767){
+    state.predictor = 32767;
+  } else if(state.predictor < -32768){
+    state.predictor = -32768;
+  }
+  state.index += IMA_INDEX[nibble];
+  if(state.index < 0){
+    state.index = 0;
+  } else if(state.index > 88){
+    state.index = 88;
+  }
+  return (int16_t)state.predictor;
+}
+
+#endif
@@ -0,0 +1,191 @@
+#ifndef NVM_STORE_H
+#define NVM_STORE_H
+
+#include <Arduino.h>
+
+#include "Defaults.h"
+
+#define NVM_ROW_SIZE    256     //Erase unit of the SAMD21 flash (4 pages)
+#define NVM_PAGE_SIZE   64      //Write unit
+#define NVM_MAGIC       0x43425553
+
+typedef struct {
+  uint32_t magic;
+  uint32_t sequence;      //Incremented on every save. The valid slot with the highest sequence wins
+  uint32_t length;
+  uint32_t crc;
+} NVMSlotHeader;
+
+/*
+  Persists a T in internal flash. The region is split in SLOTS slots and each save goes to
+  the slot after the current one, so every row is erased once every SLOTS saves (wear leveling).
+  A power loss during a save leaves the previous slot intact.
+  The region is a const array, so the linker places it in flash (as FlashStorage does).
+*/
+template<typename T, unsigned int SLOTS>
+class NVMStore {
+
+  static const uint32_t SLOT_SIZE = (sizeof(NVMSlotHeader) + sizeof(T) + NVM_ROW_SIZE - 1) / NVM_ROW_SIZE * NVM_ROW_SIZE;
+
+  static const uint8_t region[SLOT_SIZE * SLOTS];
+
+  int current;              //Slot with the last valid image, -1 if none
+  uint32_t sequence;
+  unsigned long saves;
+
+  static const volatile uint8_t * slotAddress(int slot){
+    return &region[slot * SLOT_SIZE];
+  };
+
+  // Flash is read through volatile pointers: the compiler must not fold reads of the (zero initialized) const region
+  static void read(void * dst, const volatile uint8_t * src, uint32_t length){
+    uint8_t * d = (uint8_t *)dst;
+    while(length--){
+      *d++ = *src++;
+    }
+  };
+
+  static uint32_t crc32(const volatile uint8_t * data, uint32_t length){
+    uint32_t crc = 0xFFFFFFFF;
+    for(uint32_t i = 0; i < length; i++){
+      crc ^= data[i];
+      for(int b = 0; b < 8; b++){
+        crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+      }
+    }
+    return ~crc;
+  };
+
+  static void waitReady(){
+    while(!NVMCTRL->INTFLAG.bit.READY){}
+  };
+
+  static void eraseRow(const volatile uint8_t * address){
+    NVMCTRL->ADDR.reg = ((uintptr_t)address) / 2;
+    NVMCTRL->CTRLA.reg = NVMCTRL_CTRLA_CMDEX_KEY | NVMCTRL_CTRLA_CMD_ER;
+    waitReady();
+  };
+
+  // Writes length bytes (multiple of 4) at a page aligned, erased, address
+  static void write(const volatile uint8_t * address, const uint8_t * data, uint32_t length){
+    volatile uint32_t * dst = (volatile uint32_t *)address;
+    NVMCTRL->CTRLB.bit.MANW = 1;
+    while(length){
+      NVMCTRL->CTRLA.reg = NVMCTRL_CTRLA_CMDEX_KEY | NVMCTRL_CTRLA_CMD_PBC;
+      waitReady();
+      for(int i = 0; i < NVM_PAGE_SIZE / 4 && length; i++){
+        uint32_t word;
+        memcpy(&word, data, 4);
+        *dst++ = word;
+        data += 4;
+        length -= 4;
+      }
+      NVMCTRL->CTRLA.reg = NVMCTRL_CTRLA_CMDEX_KEY | NVMCTRL_CTRLA_CMD_WP;
+      waitReady();
+    }
+  };
+
+  int isValid(int slot, NVMSlotHeader & header){
+    read(&header, slotAddress(slot), sizeof(header));
+    if(header.magic != NVM_MAGIC || header.length != sizeof(T)){
+      return 0;
+    }
+    return header.crc == crc32(slotAddress(slot) + sizeof(header), header.length);
+  };
+
+public:
+  NVMStore() : current(-1), sequence(0), saves(0) {
+  };
+
+  // Finds the newest valid image. Returns 1 if there's one
+  int begin(){
+    current = -1;
+    sequence = 0;
+    for(unsigned int slot = 0; slot < SLOTS; slot++){
+      NVMSlotHeader header;
+      if(isValid(slot, header) && (current < 0 || (int32_t)(header.sequence - sequence) > 0)){
+        current = slot;
+        sequence = header.sequence;
+      }
+    }
+    return current >= 0;
+  };
+
+  int load(T & data){
+    if(current < 0){
+      return 0;
+    }
+    read(&data, slotAddress(current) + sizeof(NVMSlotHeader), sizeof(T));
+    return 1;
+  };
+
+  int save(const T & data){
+    int slot = (current + 1) % SLOTS;
+    const volatile uint8_t * address = slotAddress(slot);
+
+    // Image is written through a row sized buffer: T has no alignment or size guarantees
+    uint8_t row[NVM_ROW_SIZE];
+    NVMSlotHeader header = { NVM_MAGIC, sequence + 1, sizeof(T), crc32((const uint8_t *)&data, sizeof(T)) };
+
+    const uint8_t * src = (const uint8_t *)&data;
+    uint32_t remaining = sizeof(T);
+    for(uint32_t offset = 0; offset < SLOT_SIZE; offset += NVM_ROW_SIZE){
+      memset(row, 0xFF, sizeof(row));
+      uint32_t start = 0;
+      if(offset == 0){
+        memcpy(row, &header, sizeof(header));
+        start = sizeof(header);
+      }
+      uint32_t n = (NVM_ROW_SIZE - start) < remaining ? (NVM_ROW_SIZE - start) : remaining;
+      memcpy(row + start, src, n);
+      src += n;
+      remaining -= n;
+
+      eraseRow(address + offset);
+      write(address + offset, row, NVM_ROW_SIZE);
+    }
+
+    NVMSlotHeader check;
+    if(!isValid(slot, check)){
+      return 0;
+    }
+
+    current = slot;
+    sequence++;
+    saves++;
+    return 1;
+  };
+
+  // Invalidates all slots (next boot imports the config file again)
+  void erase(){
+    for(unsigned int slot = 0; slot < SLOTS; slot++){
+      eraseRow(slotAddress(slot));
+    }
+    current = -1;
+  };
+
+  int getCurrentSlot() const {
+    return current;
+  };
+
+  uint32_t getSequence() const {
+    return sequence;
+  };
+
+  unsigned long getSaves() const {
+    return saves;
+  };
+
+  static uint32_t getSlotSize(){
+    return SLOT_SIZE;
+  };
+
+  static unsigned int getSlots(){
+    return SLOTS;
+  };
+};
+
+template<typename T, unsigned int SLOTS>
+const uint8_t NVMStore<T, SLOTS>::region[NVMStore<T, SLOTS>::SLOT_SIZE * SLOTS] __attribute__((aligned(NVM_ROW_SIZE))) = { };
+
+#endif
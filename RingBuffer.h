@@ -0,0 +1,78 @@
+#ifndef RING_BUFFER_H
+#define RING_BUFFER_H
+
+/*
+  Lock-free single producer / single consumer queue.
+  The producer (usually an ISR) only moves head and the consumer (the main loop) only moves tail,
+  so no interrupt masking is needed: 32 bit aligned loads and stores are atomic on the M0+.
+  SIZE must be a power of 2. Indexes are free running and wrap naturally.
+*/
+template<typename T, unsigned int SIZE>
+class RingBuffer {
+
+  static_assert(SIZE > 0 && (SIZE & (SIZE - 1)) == 0, "RingBuffer SIZE must be a power of 2");
+
+  T items[SIZE];
+  volatile unsigned int head;   // Next slot to write. Owned by the producer
+  volatile unsigned int tail;   // Next slot to read. Owned by the consumer
+
+  //Prevents the compiler from moving the item copy past the index update
+  static inline void barrier(){
+    __asm__ __volatile__("" ::: "memory");
+  }
+
+public:
+  RingBuffer() : head(0), tail(0) {
+  };
+
+  // Producer side. Returns 0 if the queue is full (item is not stored)
+  int push(const T & item){
+    unsigned int h = head;
+    if(h - tail >= SIZE){
+      return 0;
+    }
+    items[h & (SIZE - 1)] = item;
+    barrier();
+    head = h + 1;
+    return 1;
+  };
+
+  // Consumer side. Returns 0 if the queue is empty
+  int pop(T & item){
+    unsigned int t = tail;
+    if(t == head){
+      return 0;
+    }
+    item = items[t & (SIZE - 1)];
+    barrier();
+    tail = t + 1;
+    return 1;
+  };
+
+  // Consumer side. Returns the oldest item without removing it, nullptr if empty
+  T * peek(){
+    unsigned int t = tail;
+    if(t == head){
+      return nullptr;
+    }
+    return &items[t & (SIZE - 1)];
+  };
+
+  unsigned int count() const {
+    return head - tail;
+  };
+
+  int isEmpty() const {
+    return head == tail;
+  };
+
+  int isFull() const {
+    return (head - tail) >= SIZE;
+  };
+
+  static unsigned int capacity(){
+    return SIZE;
+  };
+};
+
+#endif
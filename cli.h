@@ -143,6 +143,11 @@ protected:
       return args_length == 1;
     };
 
+    // args[index], or an empty string if it was not entered
+    const char * arg(int index){
+      return (index < args_length && args[index]) ? args[index] : "";
+    };
+
     //If no argument is passed, we assume it is args[1]
     int isSubcommand(const char * options[]){
       if(args_length>1){
@@ -8,6 +8,12 @@
 class Relay;
 class AudioBoard;
 class Actions;
+class CBUS;
+class CBUSNode;
+class CBUSJournal;
+class CBUSTraffic;
+class Idle;
+class LatencyTracer;
 
 class CliContext {
 public:
@@ -15,6 +21,12 @@ public:
   AudioBoard * audio;
   Dispatcher<Actions> * dispatcher;
   CBUSConfig * config;
+  CBUS * cbus;
+  CBUSNode * node;
+  CBUSJournal * journal;
+  CBUSTraffic * traffic;
+  Idle * idle;
+  LatencyTracer * latency;
   void (*keepAlive)();
 };
 
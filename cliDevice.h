@@ -9,15 +9,65 @@ class Actions;
 #include "WD.h"
 #include "Dispatcher.h"
 #include "AudioBoard.h"
+#include "CBUS.h"
+#include "CBUSNode.h"
+#include "CBUSJournal.h"
+#include "CBUSTraffic.h"
+#include "Idle.h"
+#include "LatencyTrace.h"
+#include "CliJobs.h"
 
 
 class CliDevice : public Cli {
 
+    // Long commands run as jobs, a slice per main loop pass (run)
+    DirectoryJob directoryJob;
+    FileDumpJob fileDumpJob;
+    LogDumpJob logDumpJob;
+    LogRemoveJob logRemoveJob;
+    CliJob * job;
+
+    int startJob(CliJob * j){
+        job = j;
+        return CMD_OK;
+    };
+
+    void endJob(){
+        job->stop();
+        job = nullptr;
+        out->print("\r\n> ");
+    };
+
+    /*
+      Steps the job for up to its budget. A CAN frame waiting ends the slice: CBUS runs first, the job
+      continues in the next pass. At least one step per slice, so the job always progresses.
+    */
+    void runJob(){
+        unsigned long start = micros();
+        do {
+            if(!job->step(*out)){
+                endJob();
+                return;
+            }
+        } while(micros() - start < job->getBudget() && !ctx->cbus->available());
+    };
+
     void help_audio(){
       out->println("Controls audio playback.");
       out->println("Options:");
-      out->println("[list|ls|L]: lists all audio files in the SD card.");
+      out->println("[list|ls|L]: lists the audio catalog: the MP3 and WAV files in the SD root, inspected at boot.");
       out->println("[play|p|P] {file}: plays the file {file}.");
+      out->println("[bank|b]: lists the sound bank: tracks with the start of their audio in RAM (BANK= in the config file).");
+      out->println("[mix|m]: voices the mixer is playing, and its CPU time.");
+      out->println("[mix|m {track} [gain] [loop]]: mixes {track}.wav (mono, 16 bit PCM or IMA-ADPCM, 22050 Hz) with gain 0-256 (256: unity, the default). loop repeats it.");
+      out->println("[mix|m stop]: stops the mixer and all its voices.");
+      out->println("[mixbench|mb]: benchmarks the mixing kernel on this CPU: samples/s for each number of voices. Not while playing.");
+      out->println("[queue|q]: track playing and its priority, requests waiting, preemptions, drops and preemption latency (uS).");
+      out->println("[queue|q reset]: clears the queue statistics.");
+      out->println("[feeder|f]: audio feeder statistics: DMA chunks, SD reads, underruns and CPU time.");
+      out->println("[feeder|f reset]: clears the audio feeder statistics.");
+      out->println("[latency|lat]: trigger to sound latency (uS) of the last CAN events and push button presses, per stage.");
+      out->println("[latency|lat reset]: clears the latency traces.");
     };
     
     int cmd_audio(){
@@ -27,19 +77,32 @@ class CliDevice : public Cli {
 
         const char * lsc[] = {"list", "ls", "L", nullptr};
         if(isSubcommand(lsc)){
-          auto root = SD.open("/");
-          while(true){
-            (*ctx->keepAlive)();
-            File entry = root.openNextFile();
-            if(!entry) break;
-            const char * name = entry.name();
-            //Serial.println(name);
-            if(name && strlen(name) > 4 && strcmp(name + strlen(name) - 4, ".MP3") == 0){
-              out->println(name);
-            }
-            entry.close();
+          AudioCatalog * catalog = ctx->audio->getCatalog();
+          for(int i = 0; i < catalog->getCount(); i++){
+            const AudioTrack * t = catalog->get(i);
+            out->print(t->name);
+            out->print(", ");
+            out->print(t->size);
+            out->print(" bytes, Audio from: ");
+            out->print(t->dataStart);
+            out->print(", ");
+            out->print(t->rate);
+            out->print(" Hz");
+            if(t->format == AUDIO_FORMAT_MP3){
+              out->print(", ");
+              out->print(t->kbps);
+              out->print(" kbps");
+            }
+            out->print(", ");
+            out->print(t->duration);
+            out->println(" mS");
           }
-          root.close();
+          out->print("Tracks: ");
+          out->print(catalog->getCount());
+          out->print("/");
+          out->print(AUDIO_CATALOG_SIZE);
+          out->print(", Left out: ");
+          out->println(catalog->getSkipped());
           return CMD_OK;
         }
 
@@ -51,7 +114,7 @@ class CliDevice : public Cli {
             }
 
             auto audio = ctx->audio;
-            audio->play(args[2]);
+            audio->play(args[2], ctx->config->getTrackPriority(args[2]));
             return CMD_OK;
         }
 
@@ -71,6 +134,205 @@ class CliDevice : public Cli {
             return CMD_OK;
         }
 
+        const char * bnk[] = {"bank", "b", nullptr};
+        if(isSubcommand(bnk)){
+            if(ctx->audio->getBankCount() == 0){
+                out->println("Sound bank is empty.");
+                return CMD_OK;
+            }
+            for(int i = 0; i < ctx->audio->getBankCount(); i++){
+                const AudioClip * clip = ctx->audio->getClip(i);
+                const AudioTrack * t = ctx->audio->getCatalog()->get(clip->handle);
+                out->print(t->name);
+                out->print(". In RAM: ");
+                out->print(clip->length);
+                out->print(" bytes, from offset ");
+                out->println(t->dataStart);
+            }
+            return CMD_OK;
+        }
+
+        const char * mix[] = {"mix", "m", nullptr};
+        if(isSubcommand(mix)){
+            auto audio = ctx->audio;
+            if(strcmp(arg(2), "stop") == 0){
+                audio->stopPlaying();
+                return CMD_OK;
+            }
+            if(strlen(arg(2))){
+                int gain = strlen(arg(3)) ? atoi(arg(3)) : MIX_GAIN_UNITY;
+                if(gain < 0 || gain > MIX_GAIN_UNITY){
+                    out->println("Gain must be 0 to 256.");
+                    return CMD_ERROR;
+                }
+                if(!audio->mix(arg(2), gain, strcmp(arg(4), "loop") == 0)){
+                    out->println("Not mixed: a track is playing, all voices are busy, or the WAV is missing or in the wrong format.");
+                    return CMD_ERROR;
+                }
+                return CMD_OK;
+            }
+
+            AudioMixer * mixer = audio->getMixer();
+            out->println(audio->isMixing() ? "Mixing" : "Mixer stopped");
+            for(int i = 0; i < AUDIO_MIX_VOICES; i++){
+                const AudioVoice * v = mixer->getVoice(i);
+                if(!v){
+                    continue;
+                }
+                out->print(i);
+                out->print(". ");
+                out->print(v->name);
+                out->print(v->format == AUDIO_MIX_PCM ? ", PCM" : ", IMA-ADPCM");
+                out->print(", Gain: ");
+                out->print(v->gain);
+                out->print(v->loop ? ", Loop" : "");
+                out->print(", Left: ");
+                out->print(v->remaining);
+                out->println(" bytes");
+            }
+            const AudioMixerStats & s = mixer->getStats();
+            out->print("Blocks: ");
+            out->print(s.blocks);
+            out->print(", Samples: ");
+            out->print(s.samples);
+            out->print(", uS mixing: ");
+            out->print((unsigned long)s.mixMicros);
+            out->print(", reading PCM: ");
+            out->println((unsigned long)s.readMicros);
+            return CMD_OK;
+        }
+
+        const char * mb[] = {"mixbench", "mb", nullptr};
+        if(isSubcommand(mb)){
+            if(ctx->audio->isPlaying()){
+                out->println("Audio is playing. Stop it first.");
+                return CMD_ERROR;
+            }
+            ctx->audio->getMixer()->benchmark(*out, ctx->keepAlive);
+            return CMD_OK;
+        }
+
+        const char * que[] = {"queue", "q", nullptr};
+        if(isSubcommand(que)){
+            auto audio = ctx->audio;
+            if(strcmp(arg(2), "reset") == 0){
+                audio->resetStats();
+                out->println("Audio queue statistics cleared.");
+                return CMD_OK;
+            }
+            out->print("Playing: ");
+            if(audio->getPlaying()){
+                out->print(audio->getPlaying());
+                out->print(", Priority: ");
+                out->println(audio->getPlayingPriority());
+            } else {
+                out->println("nothing");
+            }
+            for(int i = 0; i < audio->getPendingCount(); i++){
+                const AudioRequest * r = audio->getPending(i);
+                out->print(i);
+                out->print(". ");
+                out->print(ctx->audio->getCatalog()->get(r->handle)->name);
+                out->print(", Priority: ");
+                out->print(r->priority);
+                out->print(", Waiting: ");
+                out->print(millis() - r->at);
+                out->println(" mS");
+            }
+            const AudioQueueStats & s = audio->getStats();
+            out->print("Requests: ");
+            out->print(s.requests);
+            out->print(", Preempted: ");
+            out->print(s.preempted);
+            out->print(", Queued: ");
+            out->println(s.queued);
+            out->print("Dropped. Lower priority: ");
+            out->print(s.dropped);
+            out->print(", Queue full: ");
+            out->print(s.queueFull);
+            out->print(", Expired: ");
+            out->print(s.expired);
+            out->print(", Not on the SD card: ");
+            out->println(s.missing);
+            if(s.preemptMax){
+                out->print("Preemption uS min/mean/max: ");
+                out->print(s.preemptMin);
+                out->print("/");
+                out->print((unsigned long)(s.preemptTotal / s.preempted));
+                out->print("/");
+                out->println(s.preemptMax);
+            }
+            return CMD_OK;
+        }
+
+        const char * fdr[] = {"feeder", "f", nullptr};
+        if(isSubcommand(fdr)){
+            AudioFeeder * feeder = ctx->audio->getFeeder();
+            if(strcmp(arg(2), "reset") == 0){
+                feeder->resetStats();
+                out->println("Audio feeder statistics cleared.");
+                return CMD_OK;
+            }
+            const AudioFeederStats & s = feeder->getStats();
+            out->print("Chunks: ");
+            out->print(s.chunks);
+            out->print(", Bytes: ");
+            out->print(s.bytes);
+            out->print(", SD reads: ");
+            out->print(s.reads);
+            out->print(", DMA errors: ");
+            out->println(s.dmaErrors);
+            out->print("Underruns (DREQ high, buffers empty): ");
+            out->println(s.underruns);
+            out->print("CPU uS sending: ");
+            out->print((unsigned long)s.feedMicros);
+            out->print(", reading: ");
+            out->print((unsigned long)s.readMicros);
+            out->print(", Load: ");
+            out->print(feeder->getLoad());
+            out->print("% of the time playing, Longest poll (read ahead): ");
+            out->print(s.maxPoll);
+            out->println(" uS");
+            return CMD_OK;
+        }
+
+        const char * lat[] = {"latency", "lat", nullptr};
+        if(isSubcommand(lat)){
+            return cmd_latency();
+        }
+
+        out->println("Invalid parameter.");
+        return CMD_ERROR;
+    };
+
+    // "audio latency" and "trace latency"
+    int cmd_latency(){
+        if(strcmp(arg(2), "reset") == 0){
+            ctx->latency->reset();
+            out->println("Latency traces cleared.");
+            return CMD_OK;
+        }
+        ctx->latency->printReport(*out);
+        return CMD_OK;
+    };
+
+    void help_trace(){
+      out->println("Traces.");
+      out->println("Options:");
+      out->println("[latency|lat]: trigger to sound latency (uS), as in \"audio latency\".");
+      out->println("[latency|lat reset]: clears the latency traces.");
+    };
+
+    int cmd_trace(){
+        if(noArguments()){
+          return CMD_HELP;
+        }
+
+        const char * lat[] = {"latency", "lat", nullptr};
+        if(isSubcommand(lat)){
+            return cmd_latency();
+        }
+
         out->println("Invalid parameter.");
         return CMD_ERROR;
     };
@@ -98,28 +360,95 @@ class CliDevice : public Cli {
     };
 
     void help_dispatcher(){
-        out->println("Displays all scheduled Actions, with expected trigger counts.");
+        out->println("Displays all scheduled Actions, with their period, next run, runs, missed deadlines, execution times and overruns.");
         out->println("With no options, displays information of all Actions.");
         out->println("Options:");
         out->println("[execute|x|exe|exec|run|X {index|name}]: executes action with index {index} or name {name}. Default is 0.");
-        out->println("[tick|T {index} {ticks}]: sets ticks for action {index}. {ticks} must be >= -1. -1 means disabled.");
+        out->println("[period|p|tick|T {index} {mS}]: sets the period of action {index}. {mS} must be >= 1, or -1 to disable it. Static tasks have fixed periods.");
         out->println("[schedule|sch|immediate|s|S {index}]: sets Action {index} for immediate execution."); 
-        out->println("[step|stpe|ste|st]: calls dispatcher and steps over as a TICK had happened (regardless if dispatcher is disabled)."); 
+        out->println("[step|stpe|ste|st]: runs the actions and timers that are due (regardless if dispatcher is disabled)."); 
+        out->println("[stats|stat]: displays handler execution times (uS) and their log2 histogram per action, task and for the one-shot timers.");
+        out->println("[stats|stat reset]: clears execution times, runs and missed deadlines.");
+        out->println("[idle|i]: displays time asleep and awake between deadlines, and what woke the device up.");
+        out->println("[idle|i {on|off|reset}]: enables or disables sleeping when idle, or clears the statistics.");
         out->println("[disable|dis|D]: disables all Actions.");
         out->println("[enable|ena|E]: enables all Actions.");
     };
 
+    void printTaskName(uint32_t name){
+        for(int c = 0; c < 4 && (name >> (8 * c)) & 0xFF; c++){
+            out->print((char)((name >> (8 * c)) & 0xFF));
+        }
+    };
+
+    // Handler time columns, ends the line
+    void printProfile(const DispatcherProfile & profile){
+        out->print(", uS min/mean/max: ");
+        out->print(profile.min);
+        out->print("/");
+        out->print(profileMean(profile));
+        out->print("/");
+        out->print(profile.max);
+        out->print(", Overruns: ");
+        out->println(profile.overruns);
+    };
+
+    // Non empty log2 buckets, "[from uS] count"
+    void printHistogram(const DispatcherProfile & profile){
+        out->print("  Calls: ");
+        out->print(profile.count);
+        out->print(". Histogram:");
+        for(int b = 0; b < DISPATCHER_HISTOGRAM; b++){
+            if(profile.histogram[b]){
+                out->print(" [");
+                out->print(b ? 1UL << b : 0);
+                out->print(b == DISPATCHER_HISTOGRAM - 1 ? "+] " : "] ");
+                out->print(profile.histogram[b]);
+            }
+        }
+        out->println();
+    };
+
+    int cmd_dispatcher_stats(){
+        if(strcmp(arg(2), "reset") == 0){
+            ctx->dispatcher->resetStats();
+            out->println("Dispatcher statistics cleared.");
+            return CMD_OK;
+        }
+
+        const int len = ctx->dispatcher->getActionsLength();
+        for(int j = 0; j < len; j++){
+            const DispatcherAction<Actions> * a = ctx->dispatcher->getAction(j);
+            out->print(a->name);
+            printProfile(a->profile);
+            printHistogram(a->profile);
+        }
+        const DispatcherTaskTable<Actions> * tasks = ctx->dispatcher->getTasks();
+        for(int j = 0; tasks && j < tasks->size(); j++){
+            printTaskName(tasks->name(j));
+            printProfile(tasks->state(j).profile);
+            printHistogram(tasks->state(j).profile);
+        }
+        out->print("Timers");
+        printProfile(ctx->dispatcher->getTimerProfile());
+        printHistogram(ctx->dispatcher->getTimerProfile());
+        return CMD_OK;
+    };
+
     int cmd_dispatcher(){
 
         if(noArguments()){
             const int len = ctx->dispatcher->getActionsLength(); 
-            if(len == 0){
+            const DispatcherTaskTable<Actions> * tasks = ctx->dispatcher->getTasks();
+            if(len == 0 && !tasks){
                 out->println("No actions registered in Disptacher. (Should not happen).");
                 return CMD_OK;
             }
 
             out->print(len);
-            out->print(" actions registered with the Dispatcher. ");
+            out->print(" actions registered with the Dispatcher, ");
+            out->print(tasks ? tasks->size() : 0);
+            out->print(" static tasks. ");
             out->println(ctx->dispatcher->status() ? " ENABLED" : " DISABLED");
             for(int j = 0; j < len; j++){
                 const DispatcherAction<Actions> * a = ctx->dispatcher->getAction(j);
@@ -127,16 +456,38 @@ class CliDevice : public Cli {
                     out->print(j);
                     out->print(". Action [");
                     out->print(a->name);
-                    out->print("]. Ticks: ");
-                    out->print(a->ticks);
-                    out->print(", Count: ");
-                    out->print(a->count);
-                    out->print(", Runs in ");
-                    out->print(ctx->dispatcher->secondsToNextRun(j));
-                    out->print(" seconds, Once in ");
-                    out->println(a->once);
+                    out->print("]. Period: ");
+                    out->print(a->period);
+                    out->print(" mS, Runs in ");
+                    out->print(ctx->dispatcher->millisToNextRun(j));
+                    out->print(" mS, Runs: ");
+                    out->print(a->runs);
+                    out->print(", Missed: ");
+                    out->print(a->missed);
+                    printProfile(a->profile);
                 }
             }
+            for(int j = 0; tasks && j < tasks->size(); j++){
+                const StaticTaskState & state = tasks->state(j);
+                uint32_t name = tasks->name(j);
+                out->print(len + j);
+                out->print(". Task [");
+                printTaskName(name);
+                out->print("]. Period: ");
+                out->print(tasks->period(j));
+                out->print(" mS, Runs in ");
+                long left = (long)(state.next - millis());
+                out->print(left > 0 ? left : 0);
+                out->print(" mS, Runs: ");
+                out->print(state.runs);
+                out->print(", Missed: ");
+                out->print(state.missed);
+                printProfile(state.profile);
+            }
+            out->print("One-shot timers armed: ");
+            out->print(ctx->dispatcher->getArmedTimers());
+            out->print("/");
+            out->println(MAX_TIMERS);
             return CMD_OK;
         }
 
@@ -160,16 +511,20 @@ class CliDevice : public Cli {
             return CMD_OK;
         }
 
-        const char * tic[] = {"t", "tick", "T", nullptr };
-        if(isSubcommand(tic)){
-            int index = atoi(args[2]);
-            int ticks = atoi(args[3]);
-            ctx->dispatcher->updateActionTicks(index, ticks);
+        const char * per[] = {"period", "p", "t", "tick", "T", nullptr };
+        if(isSubcommand(per)){
+            int index = atoi(arg(2));
+            long period = atol(arg(3));
+            if(!ctx->dispatcher->getAction(index) || period < -1 || period == 0){
+                out->println("Invalid action or period");
+                return CMD_ERROR;
+            }
+            ctx->dispatcher->updateActionPeriod(index, period);
             out->print("Action [");
             out->print(ctx->dispatcher->getAction(index)->name);
             out->print("] updated with [");
-            out->print(ticks);
-            out->println(" ticks");
+            out->print(period);
+            out->println("] mS");
             return CMD_OK;
         }
 
@@ -201,6 +556,24 @@ class CliDevice : public Cli {
             }
         }
 
+        const char * stats[] = {"stats", "stat", nullptr};
+        if(isSubcommand(stats)){
+            return cmd_dispatcher_stats();
+        }
+
+        const char * idle[] = {"idle", "i", nullptr};
+        if(isSubcommand(idle)){
+            if(strcmp(arg(2), "on") == 0 || strcmp(arg(2), "off") == 0){
+                ctx->idle->setEnabled(strcmp(arg(2), "on") == 0);
+            } else if(strcmp(arg(2), "reset") == 0){
+                ctx->idle->resetStats();
+                out->println("Idle statistics cleared.");
+                return CMD_OK;
+            }
+            ctx->idle->printStats(*out);
+            return CMD_OK;
+        }
+
         const char * step[] = {"step", "stpe", "ste", "st", nullptr};
         if(isSubcommand(step)){
             out->println("Step");
@@ -313,6 +686,8 @@ class CliDevice : public Cli {
         const char * tsc[] = {"test", "t", "tst", "T", nullptr };
         if(isSubcommand(tsc)){
             out->println("WDT. System will now enter an infinite loop and reset.");
+            logRing.drainAll(Serial);
+            error.flush();
             while(1){} 
         }
 
@@ -337,6 +712,8 @@ class CliDevice : public Cli {
 
         //Just a simple protection to prevent accidentally reseting the board
         if(!strcmp("ETE", args[1])){
+            logRing.drainAll(Serial);
+            error.flush();
             NVIC_SystemReset();
             //Will never get here!
             return CMD_OK;
@@ -348,6 +725,7 @@ class CliDevice : public Cli {
 
     void help_fs(){
         out->println("Manages the SD card file system. Filesystem commands are disabled while audio is playing.");
+        out->println("Listings and dumps run a slice at a time between CBUS work. Entering a new command stops them.");
         out->println("Options:");
         out->println("[ls|l|dir|L]: lists all files and directories in the root.");
         out->println("[mkdir|md|D {name}]: creates a directory with name {name}.");
@@ -373,10 +751,11 @@ class CliDevice : public Cli {
 
         const char * ls[] = {"ls", "l", "dir", "L", nullptr};
         if(isSubcommand(ls)){
-            File root = SD.open("/");
-            printDirectory(out, root, 0, ctx->keepAlive);
-            root.close();
-            return CMD_OK;
+            if(!directoryJob.start("/")){
+                out->println("SD card not available.");
+                return CMD_ERROR;
+            }
+            return startJob(&directoryJob);
         } 
 
         const char * md[] = {"mkdir", "md", "D", nullptr};
@@ -407,20 +786,11 @@ class CliDevice : public Cli {
                 hex = 1;
             }
 
-            File f = SD.open(args[2], O_READ);
-            f.seek(0);
-            while(f.available()){
-                (*ctx->keepAlive)();
-                char b[256];    //Magic buffer - note that if command is not called on the local TTY, it will only print a subsegment
-                int r = f.readBytes(b, sizeof(b));
-                if(hex){
-                    Utils::dumpHex(out, b, r);   
-                } else {
-                    out->write(b, r);
-                }
+            if(!fileDumpJob.start(args[2], hex, 0)){
+                out->println("Could not open the file.");
+                return CMD_ERROR;
             }
-            f.close();
-            return CMD_OK;
+            return startJob(&fileDumpJob);
         }
 
         const char * rm[] = {"rm", "del", nullptr};
@@ -448,15 +818,125 @@ class CliDevice : public Cli {
     };
 
     void help_logs(){
-        out->println("Manages logs.");
+        out->println("Manages logs. Dumps, 'ls files' and 'rm all' run a slice at a time between CBUS work. Entering a new command stops them.");
         out->println("Options:");
-        out->println("[ls|l|dir|L]: lists all log files.");
-        out->println("[dump|d|cat {file}]: prints the content of the log file {file}.");
+        out->println("[ls|l|dir|L]: lists the error log segments, oldest first: file, first and last record (epoch), records, bytes.");
+        out->println("[ls|l|dir|L files]: lists all the files in the log folder.");
+        out->println("[dump|d|cat {file}]: prints the content of the log file {file}. Enter 'all' for all the error log segments.");
         out->println("[remove|del|rm {file}]: removes the log file {file}. Enter 'all' to remove all logs.");
+        out->println("[stats|s]: displays console log ring and error log file buffer usage, dropped records and throughput. [stats reset]: clears them.");
+        out->println("[format|fmt {text|binary}]: console and error log record format. Binary records are decoded with tools/logdecode.py.");
+        out->println("[mask|m]: displays the console log modules compiled in and enabled, per level.");
+        out->println("[mask|m {trace|info} {module|all} {on|off}]: enables or disables console logging of {module} at runtime.");
+    };
+
+    void printLogMask(const char * name, int compiled, unsigned int mask){
+        out->print(name);
+        out->print(": ");
+        if(!compiled){
+            out->println("compiled out");
+            return;
+        }
+        for(int i = 0; logModules[i].name; i++){
+            out->print(logModules[i].name);
+            out->print((mask & logModules[i].mask) ? "[on] " : "[off] ");
+        }
+        out->println();
+    };
+
+    unsigned int updateLogMask(unsigned int mask, const char * module, int on){
+        unsigned int bits = 0;
+        if(strcmp(module, "all") == 0){
+            bits = LOG_MODULES_ALL;
+        }
+        for(int i = 0; logModules[i].name && !bits; i++){
+            if(strcasecmp(module, logModules[i].name) == 0){
+                bits = logModules[i].mask;
+            }
+        }
+        return on ? mask | bits : mask & ~bits;
+    };
+
+    int cmd_log_mask(){
+        if(strlen(arg(2)) == 0){
+            out->print("Compiled level: ");
+            out->println(LOG_LEVEL == LOG_LEVEL_TRACE ? "trace" : LOG_LEVEL == LOG_LEVEL_INFO ? "info" : "errors only");
+            printLogMask("trace", LOG_LEVEL <= LOG_LEVEL_TRACE, trace.getMask() & LOG_MODULES);
+            printLogMask("info", LOG_LEVEL <= LOG_LEVEL_INFO, info.getMask() & LOG_MODULES);
+            return CMD_OK;
+        }
+
+        int on = strcmp(arg(4), "on") == 0;
+        if(!on && strcmp(arg(4), "off") != 0){
+            return CMD_HELP;
+        }
+        if(strcmp(arg(2), "trace") == 0){
+            trace.setMask(updateLogMask(trace.getMask(), arg(3), on));
+        } else if(strcmp(arg(2), "info") == 0){
+            info.setMask(updateLogMask(info.getMask(), arg(3), on));
+        } else {
+            return CMD_HELP;
+        }
+        out->println("Log mask updated.");
+        return CMD_OK;
     };
 
     int cmd_logs(){
 
+        const char * mask[] = {"mask", "m", nullptr };
+        if(isSubcommand(mask)){
+            return cmd_log_mask();
+        }
+
+        const char * format[] = {"format", "fmt", nullptr };
+        if(isSubcommand(format)){
+            if(strlen(arg(2)) > 0){
+                int binary = strcmp(arg(2), "binary") == 0;
+                if(!binary && strcmp(arg(2), "text") != 0){
+                    return CMD_HELP;
+                }
+                trace.setBinary(binary);
+                info.setBinary(binary);
+                error.setBinary(binary);
+            }
+            out->print("Log format: ");
+            out->println(trace.isBinary() ? "binary" : "text");
+            return CMD_OK;
+        }
+
+        const char * stats[] = {"stats", "s", nullptr };
+        if(isSubcommand(stats)){
+            if(strcmp(arg(2), "reset") == 0){
+                logRing.resetStats();
+                out->println("Log statistics cleared.");
+                return CMD_OK;
+            }
+            logRing.printStats(*out);
+            LogFileWriter * w = error.getWriter();
+            out->print("Error log: ");
+            out->print(w->isOpen() ? w->getFileName() : "closed");
+            out->print(", Buffered: ");
+            out->print(w->getBuffered());
+            out->print(" bytes, Sector writes: ");
+            out->print(w->getSectorWrites());
+            out->print(", Flushes: ");
+            out->print(w->getFlushes());
+            out->print(", Open failures: ");
+            out->println(w->getOpenFailures());
+            const LogSegment & segment = error.getSegment();
+            out->print("Segment: ");
+            out->print(segment.sequence);
+            out->print(", Records: ");
+            out->print(segment.records);
+            out->print(", Segments started: ");
+            out->print(error.getSegmentsStarted());
+            out->print(", Removed (size cap): ");
+            out->print(error.getEvicted());
+            out->print(", Rejected while removing logs: ");
+            out->println(error.getRejected());
+            return CMD_OK;
+        }
+
         if(!SD.begin(SD_CS)) {
             out->println("SD card initialization failed. Check a card is inserted.");
             return CMD_ERROR;
@@ -468,21 +948,36 @@ class CliDevice : public Cli {
 
         LogManager lm(ctx->keepAlive, "LOG");
 
+        // The error log keeps its file open and buffered
+        error.flush();
+
         const char * ls[] = {"ls", "l", "dir", nullptr };
         if(isSubcommand(ls)){
+            if(strcmp(arg(2), "files") == 0){
+                directoryJob.start("LOG");
+                return startJob(&directoryJob);
+            }
             lm.listLogs(*out);
             return CMD_OK;
         }
 
         const char * dump[] = {"dump", "d", "cat", nullptr };
         if(isSubcommand(dump)){
-            if(strcmp("all", args[2]) == 0){
-                lm.dumpAllLogs(*out);
-                return CMD_OK;
+            if(strcmp("all", arg(2)) == 0){
+                if(!logDumpJob.start()){
+                    out->println("No error log index.");
+                    return CMD_OK;
+                }
+                return startJob(&logDumpJob);
             }
-            
-            lm.dumpLog(*out, args[2]);
-            return CMD_OK;
+
+            char fileName[30];
+            snprintf(fileName, sizeof(fileName), "LOG/%s", arg(2));
+            if(!fileDumpJob.start(fileName, 0, 1)){
+                out->println("Log file not found.");
+                return CMD_ERROR;
+            }
+            return startJob(&fileDumpJob);
         }
 
         const char * remove[] = {"remove", "del", "rm", nullptr };
@@ -493,17 +988,11 @@ class CliDevice : public Cli {
             }
 
             if(strcmp("all", args[2])==0){
-                int r = lm.removeAll();
-                if(r==0){
-                    out->println("No files to remove");
-                } else {
-                    out->print("Removed ");
-                    out->print(r);
-                    out->println(" files.");
-                }
-                return CMD_OK;
+                logRemoveJob.start(&error);
+                return startJob(&logRemoveJob);
             }
-            
+
+            error.close();            
             int r = lm.remove(args[2]);
             if(r){
                 out->println("Log file removed");
@@ -518,26 +1007,190 @@ class CliDevice : public Cli {
     };
 
     void help_cbus(){
-        out->println("Displays the CBUS interface configuration.");
+        out->println("Displays the CBUS interface configuration and receive/transmit queue counters.");
+        out->println("Options:");
+        out->println("[filters|filter|f]: displays the MCP2515 acceptance filters in effect.");
+        out->println("[stats|s]: displays the CAN controller error state, error counters, frame rate and bus load.");
+        out->println("[stats|s reset]: clears the error counters and peaks.");
+        out->println("[history|h {n}]: displays the last {n} events received (default 10), newest first.");
+        out->println("[load {nodes} {events/s} {seconds} [live]]: injects events from {nodes} producers at {events/s} each. Dry run unless 'live'.");
+        out->println("[replay {file} [live]]: injects the frames captured in {file}. Lines are '{ms} {opcode} {data}' in hex. Dry run unless 'live'.");
+        out->println("[load|replay]: displays the results of the last run. [load stop]: stops it.");
+        out->println("[setup]: requests a node number from the configuration tool (RQNN). Waits for SNN.");
+        out->println("[save]: writes the current configuration (node number, learned events) to flash.");
+        out->println("[import]: replaces the configuration with the config file in the SD card and saves it to flash.");
     };
 
     int cmd_cbus(){
+        const char * flt[] = {"filters", "filter", "f", nullptr};
+        if(isSubcommand(flt)){
+            printFilters(ctx->cbus->getFilters());
+            return CMD_OK;
+        }
+
+        const char * stats[] = {"stats", "s", nullptr};
+        if(isSubcommand(stats)){
+            if(strcmp(arg(2), "reset") == 0){
+                ctx->cbus->resetHealth();
+                out->println("CBUS statistics cleared.");
+                return CMD_OK;
+            }
+            printHealth(ctx->cbus->getHealth());
+            return CMD_OK;
+        }
+
+        const char * history[] = {"history", "h", nullptr};
+        if(isSubcommand(history)){
+            int n = atoi(arg(2));
+            ctx->journal->printHistory(*out, n > 0 ? n : 10);
+            out->print("Recorded: ");
+            out->print(ctx->journal->getTotal());
+            out->print(", Not yet on SD: ");
+            out->print(ctx->journal->pending());
+            out->print(", Lost: ");
+            out->print(ctx->journal->getLost());
+            out->print(", Writes: ");
+            out->print(ctx->journal->getFlushes());
+            out->print(", Write errors: ");
+            out->print(ctx->journal->getFlushErrors());
+            out->print(", Files started: ");
+            out->println(ctx->journal->getRotations());
+            return CMD_OK;
+        }
+
+        const char * load[] = {"load", nullptr};
+        if(isSubcommand(load)){
+            if(strcmp(arg(2), "stop") == 0){
+                ctx->traffic->stop();
+            } else if(strlen(arg(2)) > 0){
+                if(!ctx->traffic->startLoad(ctx->config->getNodeNumber(), atoi(arg(2)), atoi(arg(3)), atoi(arg(4)), strcmp(arg(5), "live") == 0)){
+                    out->print("Could not start. Check the arguments (nodes x events/s up to ");
+                    out->print(CBUS_LOAD_MAX_RATE);
+                    out->println("), or wait for the current run to finish.");
+                    return CMD_ERROR;
+                }
+                out->println("Load test started. Enter 'cbus load' for results.");
+                return CMD_OK;
+            }
+            ctx->traffic->printReport(*out);
+            return CMD_OK;
+        }
+
+        const char * replay[] = {"replay", nullptr};
+        if(isSubcommand(replay)){
+            if(strlen(arg(2)) > 0){
+                if(!ctx->traffic->startReplay(arg(2), strcmp(arg(3), "live") == 0)){
+                    out->println("Could not start. Check the file exists, or wait for the current run to finish.");
+                    return CMD_ERROR;
+                }
+                out->println("Replay started. Enter 'cbus replay' for results.");
+                return CMD_OK;
+            }
+            ctx->traffic->printReport(*out);
+            return CMD_OK;
+        }
+
+        const char * setup[] = {"setup", nullptr};
+        if(isSubcommand(setup)){
+            ctx->node->enterSetup();
+            out->println("Setup mode. Waiting for a node number from the configuration tool.");
+            return CMD_OK;
+        }
+
+        const char * save[] = {"save", nullptr};
+        if(isSubcommand(save)){
+            if(!ctx->config->save()){
+                out->println("Failed to save configuration to flash.");
+                return CMD_ERROR;
+            }
+            out->println("Configuration saved.");
+            return CMD_OK;
+        }
+
+        const char * import[] = {"import", nullptr};
+        if(isSubcommand(import)){
+            if(ctx->config->import() != CBUS_CFG_INIT_OK){
+                out->println("Failed to import the config file.");
+                return CMD_ERROR;
+            }
+            ctx->cbus->setFilters(ctx->config->getNodeNumber(), ctx->config->getModuleNodeNumber(), ctx->config->useHardwareFilters());
+            out->println("Configuration imported.");
+            return CMD_OK;
+        }
+
         out->println("CBUS interface configuration:");
         out->print("Node number: ");
         out->println(ctx->config->getNodeNumber());
+        out->print("Module node number: ");
+        out->println(ctx->config->getModuleNodeNumber());
         out->print("Relay event number: ");
         out->println(ctx->config->getRelayEventNumber());
-        for(int i = 0; i < ctx->config->getMappedSoundEvents(); i++){
-            int event = ctx->config->getMappedSoundEvent(i);
-            out->print("Event [");
-            out->print(event);
+        const char * modes[] = {"Normal", "Setup", "Learn"};
+        out->print("Mode: ");
+        out->println(modes[ctx->node->getMode()]);
+        out->print("Flash: ");
+        out->print(ctx->config->isLoadedFromFlash() ? "loaded at boot" : "imported from file");
+        out->print(", Slot: ");
+        out->print(ctx->config->getStore()->getCurrentSlot());
+        out->print("/");
+        out->print(ctx->config->getStore()->getSlots());
+        out->print(", Sequence: ");
+        out->print(ctx->config->getStore()->getSequence());
+        out->print(", Saves: ");
+        out->print(ctx->config->getStore()->getSaves());
+        out->println(ctx->config->isDirty() ? ", Unsaved changes" : "");
+        out->print("Frames received: ");
+        out->print(ctx->cbus->getReceivedFrames());
+        out->print(", Queued: ");
+        out->print(ctx->cbus->available());
+        out->print("/");
+        out->print(ctx->cbus->getQueueCapacity());
+        out->print(", Overflows: ");
+        out->print(ctx->cbus->getOverflows());
+        out->print(", Ignored (RTR): ");
+        out->println(ctx->cbus->getIgnoredFrames());
+        out->print("Frames sent: ");
+        out->print(ctx->cbus->getTransmittedFrames());
+        out->print(", TX queued: ");
+        out->print(ctx->cbus->getTxQueued());
+        out->print(", TX full: ");
+        out->print(ctx->cbus->getTxFull());
+        out->print(", Deferred: ");
+        out->print(ctx->cbus->getTxDeferred());
+        out->print(", Retransmitted: ");
+        out->println(ctx->cbus->getTxRetried());
+        out->print("Produced events. Pushbutton: ");
+        out->print(ctx->config->getKeyEventNumber());
+        out->print(", Track: ");
+        out->print(ctx->config->getTrackEventNumber());
+        out->print(", CANID: ");
+        out->println(ctx->config->getCanId());
+        out->print("Mappings: ");
+        out->print(ctx->config->getMappingCount());
+        out->print("/");
+        out->print(CBUS_MAX_MAPPINGS);
+        out->print(", Track names: ");
+        out->print(ctx->config->getTrackArenaUsed());
+        out->print("/");
+        out->print(CBUS_TRACK_ARENA_SIZE);
+        out->println(" bytes");
+        for(int i = 0; i < ctx->config->getMappingCount(); i++){
+            const CBUSMapping * m = ctx->config->getMapping(i);
+            out->print("Node [");
+            out->print(m->nodeNumber);
+            out->print("] Event [");
+            out->print(m->eventNumber);
+            if(m->action == CBUS_ACTION_RELAY){
+                out->println("] mapped to relay");
+                continue;
+            }
             out->print("] mapped to track [");
-            out->print(ctx->config->getMappedSoundTrack(i));
-            if(event == 0){
-                out->println("] - Default");
-            } else {
-                out->println("]");
+            out->print(ctx->config->getTrackName(m));
+            out->print("]");
+            if(ctx->config->getTrackHandle(m) < 0){
+                out->print(" - Not on the SD card");
             }
+            out->println(m->eventNumber == DEFAULT_TRACK ? " - Default" : "");
         }
         return CMD_OK;
     };
@@ -556,6 +1209,7 @@ class CliDevice : public Cli {
         static const char * a_audio[] = {"audio", "aud", nullptr};
         static const char * a_relay[] = {"relay", "rly", nullptr};
         static const char * a_cbus[] = {"cbus", nullptr};
+        static const char * a_trace[] = {"trace", "tr", nullptr};
 
         #define CLI_COMMAND_ENTRY(name, alias) \
             { #name, static_cast<helpHandler>(&CliDevice::help_##name), static_cast<commandHandler>(&CliDevice::cmd_##name), alias }
@@ -571,7 +1225,8 @@ class CliDevice : public Cli {
             CLI_COMMAND_ENTRY(fs, a_fs),
             CLI_COMMAND_ENTRY(logs, a_logs),
             CLI_COMMAND_ENTRY(audio, a_audio),
-            CLI_COMMAND_ENTRY(cbus, a_cbus)
+            CLI_COMMAND_ENTRY(cbus, a_cbus),
+            CLI_COMMAND_ENTRY(trace, a_trace)
         };
         static CMDS commands = {
             sizeof(cmd_defs)/sizeof(CMD),
@@ -582,10 +1237,28 @@ class CliDevice : public Cli {
     };
 
 public:
-  CliDevice(Stream * in, Stream * out, CliContext * ctx) : Cli(in, out, ctx) {
+  CliDevice(Stream * in, Stream * out, CliContext * ctx) : Cli(in, out, ctx), job(nullptr) {
     buildCmds();
   };
 
+  // Runs a slice of the job in progress, if any. New input stops it and is read as the next command
+  int run(){
+    if(job){
+      if(!in->available()){
+        runJob();
+        return CMD_SKIP;
+      }
+      out->println("Stopped.");
+      endJob();
+    }
+    return Cli::run();
+  };
+
+  // A job is running: the main loop must not sleep
+  int isBusy(){
+    return job != nullptr;
+  };
+
 private:
 
     //Helper fiunctions for various cmds
@@ -596,27 +1269,89 @@ private:
         out->println("] doesn't exist.");
     };
 
-    void printDirectory(Stream * out, File dir, int numTabs, void (*keepAlive)()) {    
-        while(1){
-            (*keepAlive)();
-            File entry =  dir.openNextFile();
-            if (!entry) {
-                // no more files
-                break;
-            }
-            for(uint8_t i = 0; i < numTabs; i++) {
-                out->print('\t');
-            }
-            out->print(entry.name());
-            if(entry.isDirectory()) {
-                out->println("/");
-                printDirectory(out, entry, numTabs + 1, keepAlive);
-            } else {
-                // files have sizes, directories do not
-                out->print("\t\t");
-                out->println(entry.size(), DEC);
-            }
-            entry.close();
+    void printHexByte(byte b){
+        if(b < 0x10){
+            out->print('0');
+        }
+        out->print(b, HEX);
+    };
+
+    // Tenths as {integer}.{decimal}
+    void printTenths(unsigned int value){
+        out->print(value / 10);
+        out->print('.');
+        out->print(value % 10);
+    };
+
+    void printHealth(const CBUSHealth * h){
+        const char * states[] = {"error active", "error warning", "error passive", "bus off"};
+        out->print("Bus state: ");
+        out->print(states[h->state]);
+        out->print(", EFLG: ");
+        printHexByte(h->eflg);
+        out->println();
+        out->print("TEC: ");
+        out->print(h->tec);
+        out->print(" (max ");
+        out->print(h->maxTec);
+        out->print("), REC: ");
+        out->print(h->rec);
+        out->print(" (max ");
+        out->print(h->maxRec);
+        out->println(")");
+        out->print("Overflows. Controller: ");
+        out->print(h->hwOverflows);
+        out->print(", RX queue: ");
+        out->println(ctx->cbus->getOverflows());
+        out->print("Error warning: ");
+        out->print(h->warnings);
+        out->print(", Error passive: ");
+        out->print(h->errorPassive);
+        out->print(", Bus off: ");
+        out->print(h->busOff);
+        out->print(", Recovered: ");
+        out->println(h->recoveries);
+        out->print("Frames/s: ");
+        out->print(h->fps);
+        out->print(" (peak ");
+        out->print(h->peakFps);
+        out->print("), Bus load: ");
+        printTenths(h->load);
+        out->print("% (peak ");
+        printTenths(h->peakLoad);
+        out->println("%)");
+        if(ctx->cbus->getFilters()->mode == CBUS_FILTER_NODE){
+            out->println("Acceptance filters are on: rates only include frames for this node.");
+        }
+        out->print("Samples: ");
+        out->println(h->samples);
+    };
+
+    void printFilters(const CBUSFilters * f){
+        if(f->mode == CBUS_FILTER_PROMISCUOUS){
+            out->println("Acceptance filters: promiscuous (all frames are received)");
+            return;
+        }
+        out->println("Acceptance filters: node. Pairs are {opcode, node number high byte}");
+        for(int i = 0; i < MCP_MASKS; i++){
+            out->print("Mask ");
+            out->print(i);
+            out->print(": ");
+            printHexByte(f->masks[i][0]);
+            out->print(" ");
+            printHexByte(f->masks[i][1]);
+            out->println();
+        }
+        for(int i = 0; i < MCP_FILTERS; i++){
+            out->print("Filter ");
+            out->print(i);
+            out->print(" (RXB");
+            out->print(i < 2 ? 0 : 1);
+            out->print("): ");
+            printHexByte(f->filters[i][0]);
+            out->print(" ");
+            printHexByte(f->filters[i][1]);
+            out->println();
         }
     };
 };
@@ -6,19 +6,78 @@
 
 #define SD_CS 5
 
-#define TICK_IN_MILLIS    500
-#define MIN_TO_TICKS(x)   (x*60*1000/TICK_IN_MILLIS)
-#define HR_TO_TICKS(x)    (x*3600*1000/TICK_IN_MILLIS)
-#define SEC_TO_TICKS(x)   (x*1000/TICK_IN_MILLIS)
-#define HALF_SECOND       TICK_IN_MILLIS      
+// Dispatcher periods and timers are in mS
+#define MIN_TO_MILLIS(x)  ((x)*60*1000UL)
+#define HR_TO_MILLIS(x)   ((x)*3600*1000UL)
+#define SEC_TO_MILLIS(x)  ((x)*1000UL)
+#define HALF_SECOND       500
+#define ACTIVITY_DURATION SEC_TO_MILLIS(15)   //Relay and default audio on after the push button is pressed
+
+// Console logging compiled in (Logger.h). Anything below LOG_LEVEL, or outside LOG_MODULES, generates no code
+#ifdef RELEASE
+  #define LOG_LEVEL       LOG_LEVEL_INFO
+#else
+  #define LOG_LEVEL       LOG_LEVEL_TRACE
+#endif
+#define LOG_MODULES       LOG_MODULES_ALL
+#define LOG_RING_SIZE     2048  //Console log records waiting to be written to Serial. Must be a power of 2
+#define LOG_RECORD_SIZE   160   //Longest console log record. Longer ones are truncated
+#define LOG_DRAIN_CHUNK   64    //Bytes the log ring writes to Serial per main loop pass. A USB packet
+#define LOG_DRAIN_SLOW    2000  //uS. A write to Serial that took longer means the host is not reading
+#define LOG_DRAIN_BACKOFF 100   //mS the log ring waits after a slow write
+#define LOG_FILE_PREALLOC 8192  //Error log segments grow in chunks of this size, allocated up front (multiple of 512)
+#define LOG_SEGMENT_SIZE  65536 //Error log segment file size. A new segment is started when it's full
+#define LOG_TOTAL_SIZE    1048576 //Error log segments kept in SD. The oldest is removed to start a new one
+#define LOG_INDEX_FILE    "LOG/INDEX.DAT"
+#define LOG_FLUSH_INTERVAL 2000 //mS buffered error log records may wait before they are written to SD
 
 #define WDT_TIMEOUT       15000 //time in mS for the WDT
+#define IDLE_ENABLED      1     //Sleep between dispatcher deadlines (Idle.h). "dispatcher idle off" turns it off
+#define IDLE_MAX_SLEEP    1000  //Longest sleep in mS. Must be well below WDT_TIMEOUT
+#define LATENCY_TRACES    32    //Trigger to sound traces kept for "trace latency" ("audio latency") (32 bytes each)
+
+// Audio
+#define AUDIO_BANK_CLIPS  4     //Sound bank (BANK= in the config file): clips whose start is kept in RAM
+#define AUDIO_BANK_HEAD   2048  //Bytes kept per clip. The VS1053 FIFO size: it plays them while the file is opened
+#define AUDIO_FEED_BLOCK  512   //Bytes per SD read of the audio feeder. Multiple of 512
+#define AUDIO_FEED_BUFFERS 4    //Blocks the audio feeder reads ahead. With the VS1053 FIFO, they cover main loop stalls
+#define AUDIO_PRIORITIES  8     //Tracks with a priority (PRIORITY= in the config file). The rest have 0
+#define AUDIO_QUEUE_SIZE  4     //Play requests waiting for the current track to end (AUDIO_QUEUE=1)
+#define AUDIO_QUEUE_MAX_AGE 10000 //mS a request may wait. Older ones are dropped
+#define AUDIO_MIX_VOICES  3     //WAV clips the mixer layers ("audio mix")
+#define AUDIO_MIX_RATE    22050 //Sample rate of the mixer and its clips. Mono, 16 bit out: 44 KB/s to the VS1053
+#define AUDIO_MIX_IN      256   //Bytes read at a time per IMA-ADPCM voice
+#define AUDIO_CATALOG_SIZE 64   //Audio files in the SD root inspected at boot (AudioCatalog). 36 bytes each
+#define AUDIO_FEED_INTERVAL 20  //Longest mS between feeder polls (SD reads) while playing. Buffers and FIFO last 90 mS of 22050 Hz WAV
 
 // CLI Defs
 #define CLI_LINE_BUF_SIZE  70   //Maximum input string length
 #define CLI_MAX_NUM_ARGS   10   //Maximum number of arguments
+#define CLI_BUDGET_LIST    2000 //uS per main loop pass for listings (fs ls, audio list, logs ls files)
+#define CLI_BUDGET_DUMP    4000 //uS per main loop pass for dumps (fs cat, logs dump)
+#define CLI_BUDGET_REMOVE  4000 //uS per main loop pass for logs rm all
 
 // CAN
 #define MAX_CAN_COMMAND 10
+#define CAN_RX_QUEUE_SIZE 16    //Frames buffered by the CAN interrupt. Must be a power of 2
+#define CAN_TX_QUEUE_SIZE 8     //Frames waiting for a free MCP2515 TX buffer. Must be a power of 2
+#define CBUS_DEFAULT_CANID 100  //CANID used for produced events when not set in the config file
+#define CBUS_MIN_CANID    1     //CBUS CANIDs are 7 bits. 0 is not a valid node CANID
+#define CBUS_MAX_CANID    127
+#define CBUS_MAX_MAPPINGS 128   //(node, event) -> action entries in CBUSConfig. 8 bytes each
+#define CBUS_TRACK_ARENA_SIZE 512  //Bytes for all (interned) track names
+#define NVM_CONFIG_SLOTS 4      //Flash slots the configuration rotates through (wear leveling)
+#define CBUS_JOURNAL_SIZE 64    //Received events kept in RAM (20 bytes each)
+#define CBUS_JOURNAL_BATCH 16   //Pending journal entries that trigger a write to SD
+#define CBUS_JOURNAL_MAX_AGE 60000  //mS an entry may wait in RAM before it's written anyway
+#define CBUS_JOURNAL_FILE "LOG/JOURNAL0.CSV"
+#define CBUS_JOURNAL_FILE2 "LOG/JOURNAL1.CSV"  //The journal alternates between the two files
+#define CBUS_JOURNAL_MAX_SIZE 262144  //Bytes per journal file. Starting one removes the other: at most twice this on SD
+#define CBUS_LOAD_EVENTS 16     //Distinct event numbers each synthetic load producer cycles through
+#define CBUS_LOAD_MAX_RATE 10000 //Frames/s of all load producers together. About 8 times what a 125 kbps bus carries
+#define CBUS_MANUFACTURER_ID 13 //MERG "development" manufacturer id, reported in PNN and PARAMS
+#define CBUS_MODULE_ID 1
+#define CBUS_VERSION_MAJOR 1
+#define CBUS_VERSION_MINOR 'a'
 
 #endif
\ No newline at end of file
@@ -4,71 +4,474 @@
 #include <array>
 #include "Logger.h"
 
-#define MAX_ACTIONS 15
+#define MAX_ACTIONS 2           // Actions added at runtime (add). The periodic tasks are a StaticTasks table
+#define MAX_TIMERS  8           // One-shot timers armed at the same time
+#define DISPATCHER_HISTOGRAM 16 // Handler time buckets, log2 of uS: [0,2) [2,4) [4,8) ... [32768,...)
 
-extern ConsoleLogger trace;
-extern ConsoleLogger info;
+extern TraceLogger trace;
+extern InfoLogger info;
 extern FileLogger error;
 
+// Time spent in a handler, every invocation
+typedef struct {
+    unsigned long count;
+    unsigned long min;         // uS
+    unsigned long max;         // uS
+    unsigned long long total;  // uS
+    unsigned long overruns;    // Took longer than the period
+    uint16_t histogram[DISPATCHER_HISTOGRAM];  // Saturates at 65535
+} DispatcherProfile;
+
+inline void profileReset(DispatcherProfile &profile) {
+    memset(&profile, 0, sizeof(profile));
+}
+
+// period in mS, 0 for one-shot timers
+inline void profileRecord(DispatcherProfile &profile, unsigned long elapsed, unsigned long period) {
+    if (profile.count == 0 || elapsed < profile.min) profile.min = elapsed;
+    if (elapsed > profile.max) profile.max = elapsed;
+    profile.count++;
+    profile.total += elapsed;
+    if (period && elapsed > period * 1000UL) profile.overruns++;
+    int bucket = elapsed > 1 ? 31 - __builtin_clz(elapsed) : 0;
+    if (bucket >= DISPATCHER_HISTOGRAM) bucket = DISPATCHER_HISTOGRAM - 1;
+    if (profile.histogram[bucket] < 0xFFFF) profile.histogram[bucket]++;
+}
+
+inline unsigned long profileMean(const DispatcherProfile &profile) {
+    return profile.count ? (unsigned long)(profile.total / profile.count) : 0;
+}
+
 template<typename T>
 class DispatcherAction {
 public:
     const char *name;          // A four letter name that can be used for execution
     const char *long_name;     // Name of the action
     void (T::*handler)();      // The handler member function of T
-    int ticks;                 // Number of ticks (1 tick = 1 min)
-    int count;                 // Used to keep track of counts for the action
-    int once;                  // Schedules a one-time execution when equal to 0
+    long period;               // mS between runs. -1: disabled
+    unsigned long next;        // millis() of the next run
+    unsigned long runs;
+    unsigned long missed;      // Deadlines skipped because the previous run was too late
+    DispatcherProfile profile;
+};
+
+template<typename T>
+class DispatcherTimer {
+public:
+    void (T::*handler)();
+    unsigned long due;         // millis()
+    int armed;
+};
+
+// Task names are four letters, packed in an integer: lookups compare integers
+constexpr uint32_t taskName(const char * name, int i = 0){
+    return i == 4 || !name[i] ? 0 : ((uint32_t)(uint8_t)name[i] << (8 * i)) | taskName(name, i + 1);
+}
+
+/*
+  A task known at compile time. The handler is a template argument, so the call is direct and can be
+  inlined, and name and period are constants in flash. Only the schedule (StaticTaskState) is in RAM.
+*/
+template<typename T, void (T::*HANDLER)(), unsigned long PERIOD, uint32_t NAME>
+struct StaticTask {
+    static_assert(PERIOD > 0, "Task period must be at least 1 mS");
+    static const unsigned long period = PERIOD;
+    static const uint32_t name = NAME;
+
+    static void run(T *instance) {
+        (instance->*HANDLER)();
+    }
+};
+
+#define STATIC_TASK(T, name, handler, period)   StaticTask<T, handler, period, taskName(name)>
+
+typedef struct {
+    unsigned long next;        // millis() of the next run
+    unsigned long runs;
+    unsigned long missed;      // Deadlines skipped, as in DispatcherAction
+    DispatcherProfile profile;
+} StaticTaskState;
+
+// Unrolled at compile time: one block per task, no loop, no handler pointers
+template<typename T, typename... Tasks>
+struct StaticTaskList {
+    static const int size = 0;
+    static void dispatch(T *, unsigned long, StaticTaskState *, unsigned long &) {}
+    static void reset(unsigned long, StaticTaskState *) {}
+    static int find(uint32_t, int) { return -1; }
+    static void run(T *, int, StaticTaskState *) {}
+    static uint32_t name(int) { return 0; }
+    static unsigned long period(int) { return 0; }
+};
+
+template<typename T, typename Task, typename... Rest>
+struct StaticTaskList<T, Task, Rest...> {
+    typedef StaticTaskList<T, Rest...> Next;
+    static const int size = 1 + Next::size;
+
+    // Runs Task if due. earliest: the next due time of all tasks
+    static void dispatch(T *instance, unsigned long now, StaticTaskState *state, unsigned long &earliest) {
+        if ((long)(now - state->next) >= 0) {
+            unsigned long due = state->next;
+            state->runs++;
+            unsigned long start = micros();
+            Task::run(instance);
+            profileRecord(state->profile, micros() - start, Task::period);
+            state->next = due + Task::period;
+            if ((long)(now - state->next) >= 0) {
+                unsigned long skipped = (now - state->next) / Task::period + 1;
+                state->missed += skipped;
+                state->next += skipped * Task::period;
+            }
+        }
+        if ((long)(state->next - earliest) < 0) {
+            earliest = state->next;
+        }
+        Next::dispatch(instance, now, state + 1, earliest);
+    }
+
+    static void reset(unsigned long now, StaticTaskState *state) {
+        state->next = now + Task::period;
+        Next::reset(now, state + 1);
+    }
+
+    static int find(uint32_t name, int index) {
+        return name == Task::name ? index : Next::find(name, index + 1);
+    }
+
+    static void run(T *instance, int index, StaticTaskState *state) {
+        if (index == 0) {
+            unsigned long start = micros();
+            Task::run(instance);
+            profileRecord(state->profile, micros() - start, Task::period);
+        } else {
+            Next::run(instance, index - 1, state + 1);
+        }
+    }
+
+    static uint32_t name(int index) {
+        return index == 0 ? (uint32_t)Task::name : Next::name(index - 1);
+    }
+
+    static unsigned long period(int index) {
+        return index == 0 ? (unsigned long)Task::period : Next::period(index - 1);
+    }
+};
+
+// What Dispatcher and the CLI see of a StaticTasks table
+template<typename T>
+class DispatcherTaskTable {
+public:
+    virtual unsigned long dispatch(T *instance, unsigned long now) = 0;   // Returns when the next task is due
+    virtual unsigned long reset(unsigned long now) = 0;
+    virtual int find(uint32_t name) const = 0;
+    virtual void run(T *instance, int index) = 0;
+    virtual void schedule(int index, unsigned long now) = 0;
+    virtual int size() const = 0;
+    virtual uint32_t name(int index) const = 0;
+    virtual unsigned long period(int index) const = 0;
+    virtual const StaticTaskState &state(int index) const = 0;
+    virtual void resetStats() = 0;
+};
+
+/*
+  Compile time task table, e.g.:
+    StaticTasks<Actions,
+      STATIC_TASK(Actions, "CBUS", &Actions::checkCBUSCommandAction, 10),
+      STATIC_TASK(Actions, "JRNL", &Actions::checkCBUSJournal, 1000)> tasks;
+    dispatcher.setTasks(&tasks);
+  Dispatcher calls dispatch only when a task is due.
+*/
+template<typename T, typename... Tasks>
+class StaticTasks : public DispatcherTaskTable<T> {
+    typedef StaticTaskList<T, Tasks...> List;
+    StaticTaskState states[List::size];
+
+public:
+    StaticTasks() {
+        memset(states, 0, sizeof(states));
+    }
+
+    virtual unsigned long dispatch(T *instance, unsigned long now) {
+        unsigned long earliest = now + 0x7FFFFFFFUL;
+        List::dispatch(instance, now, states, earliest);
+        return earliest;
+    }
+
+    virtual unsigned long reset(unsigned long now) {
+        List::reset(now, states);
+        unsigned long earliest = now + 0x7FFFFFFFUL;
+        for (int i = 0; i < List::size; i++) {
+            if ((long)(states[i].next - earliest) < 0) {
+                earliest = states[i].next;
+            }
+        }
+        return earliest;
+    }
+
+    virtual int find(uint32_t name) const {
+        return List::find(name, 0);
+    }
+
+    virtual void run(T *instance, int index) {
+        List::run(instance, index, states);
+    }
+
+    virtual void schedule(int index, unsigned long now) {
+        if (index >= 0 && index < List::size) {
+            states[index].next = now;
+        }
+    }
+
+    virtual int size() const {
+        return List::size;
+    }
+
+    virtual uint32_t name(int index) const {
+        return List::name(index);
+    }
+
+    virtual unsigned long period(int index) const {
+        return List::period(index);
+    }
+
+    virtual const StaticTaskState &state(int index) const {
+        return states[index];
+    }
+
+    virtual void resetStats() {
+        for (int i = 0; i < List::size; i++) {
+            states[i].runs = 0;
+            states[i].missed = 0;
+            profileReset(states[i].profile);
+        }
+    }
 };
 
+/*
+  Runs the actions every period mS, fixed rate: a late run doesn't move the schedule, and deadlines that
+  passed while we were late are skipped and counted (missed). One-shot timers (arm) run a handler once,
+  after a delay.
+  Actions and timers are kept in a min-heap by due time, so dispatch only looks at what is due.
+  Slots 0..MAX_ACTIONS-1 in the heap are actions, the rest are timers.
+  Tasks fixed at compile time go in a StaticTasks table (setTasks) instead. Actions added at runtime (add)
+  and the static tasks share names and indexes: the static tasks follow the actions.
+*/
 template<typename T>
 class Dispatcher {
 private:
     std::array<DispatcherAction<T>, MAX_ACTIONS> actions;
-    unsigned long lastMillis;
+    std::array<DispatcherTimer<T>, MAX_TIMERS> timers;
+    int heap[MAX_ACTIONS + MAX_TIMERS];
+    int position[MAX_ACTIONS + MAX_TIMERS];     // Index of each slot in heap. -1: not scheduled
+    int heapLen;
     int disabled;
     int len;
     T *instance;
+    DispatcherTaskTable<T> *tasks;
+    unsigned long tasksDue;    // millis() when the next static task is due
+    DispatcherProfile timerProfile;     // All one-shot timers together
 
     void logMemoryUsage(const char *context) {
-        trace.log("Dispatcher", context, Utils::freeMemory());
+        LOG_TRACE(Dispatcher, "Memory usage: ", context);
+        LOG_TRACE(Dispatcher, "Free memory: ", Utils::freeMemory());
     }
 
     void executeAction(DispatcherAction<T> &action) {
         //logMemoryUsage("Memory before: ");
+        unsigned long start = micros();
         (instance->*action.handler)();
+        profileRecord(action.profile, micros() - start, action.period > 0 ? action.period : 0);
         //logMemoryUsage("Memory after: ");
     }
 
+    unsigned long dueOf(int slot) const {
+        return slot < MAX_ACTIONS ? actions[slot].next : timers[slot - MAX_ACTIONS].due;
+    }
+
+    // millis() wraps: compare the difference
+    bool before(int a, int b) const {
+        return (long)(dueOf(a) - dueOf(b)) < 0;
+    }
+
+    void swap(int i, int j) {
+        int t = heap[i];
+        heap[i] = heap[j];
+        heap[j] = t;
+        position[heap[i]] = i;
+        position[heap[j]] = j;
+    }
+
+    void siftUp(int i) {
+        while (i > 0) {
+            int parent = (i - 1) / 2;
+            if (!before(heap[i], heap[parent])) break;
+            swap(i, parent);
+            i = parent;
+        }
+    }
+
+    void siftDown(int i) {
+        while (true) {
+            int first = i;
+            int left = 2 * i + 1;
+            int right = left + 1;
+            if (left < heapLen && before(heap[left], heap[first])) first = left;
+            if (right < heapLen && before(heap[right], heap[first])) first = right;
+            if (first == i) break;
+            swap(i, first);
+            i = first;
+        }
+    }
+
+    // Inserts slot, or moves it after its due time changed
+    void schedule(int slot) {
+        if (position[slot] < 0) {
+            heap[heapLen] = slot;
+            position[slot] = heapLen++;
+        }
+        siftUp(position[slot]);
+        siftDown(position[slot]);
+    }
+
+    void unschedule(int slot) {
+        int i = position[slot];
+        if (i < 0) return;
+        heapLen--;
+        if (i != heapLen) {
+            swap(i, heapLen);
+        }
+        position[slot] = -1;
+        if (i < heapLen) {
+            siftUp(i);
+            siftDown(i);
+        }
+    }
+
+    void runAction(int x, unsigned long now) {
+        DispatcherAction<T> &action = actions[x];
+        unsigned long due = action.next;
+        unschedule(x);
+
+        LOG_TRACE(Dispatcher, "Action ready: ", action.long_name);
+        action.runs++;
+        executeAction(action);
+
+        // Disabled, or rescheduled by the handler
+        if (action.period < 0 || position[x] >= 0) return;
+
+        action.next = due + action.period;
+        if ((long)(now - action.next) >= 0) {
+            unsigned long skipped = (now - action.next) / action.period + 1;
+            action.missed += skipped;
+            action.next += skipped * action.period;
+        }
+        schedule(x);
+    }
+
+    void runTimer(int t) {
+        DispatcherTimer<T> &timer = timers[t];
+        unschedule(MAX_ACTIONS + t);
+        timer.armed = 0;
+        LOG_TRACE(Dispatcher, "Timer expired: ", t);
+        unsigned long start = micros();
+        (instance->*timer.handler)();
+        profileRecord(timerProfile, micros() - start, 0);
+    }
+
 public:
-    Dispatcher(T *instance) : lastMillis(0), disabled(0), len(0), instance(instance) {}
+    Dispatcher(T *instance) : heapLen(0), disabled(0), len(0), instance(instance), tasks(nullptr), tasksDue(0) {
+        for (int i = 0; i < MAX_ACTIONS + MAX_TIMERS; i++) {
+            position[i] = -1;
+        }
+        for (int t = 0; t < MAX_TIMERS; t++) {
+            timers[t].armed = 0;
+        }
+        profileReset(timerProfile);
+    }
+
+    // The first runs are one period from now
+    void setTasks(DispatcherTaskTable<T> *table) {
+        tasks = table;
+        tasksDue = tasks->reset(millis());
+    }
+
+    DispatcherTaskTable<T> *getTasks() const {
+        return tasks;
+    }
 
-    int add(const char *name, const char *long_name, void (T::*handler)(), int _ticks) {
+    // period in mS. The first run is one period from now
+    int add(const char *name, const char *long_name, void (T::*handler)(), long period) {
         if (len == MAX_ACTIONS) {
-            error.log("Dispatcher", "Max number of actions added.", MAX_ACTIONS);
+            LOG_ERROR(Dispatcher, "Max number of actions added.", MAX_ACTIONS);
             return -1;
         }
         actions[len].name = name;
         actions[len].long_name = long_name;
         actions[len].handler = handler;
-        actions[len].ticks = _ticks;
-        actions[len].count = 0;
-        actions[len].once = -1;
+        actions[len].period = -1;
+        actions[len].runs = 0;
+        actions[len].missed = 0;
+        profileReset(actions[len].profile);
         len++;
+        updateActionPeriod(len - 1, period);
         return len;
     }
 
-    void updateActionTicks(int actionIndex, int _ticks) {
-        if (actionIndex >= 0 && actionIndex < len && _ticks >= -1) {
-            actions[actionIndex].ticks = _ticks;
+    // period >= 1 mS, or -1 to disable. Restarts the schedule from now
+    void updateActionPeriod(int actionIndex, long period) {
+        if (actionIndex < 0 || actionIndex >= len || period < -1 || period == 0) return;
+        actions[actionIndex].period = period;
+        if (period < 0) {
+            unschedule(actionIndex);
+            return;
         }
+        actions[actionIndex].next = millis() + period;
+        schedule(actionIndex);
     }
 
-    void runActionOnce(const char *name, int _ticks) {
-        if (_ticks < 0) return;
+    /*
+      Runs handler once, delay mS from now. Returns the timer, for cancel, or -1 if all MAX_TIMERS are armed.
+      Timers don't run while the dispatcher is disabled.
+    */
+    int arm(void (T::*handler)(), unsigned long delay) {
+        for (int t = 0; t < MAX_TIMERS; t++) {
+            if (!timers[t].armed) {
+                timers[t].handler = handler;
+                timers[t].due = millis() + delay;
+                timers[t].armed = 1;
+                schedule(MAX_ACTIONS + t);
+                return t;
+            }
+        }
+        LOG_ERROR(Dispatcher, "No free timers.", MAX_TIMERS);
+        return -1;
+    }
+
+    void cancel(int timer) {
+        if (timer >= 0 && timer < MAX_TIMERS && timers[timer].armed) {
+            timers[timer].armed = 0;
+            unschedule(MAX_ACTIONS + timer);
+        }
+    }
+
+    int isArmed(int timer) const {
+        return timer >= 0 && timer < MAX_TIMERS && timers[timer].armed;
+    }
+
+    int getArmedTimers() const {
+        int armed = 0;
+        for (int t = 0; t < MAX_TIMERS; t++) {
+            armed += timers[t].armed;
+        }
+        return armed;
+    }
+
+    // Runs the action name once, delay mS from now
+    void runActionOnce(const char *name, unsigned long delay) {
         for (int x = 0; x < len; x++) {
             if (strcmp(name, actions[x].name) == 0) {
-                actions[x].once = _ticks;
+                arm(actions[x].handler, delay);
                 return;
             }
         }
@@ -78,7 +481,16 @@ public:
         disabled = 1;
     }
 
+    // The schedule restarts from now, so the time spent disabled doesn't count as missed deadlines
     void enableAllActions() {
+        if (disabled) {
+            for (int x = 0; x < len; x++) {
+                updateActionPeriod(x, actions[x].period);
+            }
+            if (tasks) {
+                tasksDue = tasks->reset(millis());
+            }
+        }
         disabled = 0;
     }
 
@@ -87,65 +499,74 @@ public:
     }
 
     void disableAction(int actionIndex) {
-        updateActionTicks(actionIndex, -1);
+        updateActionPeriod(actionIndex, -1);
     }
 
     void dispatch() {
         if (disabled) return;
-
-        unsigned long current = millis();
-        if ((current >= lastMillis && (current - lastMillis) >= TICK_IN_MILLIS) ||
-            (lastMillis > current && (lastMillis - current) >= TICK_IN_MILLIS)) {
-            lastMillis = current;
-            step();
-        }
+        step();
     }
 
+    // Runs the actions and timers that are due (regardless if dispatcher is disabled)
     void step() {
-        for (int x = 0; x < len; x++) {
-            DispatcherAction<T> &action = actions[x];
-
-            if (action.once == 0) {
-                action.once = -1;
-                trace.log("Dispatcher", "Running once ready for: ", action.long_name);
-                executeAction(action);
-                continue;
-            } else if (action.once > 0) {
-                trace.log("Dispatcher", "Decrementing running once: ", action.long_name);
-                action.once--;
-            }
-
-            if (action.ticks < 0) continue;
-
-            action.count++;
-            if (action.count >= action.ticks) {
-                trace.log("Dispatcher", "Action ready: ", action.long_name);
-                executeAction(action);
-                action.count = 0;
+        unsigned long now = millis();
+        if (tasks && (long)(now - tasksDue) >= 0) {
+            tasksDue = tasks->dispatch(instance, now);
+        }
+        while (heapLen > 0 && (long)(now - dueOf(heap[0])) >= 0) {
+            int slot = heap[0];
+            if (slot < MAX_ACTIONS) {
+                runAction(slot, now);
+            } else {
+                runTimer(slot - MAX_ACTIONS);
             }
         }
     }
 
     void execute(const char *name) {
-        trace.log("Dispatcher", "Looking to execute action: ", name);
+        LOG_TRACE(Dispatcher, "Looking to execute action: ", name);
+        if (tasks && tasks->find(taskName(name)) >= 0) {
+            execute(len + tasks->find(taskName(name)));
+            return;
+        }
         for (int x = 0; x < len; x++) {
             if (strcmp(name, actions[x].name) == 0) {
                 execute(x);
                 return;
             }
         }
-        error.log("Dispatcher", "Invalid action: ", name);
+        LOG_ERROR(Dispatcher, "Invalid action: ", name);
     }
 
     void execute(int actionIndex) {
         if (actionIndex >= 0 && actionIndex < len) {
-            trace.log("Dispatcher", "Executing action ", actions[actionIndex].name);
+            LOG_TRACE(Dispatcher, "Executing action ", actions[actionIndex].name);
             executeAction(actions[actionIndex]);
+        } else if (tasks && actionIndex >= len && actionIndex < len + tasks->size()) {
+            LOG_TRACE(Dispatcher, "Executing static task ", actionIndex);
+            tasks->run(instance, actionIndex - len);
         } else {
-            error.log("Dispatcher", "Invalid action index: ", actionIndex);
+            LOG_ERROR(Dispatcher, "Invalid action index: ", actionIndex);
         }
     }
 
+    // Handler times, runs and missed deadlines of actions, timers and static tasks
+    void resetStats() {
+        for (int x = 0; x < len; x++) {
+            actions[x].runs = 0;
+            actions[x].missed = 0;
+            profileReset(actions[x].profile);
+        }
+        profileReset(timerProfile);
+        if (tasks) {
+            tasks->resetStats();
+        }
+    }
+
+    const DispatcherProfile &getTimerProfile() const {
+        return timerProfile;
+    }
+
     int getActionsLength() const {
         return len;
     }
@@ -157,25 +578,47 @@ public:
         return nullptr;
     }
 
-    int secondsToNextRun(int actionIndex) const {
+    // mS until the next action, timer or static task is due, limit at most. For the idle loop
+    unsigned long millisToNextDue(unsigned long limit) const {
+        if (disabled) return limit;
+        unsigned long now = millis();
+        long next = limit;
+        if (heapLen > 0 && (long)(dueOf(heap[0]) - now) < next) {
+            next = (long)(dueOf(heap[0]) - now);
+        }
+        if (tasks && (long)(tasksDue - now) < next) {
+            next = (long)(tasksDue - now);
+        }
+        return next > 0 ? next : 0;
+    }
+
+    // -1 if the action is not scheduled
+    long millisToNextRun(int actionIndex) const {
         if (actionIndex >= 0 && actionIndex < len) {
-            if (actions[actionIndex].ticks < 0) {
+            if (position[actionIndex] < 0) {
                 return -1;
             }
-            return (actions[actionIndex].ticks - actions[actionIndex].count) * 1000 / TICK_IN_MILLIS;
+            long left = (long)(actions[actionIndex].next - millis());
+            return left > 0 ? left : 0;
         } else {
-            error.log("Dispatcher", "Invalid action index: ", actionIndex);
+            LOG_ERROR(Dispatcher, "Invalid action index: ", actionIndex);
             return -1;
         }
     }
 
+    // Runs in the next dispatch. A disabled action runs once
     int scheduleForImmediateExecution(int actionIndex) {
         if (actionIndex >= 0 && actionIndex < len) {
-            trace.log("Dispatcher", "Set count = ticks for immediate execution for action ", actions[actionIndex].name);
-            actions[actionIndex].count = actions[actionIndex].ticks;
+            LOG_TRACE(Dispatcher, "Scheduled for immediate execution: ", actions[actionIndex].name);
+            actions[actionIndex].next = millis();
+            schedule(actionIndex);
+            return 0;
+        } else if (tasks && actionIndex >= len && actionIndex < len + tasks->size()) {
+            tasks->schedule(actionIndex - len, millis());
+            tasksDue = millis();
             return 0;
         } else {
-            error.log("Dispatcher", "Invalid action index: ", actionIndex);
+            LOG_ERROR(Dispatcher, "Invalid action index: ", actionIndex);
             return -1;
         }
     }
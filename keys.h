@@ -11,6 +11,14 @@ class Keys {
 
   unsigned long lastDebounceTime;
   int keyInput;
+
+  static volatile unsigned long edges;
+  static volatile unsigned long edgeAt;
+
+  static void onEdge(){
+    edges++;
+    edgeAt = micros();
+  };
   
 public:
   Keys(int keyInput = PUSHBUTTON_PIN) : keyInput(keyInput){
@@ -18,6 +26,20 @@ public:
     lastDebounceTime = millis();
   }
 
+  // Counts presses as they happen, so the idle loop wakes up and latency traces start at the edge
+  void attachInterrupt(){
+    ::attachInterrupt(digitalPinToInterrupt(keyInput), Keys::onEdge, FALLING);
+  }
+
+  unsigned long getEdges(){
+    return edges;
+  }
+
+  // micros() of the last press (or bounce)
+  unsigned long getEdgeAt(){
+    return edgeAt;
+  }
+
   int isOn(){
     int reading = digitalRead(keyInput);
     
@@ -34,4 +56,7 @@ public:
   }
 };
 
+volatile unsigned long Keys::edges = 0;
+volatile unsigned long Keys::edgeAt = 0;
+
 #endif
@@ -0,0 +1,264 @@
+/*
+  Host replay of captured CBUS traffic through the sketch's receive path. The path is:
+  - the MCP2515 acceptance filters CBUS::setFilters programs, on a mock controller;
+  - the CAN interrupt handler;
+  - CBUS::getEvent;
+  - the CBUSConfig index;
+  - CBUSNode and Actions::checkCBUSCommandAction.
+  Relay, audio board, loggers, SD and flash are stubs (tools/replay), so no board is needed.
+
+  For each event it reports its time in the RX queue, its run time on this host (micros(), as the journal
+  measures it on the device) and what the relay and audio board were told to do. Then it reports the
+  frames the filters or a full queue dropped, and totals. Run it before and after a change to the path.
+
+  Frames are in the "cbus replay" format: one per line, "{ms since start} {opcode} {data bytes}", in hex
+  except the time. Lines starting with # are ignored. The RX queue is drained every REPLAY_DRAIN_PERIOD mS,
+  as the "CBUS" task does on the device. So a burst of more than CAN_RX_QUEUE_SIZE frames in one period
+  overflows the queue, as it would on the device.
+
+    g++ -std=gnu++11 -funsigned-char -O2 -Itools/replay -o cbusreplay tools/cbusreplay.cpp
+    ./cbusreplay CBCFG.TXT tools/replay/frames.txt
+*/
+
+#include "ReplayStubs.h"
+#include "../Actions.h"
+
+#define REPLAY_DRAIN_PERIOD 10      // mS. Period of the "CBUS" task in the sketch
+#define REPLAY_CANID        1       // Sender of the frames replayed. The acceptance filters don't look at it
+
+TraceLogger trace;
+InfoLogger info;
+FileLogger error;
+LatencyTracer latency;
+
+Relay relay;
+AudioBoard audio;
+Keys keys;
+CBUS cbus;
+CBUSConfig config;
+CBUSNode node;
+CBUSJournal journal;
+Actions actions;
+Dispatcher<Actions> dispatcher(&actions);
+
+typedef struct {
+  unsigned long frames;
+  unsigned long filtered;
+  unsigned long dropped;      // RX queue full
+  unsigned long undecoded;    // Opcodes getEvent doesn't support
+  unsigned long events;
+  unsigned int maxQueued;
+  unsigned long waitMin;      // uS in the RX queue
+  unsigned long waitMax;
+  unsigned long long waitTotal;
+  unsigned long runMax;       // uS
+  unsigned long long runNanos;  // Host time of all drains
+  unsigned long relayOn;
+  unsigned long relayOff;
+  unsigned long plays;
+  unsigned long stops;
+  unsigned long sent;
+} ReplayStats;
+
+ReplayStats stats;
+size_t logged;                // replayLog entries printed
+
+void keepAlive(){
+}
+
+int resolveTrack(const char * track){
+  return audio.find(track);
+}
+
+void printBytes(const uint8_t * bytes, int length){
+  for(int i = 0; i < length; i++){
+    printf(" %02X", bytes[i]);
+  }
+}
+
+unsigned long journalTotal(){
+  return journal.getTotal();
+}
+
+// Replay log entries made before the journal had more than events entries, indented under the event that caused them
+void printLog(unsigned long events){
+  for(; logged < replayLog.size() && replayLog[logged].events <= events; logged++){
+    const std::string & text = replayLog[logged].text;
+    printf("%12s    %s\n", "", text.c_str());
+    stats.relayOn += text == "relay on";
+    stats.relayOff += text == "relay off";
+    stats.plays += text.compare(0, 10, "audio play") == 0;
+    stats.stops += text.compare(0, 10, "audio stop") == 0;
+  }
+}
+
+// The next frame of the capture. Returns 0 at the end of the file
+int readFrame(FILE * file, unsigned long * at, uint8_t * bytes, int * length){
+  char line[128];
+  while(fgets(line, sizeof(line), file)){
+    if(line[0] == '#'){
+      continue;
+    }
+    char * p = line;
+    char * end;
+    *at = strtoul(p, &end, 10);
+    if(end == p){
+      continue;
+    }
+    *length = 0;
+    for(p = end; *length < 8; p = end){
+      unsigned long b = strtoul(p, &end, 16);
+      if(end == p){
+        break;
+      }
+      bytes[(*length)++] = b;
+    }
+    if(*length > 0){
+      return 1;
+    }
+  }
+  return 0;
+}
+
+void deliver(Adafruit_MCP2515 * mcp, unsigned long at, const uint8_t * bytes, int length){
+  replayClock.set(at * 1000ULL);
+  stats.frames++;
+  unsigned long overflows = cbus.getOverflows();
+  const char * fate = nullptr;
+  if(!mcp->deliver(CBUS_CAN_ID(CBUS_PRIORITY_NORMAL, REPLAY_CANID), bytes, length)){
+    stats.filtered++;
+    fate = "filtered";
+  } else if(cbus.getOverflows() != overflows){
+    stats.dropped++;
+    fate = "dropped, RX queue full";
+  }
+  if(fate){
+    printf("%8lu.000  RX", at);
+    printBytes(bytes, length);
+    printf("  %s\n", fate);
+  }
+}
+
+/*
+  Runs the "CBUS" task at now (uS). Each journal entry it adds has latency = now - received + host uS into
+  the drain when the event was done, so the host time of each event is the difference between two of them.
+  The journal records an event after its actions, so they are the replay log entries made before it.
+*/
+void drain(unsigned long now){
+  unsigned int queued = cbus.available();
+  if(queued > stats.maxQueued){
+    stats.maxQueued = queued;
+  }
+  unsigned long total = journal.getTotal();
+  auto start = std::chrono::steady_clock::now();
+  replayClock.start();
+  actions.checkCBUSCommandAction();
+  replayClock.stop();
+  stats.runNanos += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+
+  unsigned int n = journal.getTotal() - total;
+  stats.undecoded += queued - n;
+  unsigned long previous = 0;
+  for(unsigned int i = n; i-- > 0; ){
+    const CBUSJournalEntry * e = journal.get(i);
+    unsigned long wait = now - e->received;
+    unsigned long done = e->latency - wait;
+    unsigned long run = done - previous;
+    previous = done;
+    printf("%12.3f  %02X %u:%u %-3s -> %-11s wait %6.3f mS, run %lu uS\n", e->received / 1000.0, e->opcode, e->nodeNumber,
+           e->eventNumber, (e->actions & CBUS_JOURNAL_ON) ? "on" : "off", CBUSJournal::actionName(e->actions), wait / 1000.0, run);
+    printLog(total + n - i - 1);
+
+    stats.events++;
+    stats.waitTotal += wait;
+    if(stats.events == 1 || wait < stats.waitMin){
+      stats.waitMin = wait;
+    }
+    if(wait > stats.waitMax){
+      stats.waitMax = wait;
+    }
+    if(run > stats.runMax){
+      stats.runMax = run;
+    }
+  }
+}
+
+// Node replies and produced events, as the main loop sends them
+void transmit(Adafruit_MCP2515 * mcp, unsigned long now){
+  actions.checkAudioActivity();
+  node.poll();
+  cbus.pumpTx();
+  printLog(journal.getTotal());
+  for(int i = 0; i < mcp->sentCount; i++){
+    printf("%12.3f  TX", now / 1000.0);
+    printBytes(mcp->sent[i].data, mcp->sent[i].length);
+    printf("\n");
+  }
+  stats.sent += mcp->sentCount;
+  mcp->sentCount = 0;
+}
+
+int main(int argc, char ** argv){
+  if(argc < 3){
+    fprintf(stderr, "Usage: %s {config file} {frame file}\n", argv[0]);
+    return 2;
+  }
+  FILE * frames = fopen(argv[2], "r");
+  if(!frames){
+    fprintf(stderr, "Can't open %s\n", argv[2]);
+    return 1;
+  }
+
+  replayEvents = journalTotal;
+  config.setTrackResolver(resolveTrack);
+  if(config.init(argv[1]) != CBUS_CFG_INIT_OK){
+    fprintf(stderr, "Can't import %s\n", argv[1]);
+    return 1;
+  }
+  cbus.init(config.getNodeNumber(), config.getModuleNodeNumber(), config.useHardwareFilters());
+  cbus.setCanId(config.getCanId());
+  node.init(&cbus, &config);
+  actions.init(&relay, &audio, &cbus, &config, &node, &journal, &keys, &dispatcher, keepAlive);
+  Adafruit_MCP2515 * mcp = static_cast<Adafruit_MCP2515 *>(replaySpi);
+
+  printf("NN %d, module NN %d, %d mappings, acceptance filters: %s\n", config.getNodeNumber(), config.getModuleNodeNumber(),
+         config.getMappingCount(), cbus.getFilters()->mode == CBUS_FILTER_NODE ? "node" : "promiscuous");
+  printLog(0);
+  replayLog.clear();
+  logged = 0;
+  printf("%12s  Frame / event    -> actions\n", "mS");
+
+  const unsigned long period = REPLAY_DRAIN_PERIOD * 1000UL;
+  unsigned long drainAt = period;
+  unsigned long at;
+  uint8_t bytes[8];
+  int length;
+  int more = readFrame(frames, &at, bytes, &length);
+  while(more || cbus.available()){
+    // Nothing queued: the next drain that matters is the first after the next frame
+    if(!cbus.available() && more && at * 1000UL >= drainAt){
+      drainAt = (at * 1000UL / period + 1) * period;
+    }
+    while(more && at * 1000UL < drainAt){
+      deliver(mcp, at, bytes, length);
+      more = readFrame(frames, &at, bytes, &length);
+    }
+    replayClock.set(drainAt);
+    drain(drainAt);
+    transmit(mcp, drainAt);
+    drainAt += period;
+  }
+  fclose(frames);
+
+  printf("\nFrames: %lu. Filtered: %lu. Dropped, RX queue full: %lu. Not decoded: %lu\n", stats.frames, stats.filtered,
+         stats.dropped, stats.undecoded);
+  printf("Events: %lu. Longest RX queue: %u of %u\n", stats.events, stats.maxQueued, (unsigned)CAN_RX_QUEUE_SIZE);
+  if(stats.events){
+    printf("Wait in the RX queue, mS: min %.3f, mean %.3f, max %.3f\n", stats.waitMin / 1000.0,
+           stats.waitTotal / 1000.0 / stats.events, stats.waitMax / 1000.0);
+    printf("Run time per event on this host: mean %llu nS, max %lu uS\n", stats.runNanos / stats.events, stats.runMax);
+  }
+  printf("Relay on: %lu, off: %lu. Audio plays: %lu, stops: %lu. Frames sent: %lu. Errors logged: %lu\n", stats.relayOn,
+         stats.relayOff, stats.plays, stats.stops, stats.sent, error.errors);
+  return 0;
+}
@@ -0,0 +1,65 @@
+/*
+  Host benchmark of the CBUS mapping index (CBUSIndex.h): time to sort the mappings after a load, and cost of
+  a lookup, at 1k and 10k mappings. Lookups are half hits, half misses. The numbers are for the host: compare
+  them between index changes. On the device CBUS_MAX_MAPPINGS is far smaller (RAM), the cost is O(log n).
+
+    g++ -O2 -o indexbench tools/indexbench.cpp && ./indexbench
+*/
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <utility>
+#include <vector>
+
+#include "../CBUSIndex.h"
+
+static const long LOOKUPS = 1000000;
+static volatile int sink;             // Keeps the compiler from dropping the loops
+
+static double seconds(std::chrono::steady_clock::time_point start){
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static void bench(int count){
+  // Events of a few nodes, two actions on some of them, loaded in file order (mostly sorted, some out of order)
+  std::vector<CBUSMapping> mappings(count);
+  for(int i = 0; i < count; i++){
+    CBUSMapping & m = mappings[i];
+    m.nodeNumber = 256 + (i * 7) / count;
+    m.eventNumber = (i / 2) * 2 + 1;
+    m.action = 1 + (i & 1);
+    m.track = 0;
+  }
+  for(int i = 0; i < count / 20; i++){
+    std::swap(mappings[rand() % count], mappings[rand() % count]);
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  cbusSortMappings(mappings.data(), count);
+  double sort = seconds(start);
+
+  std::vector<uint32_t> keys(1024);
+  for(size_t i = 0; i < keys.size(); i++){
+    const CBUSMapping & m = mappings[rand() % count];
+    keys[i] = cbusKey(m.nodeNumber, m.eventNumber + (i & 1));   // Even events are not mapped
+  }
+
+  start = std::chrono::steady_clock::now();
+  for(long it = 0; it < LOOKUPS; it++){
+    uint32_t key = keys[it & 1023];
+    const CBUSMapping * first;
+    sink += cbusFindMappings(mappings.data(), count, key >> 16, key & 0xFFFF, &first);
+  }
+  double lookup = seconds(start);
+
+  printf("%8d  %12.3f  %12.1f\n", count, sort * 1000, lookup * 1e9 / LOOKUPS);
+}
+
+int main(){
+  srand(1);
+  printf("Mappings  Sort (mS)     Lookup (nS)\n");
+  bench(1000);
+  bench(10000);
+  return 0;
+}
@@ -0,0 +1,106 @@
+#!/usr/bin/env python3
+"""
+Decodes binary log records (see LogBinary.h) in serial captures or SD card log files back into text:
+    LEVEL|module|msg|value                          (console records)
+    epoch|ERROR|module|msg|content type|value       (error log file records)
+Text lines are copied as they are, so captures mixing CLI output and logs can be decoded whole.
+NUL padding (preallocated log files) is skipped.
+
+    python3 tools/logdecode.py capture.txt
+    python3 tools/logdecode.py --table LOGTABLE.TSV LOG/01021530.LOG
+"""
+
+import argparse
+import base64
+import binascii
+import os
+import struct
+import sys
+
+import logtable
+
+MARK = b'~'
+CONSOLE_LEVELS = {0: 'DEBUG', 1: 'INFO ', 2: 'ERRDBG'}
+ARG_NONE, ARG_STRING, ARG_VALUE, ARG_HEX, ARG_BUFFER, ARG_ENCODED = range(6)
+CLOCK_EPOCH = 1
+
+
+def url_encode(data):
+    return ''.join(chr(b) if chr(b).isalnum() and b < 0x80 else '%{:02x}'.format(b) for b in data)
+
+
+def hex_dump(data):
+    return '\n'.join(' '.join('{:02X}'.format(b) for b in data[i:i + 16]) for i in range(0, len(data), 16))
+
+
+def decode(record, table, show_time):
+    level_clock, arg_type, key, time = struct.unpack_from('<BBII', record)
+    level, clock = level_clock & 0x0F, level_clock >> 4
+    module, msg = table.get(key, ('?', '<unknown id {:08x}>'.format(key)))
+    rest = record[10:]
+
+    content_type = 'text/plain'
+    if arg_type == ARG_NONE:
+        value = None
+    elif arg_type == ARG_STRING:
+        value = rest[1:1 + rest[0]].decode('latin-1')
+    elif arg_type == ARG_VALUE:
+        value = str(struct.unpack_from('<I', rest)[0])
+    elif arg_type == ARG_HEX:
+        value = '{:X}'.format(rest[0])
+    elif arg_type == ARG_BUFFER:
+        value = '\n' + hex_dump(rest[1:1 + rest[0]])
+    elif arg_type == ARG_ENCODED:
+        content_type = rest[1:1 + rest[0]].decode('latin-1')
+        body = rest[1 + rest[0]:]
+        length = struct.unpack_from('<H', body)[0]
+        value = url_encode(body[2:2 + length])
+    else:
+        value = '<unknown argument type {}>'.format(arg_type)
+
+    if clock == CLOCK_EPOCH:
+        return '{}|ERROR|{}|{}|{}|{}'.format(time, module, msg, content_type, value if value is not None else '')
+
+    text = '{}|{}|{}'.format(CONSOLE_LEVELS.get(level, level), module, msg)
+    if value is not None:
+        text += ('' if value.startswith('\n') else '|') + value
+    return '{}|{}'.format(time, text) if show_time else text
+
+
+def decode_stream(data, table, show_time, out):
+    for line in data.replace(b'\0', b'').split(b'\n'):
+        line = line.rstrip(b'\r')
+        start = line.find(MARK)
+        if start < 0:
+            out.write(line.decode('latin-1') + '\n')
+            continue
+        # Whatever preceded the mark on the line (CLI output without a newline) is kept
+        if start > 0:
+            out.write(line[:start].decode('latin-1'))
+        try:
+            record = base64.b64decode(line[start + 1:], validate=True)
+            out.write(decode(record, table, show_time) + '\n')
+        except (binascii.Error, struct.error, IndexError):
+            out.write(line[start:].decode('latin-1') + '\n')
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('files', nargs='*', help='captures or log files (default: stdin)')
+    parser.add_argument('--table', help='table written by logtable.py (default: scan --src)')
+    parser.add_argument('--src', default=os.path.join(os.path.dirname(os.path.abspath(__file__)), '..'),
+                        help='firmware sources used when there is no --table (default: the repository)')
+    parser.add_argument('--time', action='store_true', help='prefix console records with millis()')
+    args = parser.parse_args()
+
+    table = logtable.load(args.table) if args.table else logtable.scan(args.src)
+
+    if not args.files:
+        decode_stream(sys.stdin.buffer.read(), table, args.time, sys.stdout)
+    for name in args.files:
+        with open(name, 'rb') as f:
+            decode_stream(f.read(), table, args.time, sys.stdout)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,73 @@
+#!/usr/bin/env python3
+"""
+Builds the log string table: ID -> (module, message) for every LOG_TRACE, LOG_TRACE_HEX, LOG_INFO and
+LOG_ERROR call in the firmware sources. IDs are the FNV-1a hash of "module|msg", as LOG_ID computes them.
+
+Run it on the same sources that were built, and keep the output with the binary:
+    python3 tools/logtable.py > LOGTABLE.TSV
+"""
+
+import argparse
+import os
+import re
+import sys
+
+CALL = re.compile(r'LOG_(?:TRACE_HEX|TRACE|INFO|ERROR)\(\s*(\w+)\s*,\s*((?:"(?:[^"\\]|\\.)*"\s*)+)')
+LITERAL = re.compile(r'"((?:[^"\\]|\\.)*)"')
+ESCAPES = {'n': '\n', 't': '\t', 'r': '\r', '0': '\0', '\\': '\\', '"': '"', "'": "'"}
+
+
+def fnv1a(text):
+    h = 2166136261
+    for b in text.encode('latin-1'):
+        h = ((h ^ b) * 16777619) & 0xFFFFFFFF
+    return h
+
+
+def unescape(literal):
+    return re.sub(r'\\(.)', lambda m: ESCAPES.get(m.group(1), m.group(1)), literal)
+
+
+def scan(src):
+    """Returns {id: (module, msg)} for all the sources (*.h, *.ino, *.cpp) in src"""
+    table = {}
+    for name in sorted(os.listdir(src)):
+        if not name.endswith(('.h', '.ino', '.cpp')):
+            continue
+        with open(os.path.join(src, name), encoding='latin-1') as f:
+            text = f.read()
+        for m in CALL.finditer(text):
+            if m.group(1) == 'module':
+                continue    # The macro definitions themselves
+            module = m.group(1)
+            msg = ''.join(unescape(s) for s in LITERAL.findall(m.group(2)))
+            key = fnv1a(module + '|' + msg)
+            if key in table and table[key] != (module, msg):
+                print('ID collision: {}|{} and {}|{}'.format(module, msg, *table[key]), file=sys.stderr)
+            table[key] = (module, msg)
+    return table
+
+
+def load(path):
+    """Reads a table written by this script"""
+    table = {}
+    with open(path, encoding='latin-1') as f:
+        for line in f:
+            parts = line.rstrip('\n').split('\t', 2)
+            if len(parts) == 3:
+                table[int(parts[0], 16)] = (parts[1], parts[2].encode('latin-1').decode('unicode_escape'))
+    return table
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('src', nargs='?', default=os.path.join(os.path.dirname(os.path.abspath(__file__)), '..'),
+                        help='firmware source folder (default: the repository)')
+    args = parser.parse_args()
+
+    for key, (module, msg) in sorted(scan(args.src).items(), key=lambda item: item[1]):
+        print('{:08x}\t{}\t{}'.format(key, module, msg.encode('unicode_escape').decode('latin-1')))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,63 @@
+/*
+  Host benchmark of the mixing kernel (MixKernel.h): samples per second mixed for 1 to 8 voices, and
+  IMA-ADPCM samples decoded per second. The numbers are for the host: compare them between kernel changes.
+  "audio mixbench" runs the same loops on the device.
+
+    g++ -O2 -o mixbench tools/mixbench.cpp && ./mixbench
+*/
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+
+#include "../MixKernel.h"
+
+static const int BLOCK = 256;         // Samples per mix call, as AudioMixer does (AUDIO_FEED_BLOCK / 2)
+static const int MAX_VOICES = 8;
+static const long ITERATIONS = 100000;
+
+static int16_t inputs[MAX_VOICES][BLOCK];
+static int32_t acc[BLOCK];
+static int16_t out[BLOCK];
+static volatile int32_t sink;         // Keeps the compiler from dropping the loops
+
+static double seconds(std::chrono::steady_clock::time_point start){
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(){
+  srand(1);
+  for(int v = 0; v < MAX_VOICES; v++){
+    for(int i = 0; i < BLOCK; i++){
+      inputs[v][i] = (int16_t)(rand() - RAND_MAX / 2);
+    }
+  }
+
+  printf("Voices  Samples/s (output)  Voice samples/s\n");
+  for(int voices = 1; voices <= MAX_VOICES; voices++){
+    auto start = std::chrono::steady_clock::now();
+    for(long it = 0; it < ITERATIONS; it++){
+      for(int i = 0; i < BLOCK; i++){
+        acc[i] = 0;
+      }
+      for(int v = 0; v < voices; v++){
+        mixAccumulate(acc, inputs[v], BLOCK, MIX_GAIN_UNITY / voices);
+      }
+      mixSaturate(out, acc, BLOCK);
+      sink += out[it % BLOCK];
+    }
+    double rate = ITERATIONS * BLOCK / seconds(start);
+    printf("%6d  %18.0f  %15.0f\n", voices, rate, rate * voices);
+  }
+
+  ImaState state = { 0, 0 };
+  auto start = std::chrono::steady_clock::now();
+  for(long it = 0; it < ITERATIONS; it++){
+    for(int i = 0; i < BLOCK; i++){
+      out[i] = imaDecode(state, (uint8_t)(inputs[0][i] & 0x0F));
+    }
+    sink += out[it % BLOCK];
+  }
+  printf("IMA-ADPCM decode: %.0f samples/s\n", ITERATIONS * BLOCK / seconds(start));
+  return 0;
+}
@@ -0,0 +1,198 @@
+#ifndef REPLAY_MCP2515_H
+#define REPLAY_MCP2515_H
+
+#include "Arduino.h"
+
+/*
+  Host mock of the MCP2515 and its library, fed by tools/cbusreplay.cpp.
+  - The registers CBUS.h programs over SPI (READ, WRITE, BIT MODIFY, RTS) are kept in an array, so the
+    acceptance masks and filters it writes are the ones applied to received frames.
+  - deliver() is a frame on the bus: if the filters accept it, the onReceive callback runs with it, as the
+    library does from CAN_INT.
+  - RTS sends the TX buffers at once: they are copied to sent, and TXREQ stays clear.
+*/
+
+#define REPLAY_MCP_READ     0x03
+#define REPLAY_MCP_WRITE    0x02
+#define REPLAY_MCP_MODIFY   0x05
+#define REPLAY_MCP_RTS      0x80
+#define REPLAY_MCP_CANSTAT  0x0E
+#define REPLAY_MCP_CANCTRL  0x0F
+#define REPLAY_MCP_SENT     64      // Frames kept until the harness takes them
+
+typedef struct {
+  int id;
+  int length;
+  uint8_t data[8];
+} ReplayCanFrame;
+
+class Adafruit_MCP2515 : public Stream, public ReplaySpiDevice {
+
+  uint8_t registers[128];
+  int selected;
+  int step;                   // Bytes of the current SPI command so far
+  uint8_t command;
+  uint8_t address;
+  uint8_t mask;               // BIT MODIFY
+  void (*callback)(int);
+  ReplayCanFrame rx;          // Frame being received (callback)
+  int rxRead;
+
+  // RXF0-2 at 0x00, RXF3-5 at 0x10, RXM0-1 at 0x20. {SIDH, SIDL, EID8, EID0}
+  static int filterAddress(int n){
+    return n < 3 ? n * 4 : 0x10 + (n - 3) * 4;
+  };
+
+  /*
+    A standard frame matches when the SID bits, and the EID8/EID0 bits against data bytes 0 and 1, are
+    equal wherever the mask is set. Filters for extended frames (EXIDE) don't match standard ones.
+  */
+  int matches(int filter, int maskIndex, const ReplayCanFrame & frame){
+    const uint8_t * f = &registers[filterAddress(filter)];
+    const uint8_t * m = &registers[0x20 + maskIndex * 4];
+    if(f[1] & 0x08){
+      return 0;
+    }
+    uint8_t sidh = (frame.id >> 3) & 0xFF;
+    uint8_t sidl = (frame.id & 0x07) << 5;
+    uint8_t d0 = frame.length > 0 ? frame.data[0] : 0;
+    uint8_t d1 = frame.length > 1 ? frame.data[1] : 0;
+    return !((sidh ^ f[0]) & m[0]) && !((sidl ^ f[1]) & m[1] & 0xE0) && !((d0 ^ f[2]) & m[2]) && !((d1 ^ f[3]) & m[3]);
+  };
+
+  // RXBnCTRL RXM = 11: masks and filters off
+  int accepts(const ReplayCanFrame & frame){
+    if((registers[0x60] & 0x60) == 0x60 || (registers[0x70] & 0x60) == 0x60){
+      return 1;
+    }
+    for(int n = 0; n < 6; n++){
+      if(matches(n, n < 2 ? 0 : 1, frame)){
+        return 1;
+      }
+    }
+    return 0;
+  };
+
+  void writeRegister(uint8_t reg, uint8_t value){
+    reg &= 0x7F;
+    if(reg == REPLAY_MCP_CANCTRL){
+      registers[REPLAY_MCP_CANSTAT] = (registers[REPLAY_MCP_CANSTAT] & ~0xE0) | (value & 0xE0);   // Mode changes at once
+    }
+    registers[reg] = value;
+  };
+
+  // TXBnCTRL at 0x30 + 0x10 n: CTRL, SIDH, SIDL, EID8, EID0, DLC, D0..D7
+  void send(int n){
+    const uint8_t * b = &registers[0x30 + n * 0x10];
+    if(sentCount < REPLAY_MCP_SENT){
+      ReplayCanFrame & frame = sent[sentCount++];
+      frame.id = (b[1] << 3) | (b[2] >> 5);
+      frame.length = b[5] & 0x0F;
+      memcpy(frame.data, &b[6], 8);
+    }
+    registers[0x30 + n * 0x10] &= ~0x08;
+  };
+
+public:
+
+  ReplayCanFrame sent[REPLAY_MCP_SENT];
+  int sentCount;
+  unsigned long filtered;     // Frames the acceptance filters rejected
+
+  Adafruit_MCP2515(int cs) : selected(0), step(0), command(0), address(0), mask(0), callback(nullptr), rxRead(0), sentCount(0),
+                             filtered(0) {
+    memset(registers, 0, sizeof(registers));
+    registers[0x60] = registers[0x70] = 0x60;
+    csPin = cs;
+    replaySpi = this;
+  };
+
+  int begin(long){
+    return 1;
+  };
+
+  void onReceive(int, void (*callback)(int)){
+    this->callback = callback;
+  };
+
+  // A frame on the bus. Returns 0 if the acceptance filters drop it
+  int deliver(int id, const uint8_t * data, int length){
+    rx.id = id;
+    rx.length = length < 8 ? length : 8;
+    memset(rx.data, 0, sizeof(rx.data));
+    memcpy(rx.data, data, rx.length);
+    if(!accepts(rx)){
+      filtered++;
+      return 0;
+    }
+    rxRead = 0;
+    if(callback){
+      callback(rx.length);
+    }
+    return 1;
+  };
+
+  bool packetRtr(){
+    return false;
+  };
+
+  long packetId(){
+    return rx.id;
+  };
+
+  int available(){
+    return rx.length - rxRead;
+  };
+
+  int read(){
+    return rxRead < rx.length ? rx.data[rxRead++] : -1;
+  };
+
+  int peek(){
+    return rxRead < rx.length ? rx.data[rxRead] : -1;
+  };
+
+  size_t write(uint8_t){
+    return 1;
+  };
+
+  using Print::write;
+
+  void select(int selected){
+    this->selected = selected;
+    step = 0;
+  };
+
+  uint8_t transfer(uint8_t value){
+    if(!selected){
+      return 0;
+    }
+    uint8_t out = 0;
+    if(step == 0){
+      command = value;
+      if((command & 0xF8) == REPLAY_MCP_RTS){
+        for(int n = 0; n < 3; n++){
+          if(command & (1 << n)){
+            send(n);
+          }
+        }
+      }
+    } else if(step == 1){
+      address = value & 0x7F;
+    } else if(command == REPLAY_MCP_READ){
+      out = registers[address++ & 0x7F];
+    } else if(command == REPLAY_MCP_WRITE){
+      writeRegister(address++, value);
+    } else if(command == REPLAY_MCP_MODIFY){
+      if(step == 2){
+        mask = value;
+      } else if(step == 3){
+        writeRegister(address, (registers[address] & ~mask) | (value & mask));
+      }
+    }
+    step++;
+    return out;
+  };
+};
+
+#endif
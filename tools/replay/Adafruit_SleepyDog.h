@@ -0,0 +1,18 @@
+#ifndef REPLAY_SLEEPYDOG_H
+#define REPLAY_SLEEPYDOG_H
+
+// Host stand-in for the watchdog library
+class ReplayWatchdog {
+public:
+  int enable(int ms = 0){
+    return ms;
+  };
+  void disable(){
+  };
+  void reset(){
+  };
+};
+
+ReplayWatchdog Watchdog;
+
+#endif
@@ -0,0 +1,226 @@
+#ifndef REPLAY_ARDUINO_H
+#define REPLAY_ARDUINO_H
+
+/*
+  Host stand-in for the Arduino core, for tools/cbusreplay.cpp: only what the CBUS receive path uses.
+  Time is the replay clock (replayClock), pins are an array, and one SPI device (the MCP2515 mock) is
+  selected with its CS pin.
+*/
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#define ARDUINO 10819           // As the IDE passes it. Utils::freeMemory then only needs __brkval
+
+char * __brkval = nullptr;
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+#define RISING 3
+#define FALLING 2
+#define CHANGE 1
+#define LED_BUILTIN 13
+#define HEX 16
+#define DEC 10
+
+/*
+  Replay time in uS. Frozen between steps, set by the harness to each frame's capture time. While running
+  (start), host time is added: what the sketch measures with micros() is then its real cost on this host.
+*/
+struct ReplayClock {
+  unsigned long long now;
+  int running;
+  std::chrono::steady_clock::time_point since;
+
+  void set(unsigned long long micros){
+    now = micros;
+    running = 0;
+  };
+
+  void start(){
+    since = std::chrono::steady_clock::now();
+    running = 1;
+  };
+
+  // Back to the frozen time. Returns the host uS that ran
+  unsigned long long stop(){
+    unsigned long long elapsed = this->elapsed();
+    running = 0;
+    return elapsed;
+  };
+
+  unsigned long long elapsed(){
+    if(!running){
+      return 0;
+    }
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - since).count();
+  };
+
+  unsigned long long micros(){
+    return now + elapsed();
+  };
+};
+
+ReplayClock replayClock;
+
+inline unsigned long micros(){
+  return (unsigned long)replayClock.micros();
+}
+
+inline unsigned long millis(){
+  return (unsigned long)(replayClock.micros() / 1000);
+}
+
+inline void delay(unsigned long){
+}
+
+inline void delayMicroseconds(unsigned int){
+}
+
+// The one SPI device on the bus, selected while its CS pin is LOW
+class ReplaySpiDevice {
+public:
+  int csPin;
+  virtual void select(int selected) = 0;
+  virtual uint8_t transfer(uint8_t value) = 0;
+};
+
+ReplaySpiDevice * replaySpi = nullptr;
+int replayPins[64];
+
+inline void pinMode(int, int){
+}
+
+inline void digitalWrite(int pin, int value){
+  replayPins[pin & 63] = value;
+  if(replaySpi && pin == replaySpi->csPin){
+    replaySpi->select(value == LOW);
+  }
+}
+
+// Inputs read HIGH: the push button (INPUT_PULLUP) is never pressed
+inline int digitalRead(int){
+  return HIGH;
+}
+
+inline int digitalPinToInterrupt(int pin){
+  return pin;
+}
+
+inline void attachInterrupt(int, void (*)(), int){
+}
+
+inline void detachInterrupt(int){
+}
+
+inline void noInterrupts(){
+}
+
+inline void interrupts(){
+}
+
+class Print {
+public:
+  virtual size_t write(uint8_t) = 0;
+  virtual size_t write(const uint8_t * buffer, size_t size){
+    for(size_t i = 0; i < size; i++){
+      write(buffer[i]);
+    }
+    return size;
+  };
+  size_t write(const char * s){
+    return write((const uint8_t *)s, strlen(s));
+  };
+  virtual int availableForWrite(){
+    return 0;
+  };
+  virtual void flush(){
+  };
+
+  size_t print(const char * s){
+    return write(s);
+  };
+  size_t print(char c){
+    return write((uint8_t)c);
+  };
+  size_t print(long long value, int base = DEC){
+    char text[24];
+    snprintf(text, sizeof(text), base == HEX ? "%llX" : "%lld", value);
+    return write(text);
+  };
+  size_t print(int value, int base = DEC){
+    return print((long long)value, base);
+  };
+  size_t print(unsigned value, int base = DEC){
+    return print((long long)value, base);
+  };
+  size_t print(long value, int base = DEC){
+    return print((long long)value, base);
+  };
+  size_t print(unsigned long value, int base = DEC){
+    return print((long long)value, base);
+  };
+  size_t print(unsigned long long value, int base = DEC){
+    return print((long long)value, base);
+  };
+  size_t print(unsigned char value, int base = DEC){
+    return print((long long)value, base);
+  };
+  size_t print(double value, int = 2){
+    char text[32];
+    snprintf(text, sizeof(text), "%.2f", value);
+    return write(text);
+  };
+  size_t println(){
+    return write("\r\n");
+  };
+  template<typename T> size_t println(T value){
+    return print(value) + println();
+  };
+  template<typename T> size_t println(T value, int base){
+    return print(value, base) + println();
+  };
+};
+
+class Stream : public Print {
+public:
+  virtual int available() = 0;
+  virtual int read() = 0;
+  virtual int peek() = 0;
+};
+
+// Console output of the sketch goes to stdout
+class ReplaySerial : public Stream {
+public:
+  operator bool(){
+    return true;
+  };
+  void begin(long){
+  };
+  int available(){
+    return 0;
+  };
+  int read(){
+    return -1;
+  };
+  int peek(){
+    return -1;
+  };
+  size_t write(uint8_t c){
+    return fputc(c, stdout) != EOF;
+  };
+  using Print::write;
+};
+
+ReplaySerial Serial;
+
+#endif
@@ -0,0 +1,2 @@
+// The sketch includes "Cli.h". On a case sensitive file system it is found here, and it is cli.h
+#include "../../cli.h"
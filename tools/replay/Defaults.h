@@ -0,0 +1,2 @@
+// The sketch includes "Defaults.h". On a case sensitive file system it is found here, and it is defaults.h
+#include "../../defaults.h"
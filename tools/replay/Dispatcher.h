@@ -0,0 +1,2 @@
+// The sketch includes "Dispatcher.h". On a case sensitive file system it is found here, and it is dispatcher.h
+#include "../../dispatcher.h"
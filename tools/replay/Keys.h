@@ -0,0 +1,2 @@
+// The sketch includes "Keys.h". On a case sensitive file system it is found here, and it is keys.h
+#include "../../keys.h"
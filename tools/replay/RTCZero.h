@@ -0,0 +1,16 @@
+#ifndef REPLAY_RTCZERO_H
+#define REPLAY_RTCZERO_H
+
+#include "Arduino.h"
+
+// Host stand-in for RTCZero: the epoch is the replay time, in seconds
+class RTCZero {
+public:
+  void begin(){
+  };
+  uint32_t getEpoch(){
+    return millis() / 1000;
+  };
+};
+
+#endif
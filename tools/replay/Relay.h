@@ -0,0 +1,2 @@
+// The sketch includes "Relay.h". On a case sensitive file system it is found here, and it is relay.h
+#include "../../relay.h"
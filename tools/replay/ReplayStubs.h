@@ -0,0 +1,179 @@
+#ifndef REPLAY_STUBS_H
+#define REPLAY_STUBS_H
+
+/*
+  Stand-ins for the parts of the sketch around the CBUS receive path, for tools/cbusreplay.cpp. Each one
+  defines the include guard of the header it replaces, so it's included before Actions.h:
+  - Logger.h: traces and info compile to nothing. Errors go to the replay log, in sequence.
+  - NVMStore.h: nothing in flash, so CBUSConfig::init imports the config file. Saves are kept in RAM.
+  - Relay.h, AudioBoard.h: calls go to the replay log. A track plays until it's stopped.
+  - Cli.h: not used by Actions.
+*/
+
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "Arduino.h"
+#include "Defaults.h"
+#include "Utils.h"
+
+// What the sketch did, in order. events: events done before the call, so the ones after it caused it
+typedef struct {
+  unsigned long events;
+  std::string text;
+} ReplayAction;
+
+std::vector<ReplayAction> replayLog;
+unsigned long (*replayEvents)() = nullptr;  // Set by the harness: the journal's total
+
+inline void replayRecord(const std::string & text){
+  ReplayAction action = { replayEvents ? replayEvents() : 0, text };
+  replayLog.push_back(action);
+}
+
+template<typename T> std::string replayText(T value){
+  std::ostringstream out;
+  out << value;
+  return out.str();
+}
+
+inline std::string replayText(unsigned char value){
+  return replayText((int)value);
+}
+
+inline std::string replayText(const char * value){
+  return value ? value : "";
+}
+
+#define _LOGGER_H
+
+class TraceLogger {
+};
+
+class InfoLogger {
+};
+
+class FileLogger {
+public:
+  unsigned long errors = 0;
+
+  void log(const char * module, const char * msg){
+    errors++;
+    replayRecord(std::string("error ") + module + ": " + msg);
+  };
+
+  template<typename T> void log(const char * module, const char * msg, T value){
+    errors++;
+    replayRecord(std::string("error ") + module + ": " + msg + replayText(value));
+  };
+};
+
+#define LOG_TRACE(module, msg, ...)     do { } while(0)
+#define LOG_TRACE_HEX(module, msg, ...) do { } while(0)
+#define LOG_INFO(module, msg, ...)      do { } while(0)
+#define LOG_ERROR(module, msg, ...)     error.log(#module, msg, ##__VA_ARGS__)
+
+#define NVM_STORE_H
+
+template<typename T, unsigned int SLOTS>
+class NVMStore {
+  T saved;
+  int valid = 0;
+
+public:
+  unsigned long saves = 0;
+
+  int begin(){
+    return 1;
+  };
+
+  int load(T & data){
+    if(valid){
+      data = saved;
+    }
+    return valid;
+  };
+
+  int save(const T & data){
+    saved = data;
+    valid = 1;
+    saves++;
+    return 1;
+  };
+};
+
+#define _RELAY_H
+
+class Relay {
+  int state = 0;
+
+public:
+  void init(){
+    off();
+  };
+
+  int isOn(){
+    return state;
+  };
+
+  void on(){
+    state = 1;
+    replayRecord("relay on");
+  };
+
+  void off(){
+    state = 0;
+    replayRecord("relay off");
+  };
+};
+
+#define AUDIO_PRINTER_H
+
+// Handles are indexes in tracks, given out by find (the track resolver): every track is on the "SD card"
+class AudioBoard {
+  std::vector<std::string> tracks;
+  int playing = -1;
+
+  std::string name(int handle){
+    return handle >= 0 && handle < (int)tracks.size() ? tracks[handle] : "(missing track)";
+  };
+
+public:
+  int find(const char * track){
+    for(size_t i = 0; i < tracks.size(); i++){
+      if(tracks[i] == track){
+        return i;
+      }
+    }
+    tracks.push_back(track);
+    return tracks.size() - 1;
+  };
+
+  void play(int handle, int priority = 0){
+    replayRecord("audio play " + name(handle) + " (priority " + replayText(priority) + ")");
+    if(handle >= 0){
+      playing = handle;
+    }
+  };
+
+  void stopTrack(int handle){
+    replayRecord("audio stop " + name(handle));
+    if(handle == playing){
+      playing = -1;
+    }
+  };
+
+  void stopPlaying(){
+    replayRecord("audio stop all");
+    playing = -1;
+  };
+
+  int isPlaying(){
+    return playing >= 0;
+  };
+};
+
+#define CLI_H
+
+#endif
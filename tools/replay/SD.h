@@ -0,0 +1,122 @@
+#ifndef REPLAY_SD_H
+#define REPLAY_SD_H
+
+#include "Arduino.h"
+
+/*
+  Host stand-in for the SD library: files are host files, paths relative to the current directory.
+  The configuration file is read through it, and the journal could be written.
+*/
+
+#define FILE_READ 0
+#define FILE_WRITE 1
+
+class File : public Stream {
+  FILE * f;
+
+public:
+  File(FILE * f = nullptr) : f(f) {
+  };
+
+  operator bool(){
+    return f != nullptr;
+  };
+
+  int available(){
+    if(!f){
+      return 0;
+    }
+    long position = ftell(f);
+    fseek(f, 0, SEEK_END);
+    long end = ftell(f);
+    fseek(f, position, SEEK_SET);
+    return (int)(end - position);
+  };
+
+  int read(){
+    return f ? fgetc(f) : -1;
+  };
+
+  int read(void * buffer, size_t size){
+    return f ? (int)fread(buffer, 1, size, f) : -1;
+  };
+
+  int peek(){
+    if(!f){
+      return -1;
+    }
+    int c = fgetc(f);
+    if(c != EOF){
+      ungetc(c, f);
+    }
+    return c;
+  };
+
+  size_t write(uint8_t c){
+    return f && fputc(c, f) != EOF;
+  };
+
+  size_t write(const uint8_t * buffer, size_t size){
+    return f ? fwrite(buffer, 1, size, f) : 0;
+  };
+
+  using Print::write;
+
+  bool seek(uint32_t position){
+    return f && fseek(f, position, SEEK_SET) == 0;
+  };
+
+  uint32_t position(){
+    return f ? ftell(f) : 0;
+  };
+
+  uint32_t size(){
+    if(!f){
+      return 0;
+    }
+    long position = ftell(f);
+    fseek(f, 0, SEEK_END);
+    long end = ftell(f);
+    fseek(f, position, SEEK_SET);
+    return end;
+  };
+
+  void flush(){
+    if(f){
+      fflush(f);
+    }
+  };
+
+  void close(){
+    if(f){
+      fclose(f);
+      f = nullptr;
+    }
+  };
+};
+
+class SDClass {
+public:
+  bool begin(int){
+    return true;
+  };
+  File open(const char * path, int mode = FILE_READ){
+    return File(fopen(path, mode == FILE_WRITE ? "ab+" : "rb"));
+  };
+  bool exists(const char * path){
+    File f = open(path);
+    int found = f;
+    f.close();
+    return found;
+  };
+  bool remove(const char * path){
+    return ::remove(path) == 0;
+  };
+  bool mkdir(const char *){
+    return true;
+  };
+};
+
+SDClass SD;
+
+#endif
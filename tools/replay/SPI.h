@@ -0,0 +1,34 @@
+#ifndef REPLAY_SPI_H
+#define REPLAY_SPI_H
+
+#include "Arduino.h"
+
+// Host stand-in for the SPI library: transfers go to the device selected (replaySpi)
+
+#define MSBFIRST 1
+#define SPI_MODE0 0
+
+class SPISettings {
+public:
+  SPISettings(unsigned long, int, int){
+  };
+};
+
+class SPIClass {
+public:
+  void begin(){
+  };
+  void beginTransaction(const SPISettings &){
+  };
+  void endTransaction(){
+  };
+  void usingInterrupt(int){
+  };
+  uint8_t transfer(uint8_t value){
+    return replaySpi ? replaySpi->transfer(value) : 0;
+  };
+};
+
+SPIClass SPI;
+
+#endif
@@ -0,0 +1,2 @@
+// Print and Stream are in the Arduino.h stand-in
+#include "Arduino.h"
@@ -0,0 +1,2 @@
+// The sketch includes "Utils.h". On a case sensitive file system it is found here, and it is utils.h
+#include "../../utils.h"
@@ -22,7 +22,7 @@ public:
     delay(time);   
   }
 
-  static void dumpHex(Stream * out, const void * data, size_t size){
+  static void dumpHex(Print * out, const void * data, size_t size){
     char ascii[17];
     ascii[16] = '\0'; // Null-terminate the ASCII buffer
     size_t i, j;